@@ -0,0 +1,313 @@
+
+/* glyph_blending.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Fixed-point kernels for blending glyph coverage values into r/g/b
+// pixels. Every output value is evaluated as
+//   (background * (255 - coverage) + foreground * coverage) / 255
+// using integer arithmetic only. On x86 CPUs SSE2 and AVX2 variants are
+// selected at runtime by init_glyph_blending(), all other platforms use
+// the scalar functions.
+
+#include "glyph_blending.h"
+#include "tools/tracelog.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GLYPH_BLENDING_X86
+#include <immintrin.h>
+#endif
+
+
+static inline uint8_t blend_value(uint8_t foreground, uint8_t background,
+    uint8_t coverage) {
+  unsigned int value
+    = background * (255 - coverage) + foreground * coverage + 128;
+
+  // Rounded division by 255.
+  return (value + (value >> 8)) >> 8;
+}
+
+
+static void blend_gray_row_scalar(const uint8_t *coverage, int nof_pixels,
+    uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background) {
+  int i;
+
+  for (i=0; i<nof_pixels; i++) {
+    *(rgb_output++) = blend_value(foreground[0], background[0], coverage[i]);
+    *(rgb_output++) = blend_value(foreground[1], background[1], coverage[i]);
+    *(rgb_output++) = blend_value(foreground[2], background[2], coverage[i]);
+  }
+}
+
+
+static void blend_lcd_row_scalar(const uint8_t *coverage, int nof_pixels,
+    uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background) {
+  int i;
+
+  for (i=0; i<nof_pixels; i++) {
+    *(rgb_output++) = blend_value(foreground[0], background[0], *(coverage++));
+    *(rgb_output++) = blend_value(foreground[1], background[1], *(coverage++));
+    *(rgb_output++) = blend_value(foreground[2], background[2], *(coverage++));
+  }
+}
+
+
+#ifdef GLYPH_BLENDING_X86
+
+// For LCD bitmaps the subpixel values are blended directly in their
+// r/g/b order, so every vector lane needs the colour of the channel it
+// is working on. Since the vector sizes are not divisible by 3, the lane
+// pattern depends on the vector's offset in the row. This fills
+// "nof_vectors" consecutive vectors of "nof_lanes" lanes each.
+static void fill_channel_pattern(uint16_t *dest, int nof_vectors,
+    int nof_lanes, const uint8_t *colour) {
+  int i;
+
+  for (i=0; i<nof_vectors*nof_lanes; i++) {
+    dest[i] = colour[i % 3];
+  }
+}
+
+
+__attribute__((target("sse2")))
+static inline __m128i blend_epi16_sse2(__m128i coverage, __m128i foreground,
+    __m128i background) {
+  __m128i value;
+
+  value = _mm_add_epi16(
+      _mm_mullo_epi16(background,
+        _mm_sub_epi16(_mm_set1_epi16(255), coverage)),
+      _mm_mullo_epi16(foreground, coverage));
+  value = _mm_add_epi16(value, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(value, _mm_srli_epi16(value, 8)), 8);
+}
+
+
+__attribute__((target("sse2")))
+static void blend_gray_row_sse2(const uint8_t *coverage, int nof_pixels,
+    uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i fg_r = _mm_set1_epi16(foreground[0]);
+  __m128i fg_g = _mm_set1_epi16(foreground[1]);
+  __m128i fg_b = _mm_set1_epi16(foreground[2]);
+  __m128i bg_r = _mm_set1_epi16(background[0]);
+  __m128i bg_g = _mm_set1_epi16(background[1]);
+  __m128i bg_b = _mm_set1_epi16(background[2]);
+  __m128i alpha;
+  uint8_t channels[32];
+  int i, j;
+
+  for (i=0; i+8<=nof_pixels; i+=8) {
+    alpha = _mm_unpacklo_epi8(
+        _mm_loadl_epi64((const __m128i*)(coverage + i)), zero);
+
+    _mm_storeu_si128((__m128i*)channels,
+        _mm_packus_epi16(
+          blend_epi16_sse2(alpha, fg_r, bg_r),
+          blend_epi16_sse2(alpha, fg_g, bg_g)));
+    _mm_storeu_si128((__m128i*)(channels + 16),
+        _mm_packus_epi16(blend_epi16_sse2(alpha, fg_b, bg_b), zero));
+
+    for (j=0; j<8; j++) {
+      *(rgb_output++) = channels[j];
+      *(rgb_output++) = channels[j + 8];
+      *(rgb_output++) = channels[j + 16];
+    }
+  }
+
+  blend_gray_row_scalar(coverage + i, nof_pixels - i, rgb_output,
+      foreground, background);
+}
+
+
+__attribute__((target("sse2")))
+static void blend_lcd_row_sse2(const uint8_t *coverage, int nof_pixels,
+    uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i fg[3], bg[3], alpha;
+  uint16_t fg_pattern[24], bg_pattern[24];
+  int nof_values = nof_pixels * 3;
+  int i, k;
+
+  // 24 subpixel values -- three vectors of eight lanes -- form a block
+  // which starts with a red value again.
+  fill_channel_pattern(fg_pattern, 3, 8, foreground);
+  fill_channel_pattern(bg_pattern, 3, 8, background);
+  for (k=0; k<3; k++) {
+    fg[k] = _mm_loadu_si128((const __m128i*)(fg_pattern + k*8));
+    bg[k] = _mm_loadu_si128((const __m128i*)(bg_pattern + k*8));
+  }
+
+  for (i=0; i+24<=nof_values; i+=24) {
+    for (k=0; k<3; k++) {
+      alpha = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i*)(coverage + i + k*8)), zero);
+      _mm_storel_epi64((__m128i*)(rgb_output + i + k*8),
+          _mm_packus_epi16(blend_epi16_sse2(alpha, fg[k], bg[k]), zero));
+    }
+  }
+
+  blend_lcd_row_scalar(coverage + i, (nof_values - i) / 3, rgb_output + i,
+      foreground, background);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i blend_epi16_avx2(__m256i coverage, __m256i foreground,
+    __m256i background) {
+  __m256i value;
+
+  value = _mm256_add_epi16(
+      _mm256_mullo_epi16(background,
+        _mm256_sub_epi16(_mm256_set1_epi16(255), coverage)),
+      _mm256_mullo_epi16(foreground, coverage));
+  value = _mm256_add_epi16(value, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(
+      _mm256_add_epi16(value, _mm256_srli_epi16(value, 8)), 8);
+}
+
+
+// _mm256_packus_epi16 packs within 128-bit lanes, this restores the order
+// of the 16-bit input values.
+__attribute__((target("avx2")))
+static inline __m256i pack_epi16_avx2(__m256i low, __m256i high) {
+  return _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+
+__attribute__((target("avx2")))
+static void blend_gray_row_avx2(const uint8_t *coverage, int nof_pixels,
+    uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i fg_r = _mm256_set1_epi16(foreground[0]);
+  __m256i fg_g = _mm256_set1_epi16(foreground[1]);
+  __m256i fg_b = _mm256_set1_epi16(foreground[2]);
+  __m256i bg_r = _mm256_set1_epi16(background[0]);
+  __m256i bg_g = _mm256_set1_epi16(background[1]);
+  __m256i bg_b = _mm256_set1_epi16(background[2]);
+  __m256i alpha;
+  uint8_t channels[64];
+  int i, j;
+
+  for (i=0; i+16<=nof_pixels; i+=16) {
+    alpha = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128((const __m128i*)(coverage + i)));
+
+    _mm256_storeu_si256((__m256i*)channels,
+        pack_epi16_avx2(
+          blend_epi16_avx2(alpha, fg_r, bg_r),
+          blend_epi16_avx2(alpha, fg_g, bg_g)));
+    _mm256_storeu_si256((__m256i*)(channels + 32),
+        pack_epi16_avx2(blend_epi16_avx2(alpha, fg_b, bg_b), zero));
+
+    for (j=0; j<16; j++) {
+      *(rgb_output++) = channels[j];
+      *(rgb_output++) = channels[j + 16];
+      *(rgb_output++) = channels[j + 32];
+    }
+  }
+
+  blend_gray_row_scalar(coverage + i, nof_pixels - i, rgb_output,
+      foreground, background);
+}
+
+
+__attribute__((target("avx2")))
+static void blend_lcd_row_avx2(const uint8_t *coverage, int nof_pixels,
+    uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i fg[3], bg[3], alpha;
+  uint16_t fg_pattern[48], bg_pattern[48];
+  int nof_values = nof_pixels * 3;
+  int i, k;
+
+  // Blocks of 48 subpixel values -- three vectors of 16 lanes.
+  fill_channel_pattern(fg_pattern, 3, 16, foreground);
+  fill_channel_pattern(bg_pattern, 3, 16, background);
+  for (k=0; k<3; k++) {
+    fg[k] = _mm256_loadu_si256((const __m256i*)(fg_pattern + k*16));
+    bg[k] = _mm256_loadu_si256((const __m256i*)(bg_pattern + k*16));
+  }
+
+  for (i=0; i+48<=nof_values; i+=48) {
+    for (k=0; k<3; k++) {
+      alpha = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i*)(coverage + i + k*16)));
+      _mm_storeu_si128((__m128i*)(rgb_output + i + k*16),
+          _mm256_castsi256_si128(
+            pack_epi16_avx2(blend_epi16_avx2(alpha, fg[k], bg[k]), zero)));
+    }
+  }
+
+  blend_lcd_row_scalar(coverage + i, (nof_values - i) / 3, rgb_output + i,
+      foreground, background);
+}
+
+#endif // GLYPH_BLENDING_X86
+
+
+gray_row_blend_function blend_gray_row = &blend_gray_row_scalar;
+lcd_row_blend_function blend_lcd_row = &blend_lcd_row_scalar;
+
+
+void init_glyph_blending() {
+#ifdef GLYPH_BLENDING_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    TRACE_LOG("Using AVX2 glyph blending.\n");
+    blend_gray_row = &blend_gray_row_avx2;
+    blend_lcd_row = &blend_lcd_row_avx2;
+    return;
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    TRACE_LOG("Using SSE2 glyph blending.\n");
+    blend_gray_row = &blend_gray_row_sse2;
+    blend_lcd_row = &blend_lcd_row_sse2;
+    return;
+  }
+#endif // GLYPH_BLENDING_X86
+
+  TRACE_LOG("Using scalar glyph blending.\n");
+  blend_gray_row = &blend_gray_row_scalar;
+  blend_lcd_row = &blend_lcd_row_scalar;
+}
+
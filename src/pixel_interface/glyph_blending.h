@@ -0,0 +1,59 @@
+
+/* glyph_blending.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef glyph_blending_h_INCLUDED
+#define glyph_blending_h_INCLUDED
+
+#include "tools/types.h"
+
+// Blends nof_pixels coverage values from "coverage" into nof_pixels r/g/b
+// triplets at "rgb_output", using the foreground and background colours
+// given as r/g/b triplets.
+typedef void (*gray_row_blend_function)(const uint8_t *coverage,
+    int nof_pixels, uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background);
+
+// Same as above for LCD bitmaps, where "coverage" contains one value per
+// subpixel, so nof_pixels * 3 values are read.
+typedef void (*lcd_row_blend_function)(const uint8_t *coverage,
+    int nof_pixels, uint8_t *rgb_output, const uint8_t *foreground,
+    const uint8_t *background);
+
+extern gray_row_blend_function blend_gray_row;
+extern lcd_row_blend_function blend_lcd_row;
+
+void init_glyph_blending();
+
+#endif // glyph_blending_h_INCLUDED
+
@@ -0,0 +1,259 @@
+
+/* history_line_index.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// The paragraphs are numbered in the order they were appended, starting
+// at zero. Since paragraphs are only removed from the top, the index
+// keeps the line counts of removed paragraphs at zero and the paragraphs
+// in use are first_paragraph..end_paragraph-1. Once the tree is full, the
+// paragraphs still in use are moved to its front.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "history_line_index.h"
+#include "tools/tracelog.h"
+#include "interpreter/fizmo.h"
+
+static long *line_tree = NULL; // Fenwick tree, 1-based
+static int *paragraph_lines = NULL;
+static long index_size = 0; // always a power of two
+static long first_paragraph = 0;
+static long end_paragraph = 0;
+static long total_lines = 0;
+
+
+static void add_to_line_tree(long paragraph, long delta) {
+  long i;
+
+  for (i=paragraph+1; i<=index_size; i+=(i & -i)) {
+    line_tree[i] += delta;
+  }
+}
+
+
+// Returns the number of lines in paragraphs 0..end-1.
+static long get_line_tree_prefix(long end) {
+  long i, result = 0;
+
+  for (i=end; i>0; i-=(i & -i)) {
+    result += line_tree[i];
+  }
+
+  return result;
+}
+
+
+static void rebuild_history_line_index(long new_size) {
+  long nof_paragraphs = end_paragraph - first_paragraph;
+  long i, parent;
+
+  if (nof_paragraphs > 0) {
+    memmove(paragraph_lines, paragraph_lines + first_paragraph,
+        nof_paragraphs * sizeof(int));
+  }
+
+  if (new_size != index_size) {
+    paragraph_lines = fizmo_realloc(paragraph_lines, new_size * sizeof(int));
+    line_tree = fizmo_realloc(line_tree, (new_size + 1) * sizeof(long));
+    index_size = new_size;
+  }
+
+  first_paragraph = 0;
+  end_paragraph = nof_paragraphs;
+
+  // Linear time construction: Every node passes its sum to its parent.
+  memset(line_tree, 0, (index_size + 1) * sizeof(long));
+  for (i=1; i<=index_size; i++) {
+    if (i <= end_paragraph) {
+      line_tree[i] += paragraph_lines[i - 1];
+    }
+    if ((parent = i + (i & -i)) <= index_size) {
+      line_tree[parent] += line_tree[i];
+    }
+  }
+
+  TRACE_LOG("Rebuilt history line index with %ld paragraphs, size %ld.\n",
+      nof_paragraphs, index_size);
+}
+
+
+void reset_history_line_index() {
+  first_paragraph = 0;
+  end_paragraph = 0;
+  total_lines = 0;
+  if (line_tree != NULL) {
+    memset(line_tree, 0, (index_size + 1) * sizeof(long));
+  }
+}
+
+
+void append_history_line_index_paragraph(int nof_lines) {
+  long nof_paragraphs = end_paragraph - first_paragraph;
+
+  if (end_paragraph == index_size) {
+    rebuild_history_line_index(
+        nof_paragraphs * 2 >= index_size
+        ? (index_size > 0 ? index_size * 2 : 1024)
+        : index_size);
+  }
+
+  paragraph_lines[end_paragraph] = nof_lines;
+  add_to_line_tree(end_paragraph, nof_lines);
+  end_paragraph++;
+  total_lines += nof_lines;
+}
+
+
+void remove_history_line_index_paragraph() {
+  if (first_paragraph == end_paragraph) {
+    return;
+  }
+
+  add_to_line_tree(first_paragraph, -paragraph_lines[first_paragraph]);
+  total_lines -= paragraph_lines[first_paragraph];
+  paragraph_lines[first_paragraph] = 0;
+  first_paragraph++;
+}
+
+
+void set_history_line_index_paragraph(long paragraph, int nof_lines) {
+  long index = first_paragraph + paragraph;
+
+  if ( (paragraph < 0) || (index >= end_paragraph) ) {
+    return;
+  }
+
+  add_to_line_tree(index, nof_lines - paragraph_lines[index]);
+  total_lines += nof_lines - paragraph_lines[index];
+  paragraph_lines[index] = nof_lines;
+}
+
+
+void truncate_history_line_index(long nof_paragraphs) {
+  if (nof_paragraphs < 0) {
+    nof_paragraphs = 0;
+  }
+
+  while (end_paragraph - first_paragraph > nof_paragraphs) {
+    end_paragraph--;
+    add_to_line_tree(end_paragraph, -paragraph_lines[end_paragraph]);
+    total_lines -= paragraph_lines[end_paragraph];
+    paragraph_lines[end_paragraph] = 0;
+  }
+}
+
+
+long get_history_line_index_nof_paragraphs() {
+  return end_paragraph - first_paragraph;
+}
+
+
+long get_history_line_index_nof_lines() {
+  return total_lines;
+}
+
+
+long get_history_line_index_lines_above(long nof_paragraphs) {
+  if (nof_paragraphs <= 0) {
+    return 0;
+  }
+  else if (nof_paragraphs >= end_paragraph - first_paragraph) {
+    return total_lines;
+  }
+
+  return get_line_tree_prefix(first_paragraph + nof_paragraphs);
+}
+
+
+long get_history_line_index_lines_below(long nof_paragraphs) {
+  if (nof_paragraphs >= end_paragraph - first_paragraph) {
+    return total_lines;
+  }
+  else if (nof_paragraphs <= 0) {
+    return 0;
+  }
+
+  return total_lines - get_line_tree_prefix(end_paragraph - nof_paragraphs);
+}
+
+
+long find_history_line_index_paragraphs_below(long nof_lines) {
+  long lines_above = total_lines - nof_lines;
+  long position = 0, step;
+
+  if (nof_lines <= 0) {
+    return 0;
+  }
+  else if (lines_above < 0) {
+    return end_paragraph - first_paragraph;
+  }
+
+  // Find the largest position whose prefix doesn't exceed lines_above.
+  // Since every paragraph in use has at least one line, the paragraphs
+  // from that position on contain at least nof_lines lines.
+  for (step=index_size; step>0; step>>=1) {
+    if ( (position + step <= index_size)
+        && (line_tree[position + step] <= lines_above) ) {
+      position += step;
+      lines_above -= line_tree[position];
+    }
+  }
+
+  if (position > end_paragraph) {
+    position = end_paragraph;
+  }
+  else if (position < first_paragraph) {
+    position = first_paragraph;
+  }
+
+  return end_paragraph - position;
+}
+
+
+void free_history_line_index() {
+  if (line_tree != NULL) {
+    free(line_tree);
+    line_tree = NULL;
+  }
+  if (paragraph_lines != NULL) {
+    free(paragraph_lines);
+    paragraph_lines = NULL;
+  }
+  index_size = 0;
+  first_paragraph = 0;
+  end_paragraph = 0;
+  total_lines = 0;
+}
+
@@ -0,0 +1,77 @@
+
+/* history_line_index.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef history_line_index_h_INCLUDED
+#define history_line_index_h_INCLUDED
+
+#include "tools/types.h"
+
+// Keeps the number of lines of every paragraph in window 0's history in
+// a Fenwick tree, so that the number of lines above or below a paragraph
+// and the paragraph containing a given line can be found without walking
+// the history. Paragraphs are appended at the bottom and removed from the
+// top, in the same order as libfizmo stores and discards them.
+
+void reset_history_line_index();
+void append_history_line_index_paragraph(int nof_lines);
+void remove_history_line_index_paragraph();
+
+// Replaces the line count of a paragraph, counted from the top.
+void set_history_line_index_paragraph(long paragraph, int nof_lines);
+
+// Removes all but the nof_paragraphs topmost paragraphs.
+void truncate_history_line_index(long nof_paragraphs);
+
+// Returns the number of paragraphs in the index.
+long get_history_line_index_nof_paragraphs();
+
+// Returns the sum of the lines of all paragraphs.
+long get_history_line_index_nof_lines();
+
+// Returns the number of lines of the nof_paragraphs topmost paragraphs.
+long get_history_line_index_lines_above(long nof_paragraphs);
+
+// Returns the number of lines of the nof_paragraphs bottommost paragraphs.
+long get_history_line_index_lines_below(long nof_paragraphs);
+
+// Returns the smallest number of paragraphs, counted from the bottom,
+// which contain at least nof_lines lines. In case the whole history
+// contains fewer lines, the number of all paragraphs is returned.
+long find_history_line_index_paragraphs_below(long nof_lines);
+
+void free_history_line_index();
+
+#endif // history_line_index_h_INCLUDED
+
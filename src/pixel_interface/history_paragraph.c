@@ -0,0 +1,139 @@
+
+/* history_paragraph.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Paragraphs are recorded while being replayed from the output history so
+// their layout can be looked up in the line break cache before deciding
+// whether they have to be sent through the wordwrapper at all.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "history_paragraph.h"
+#include "tools/tracelog.h"
+#include "interpreter/fizmo.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+
+static inline uint32_t add_to_hash(uint32_t hash, uint32_t value) {
+  return (hash ^ value) * FNV_PRIME;
+}
+
+
+void init_history_paragraph(history_paragraph *paragraph) {
+  paragraph->text = NULL;
+  paragraph->text_length = 0;
+  paragraph->text_size = 0;
+  paragraph->events = NULL;
+  paragraph->nof_events = 0;
+  paragraph->events_size = 0;
+  paragraph->hash = FNV_OFFSET_BASIS;
+  paragraph->start_style = 0;
+  paragraph->start_font = 0;
+}
+
+
+void reset_history_paragraph(history_paragraph *paragraph,
+    z_style start_style, z_font start_font) {
+  paragraph->text_length = 0;
+  paragraph->nof_events = 0;
+  paragraph->start_style = start_style;
+  paragraph->start_font = start_font;
+  paragraph->hash = add_to_hash(
+      add_to_hash(FNV_OFFSET_BASIS, start_style), start_font);
+}
+
+
+void add_history_paragraph_text(history_paragraph *paragraph,
+    const z_ucs *text, size_t len) {
+  size_t i;
+
+  if (paragraph->text_length + (long)len > paragraph->text_size) {
+    paragraph->text_size
+      = paragraph->text_size > 0 ? paragraph->text_size : 1024;
+    while (paragraph->text_length + (long)len > paragraph->text_size) {
+      paragraph->text_size *= 2;
+    }
+    paragraph->text = fizmo_realloc(
+        paragraph->text, paragraph->text_size * sizeof(z_ucs));
+  }
+
+  for (i=0; i<len; i++) {
+    paragraph->hash = add_to_hash(paragraph->hash, text[i]);
+  }
+
+  memcpy(paragraph->text + paragraph->text_length, text, len * sizeof(z_ucs));
+  paragraph->text_length += len;
+}
+
+
+void add_history_paragraph_event(history_paragraph *paragraph, int type,
+    int32_t parameter1, int32_t parameter2, int32_t parameter3) {
+  history_paragraph_event *event;
+
+  if (paragraph->nof_events == paragraph->events_size) {
+    paragraph->events_size
+      = paragraph->events_size > 0 ? paragraph->events_size * 2 : 32;
+    paragraph->events = fizmo_realloc(
+        paragraph->events,
+        paragraph->events_size * sizeof(history_paragraph_event));
+  }
+
+  event = &paragraph->events[paragraph->nof_events++];
+  event->position = paragraph->text_length;
+  event->type = type;
+  event->parameter1 = parameter1;
+  event->parameter2 = parameter2;
+  event->parameter3 = parameter3;
+
+  // Since the hash covers the text as well, the event's position is
+  // implicitly included.
+  paragraph->hash = add_to_hash(paragraph->hash, 0x80000000u | type);
+  paragraph->hash = add_to_hash(paragraph->hash, (uint32_t)parameter1);
+  paragraph->hash = add_to_hash(paragraph->hash, (uint32_t)parameter2);
+  paragraph->hash = add_to_hash(paragraph->hash, (uint32_t)parameter3);
+}
+
+
+void free_history_paragraph(history_paragraph *paragraph) {
+  if (paragraph->text != NULL) {
+    free(paragraph->text);
+  }
+  if (paragraph->events != NULL) {
+    free(paragraph->events);
+  }
+  init_history_paragraph(paragraph);
+}
+
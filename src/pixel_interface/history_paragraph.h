@@ -0,0 +1,82 @@
+
+/* history_paragraph.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef history_paragraph_h_INCLUDED
+#define history_paragraph_h_INCLUDED
+
+#include "tools/types.h"
+
+#define HISTORY_PARAGRAPH_TEXT_STYLE 0
+#define HISTORY_PARAGRAPH_COLOUR 1
+#define HISTORY_PARAGRAPH_FONT 2
+#define HISTORY_PARAGRAPH_LINE_END 3
+
+// An event occuring in front of the char at "position" in the paragraph's
+// text. For HISTORY_PARAGRAPH_COLOUR parameter1 and parameter2 contain the
+// foreground and background colours and parameter3 the window number, the
+// other event types only use parameter1.
+typedef struct history_paragraph_event_struct {
+  long position;
+  int type;
+  int32_t parameter1;
+  int32_t parameter2;
+  int32_t parameter3;
+} history_paragraph_event;
+
+// A paragraph as replayed from the output history, containing the text and
+// all style, colour and font changes. "hash" identifies the paragraph's
+// contents together with the style and font in effect at its start.
+typedef struct history_paragraph_struct {
+  z_ucs *text;
+  long text_length;
+  long text_size;
+  history_paragraph_event *events;
+  int nof_events;
+  int events_size;
+  uint32_t hash;
+  z_style start_style;
+  z_font start_font;
+} history_paragraph;
+
+void init_history_paragraph(history_paragraph *paragraph);
+void reset_history_paragraph(history_paragraph *paragraph,
+    z_style start_style, z_font start_font);
+void add_history_paragraph_text(history_paragraph *paragraph,
+    const z_ucs *text, size_t len);
+void add_history_paragraph_event(history_paragraph *paragraph, int type,
+    int32_t parameter1, int32_t parameter2, int32_t parameter3);
+void free_history_paragraph(history_paragraph *paragraph);
+
+#endif // history_paragraph_h_INCLUDED
+
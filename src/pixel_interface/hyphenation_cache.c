@@ -0,0 +1,156 @@
+
+/* hyphenation_cache.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Hyphenating a word using libfizmo's hyphenate() requires a pattern search
+// and a newly allocated result each time. Since the same words are wrapped
+// over and over again when the history is remeasured, the results are kept
+// in a direct-mapped cache. Only the hyphenated words are stored, since the
+// original word is obtained by skipping the soft hyphens.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hyphenation_cache.h"
+#include "tools/tracelog.h"
+#include "tools/z_ucs.h"
+#include "tools/i18n.h"
+#include "interpreter/hyphenation.h"
+#include "interpreter/fizmo.h"
+
+static z_ucs *hyphenation_cache[HYPHENATION_CACHE_SIZE];
+static z_ucs *hyphenation_cache_locale_name = NULL;
+
+
+static void clear_hyphenation_cache() {
+  int i;
+
+  for (i=0; i<HYPHENATION_CACHE_SIZE; i++) {
+    if (hyphenation_cache[i] != NULL) {
+      free(hyphenation_cache[i]);
+      hyphenation_cache[i] = NULL;
+    }
+  }
+}
+
+
+static unsigned int hyphenation_cache_index(z_ucs *word) {
+  uint32_t hash = 5381;
+
+  while (*word != 0) {
+    hash = ((hash << 5) + hash) ^ *word;
+    word++;
+  }
+
+  return hash & (HYPHENATION_CACHE_SIZE - 1);
+}
+
+
+// Returns true in case "hyphenated_word" equals "word" when ignoring all
+// soft hyphens.
+static bool matches_hyphenated_word(z_ucs *word, z_ucs *hyphenated_word) {
+  while (*hyphenated_word != 0) {
+    if (*hyphenated_word != Z_UCS_SOFT_HYPEN) {
+      if (*hyphenated_word != *word) {
+        return false;
+      }
+      word++;
+    }
+    hyphenated_word++;
+  }
+
+  return *word == 0;
+}
+
+
+static z_ucs *get_hyphenated_word(z_ucs *word) {
+  z_ucs *locale_name = get_current_locale_name();
+  z_ucs **entry;
+
+  if ( ((hyphenation_cache_locale_name == NULL) != (locale_name == NULL))
+      || ( (locale_name != NULL)
+        && (z_ucs_cmp(hyphenation_cache_locale_name, locale_name) != 0) ) ) {
+    TRACE_LOG("Locale changed, clearing hyphenation cache.\n");
+    clear_hyphenation_cache();
+    if (hyphenation_cache_locale_name != NULL) {
+      free(hyphenation_cache_locale_name);
+      hyphenation_cache_locale_name = NULL;
+    }
+    if (locale_name != NULL) {
+      hyphenation_cache_locale_name = z_ucs_dup(locale_name);
+    }
+  }
+
+  entry = &hyphenation_cache[hyphenation_cache_index(word)];
+
+  if ( (*entry != NULL) && (matches_hyphenated_word(word, *entry) == true) ) {
+    return *entry;
+  }
+
+  if (*entry != NULL) {
+    free(*entry);
+  }
+
+  *entry = hyphenate(word);
+
+  return *entry;
+}
+
+
+z_ucs *copy_hyphenated_word(z_ucs *word, z_ucs **buffer,
+    size_t *buffer_size) {
+  z_ucs *hyphenated_word;
+  size_t len;
+
+  if ((hyphenated_word = get_hyphenated_word(word)) != NULL) {
+    len = z_ucs_len(hyphenated_word) + 1;
+    if (len > *buffer_size) {
+      *buffer_size = len;
+      *buffer = fizmo_realloc(*buffer, len * sizeof(z_ucs));
+    }
+    memcpy(*buffer, hyphenated_word, len * sizeof(z_ucs));
+  }
+
+  return hyphenated_word != NULL ? *buffer : NULL;
+}
+
+
+void free_hyphenation_cache() {
+  clear_hyphenation_cache();
+
+  if (hyphenation_cache_locale_name != NULL) {
+    free(hyphenation_cache_locale_name);
+    hyphenation_cache_locale_name = NULL;
+  }
+}
+
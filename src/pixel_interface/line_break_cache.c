@@ -0,0 +1,234 @@
+
+/* line_break_cache.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Resizing the screen back and forth makes the history to be remeasured
+// at the same widths over and over again. This cache keeps the line breaks
+// found for each paragraph, so a paragraph which has already been wrapped
+// at a given line length with the same fonts doesn't have to go through
+// the wordwrapper again.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "line_break_cache.h"
+#include "tools/tracelog.h"
+#include "interpreter/fizmo.h"
+
+typedef struct line_break_cache_table_struct {
+  int line_length;
+  uint32_t font_configuration;
+  unsigned long last_use;
+  line_break_cache_entry *entries; // NULL for unused tables.
+} line_break_cache_table;
+
+// Paragraph texts are kept once per slot instead of once per entry, since
+// a paragraph maps to the same slot for every line length.
+typedef struct line_break_cache_text_struct {
+  z_ucs *text;
+  long text_length;
+  unsigned long generation;
+} line_break_cache_text;
+
+static line_break_cache_table line_break_cache[
+  LINE_BREAK_CACHE_MAX_LINE_LENGTHS];
+static line_break_cache_text *line_break_cache_texts = NULL;
+static unsigned long line_break_cache_use_counter = 0;
+static unsigned long line_break_cache_text_generation = 0;
+
+
+static void free_line_break_cache_table(line_break_cache_table *table) {
+  int i;
+
+  if (table->entries == NULL) {
+    return;
+  }
+
+  for (i=0; i<LINE_BREAK_CACHE_SIZE; i++) {
+    if (table->entries[i].breaks != NULL) {
+      free(table->entries[i].breaks);
+    }
+  }
+
+  free(table->entries);
+  table->entries = NULL;
+}
+
+
+static line_break_cache_table *find_line_break_cache_table(int line_length,
+    uint32_t font_configuration) {
+  int i;
+
+  for (i=0; i<LINE_BREAK_CACHE_MAX_LINE_LENGTHS; i++) {
+    if ( (line_break_cache[i].entries != NULL)
+        && (line_break_cache[i].line_length == line_length)
+        && (line_break_cache[i].font_configuration == font_configuration) ) {
+      line_break_cache[i].last_use = ++line_break_cache_use_counter;
+      return &line_break_cache[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+static bool is_slot_text(long index, const z_ucs *text, long text_length) {
+  return (line_break_cache_texts[index].text_length == text_length)
+    && ( (text_length == 0)
+        || (memcmp(line_break_cache_texts[index].text, text,
+            text_length * sizeof(z_ucs)) == 0) );
+}
+
+
+line_break_cache_entry *get_line_break_cache_entry(int line_length,
+    uint32_t font_configuration, uint32_t paragraph_hash, const z_ucs *text,
+    long text_length) {
+  line_break_cache_table *table;
+  line_break_cache_entry *entry;
+  long index;
+
+  if ((table = find_line_break_cache_table(
+          line_length, font_configuration)) == NULL) {
+    return NULL;
+  }
+
+  index = paragraph_hash & (LINE_BREAK_CACHE_SIZE - 1);
+  entry = &table->entries[index];
+
+  if ( (entry->breaks == NULL)
+      || (entry->paragraph_hash != paragraph_hash)
+      || (entry->text_generation != line_break_cache_texts[index].generation)
+      || (is_slot_text(index, text, text_length) == false) ) {
+    return NULL;
+  }
+
+  return entry;
+}
+
+
+line_break_cache_entry *store_line_break_cache_entry(int line_length,
+    uint32_t font_configuration, uint32_t paragraph_hash, const z_ucs *text,
+    long text_length, int nof_lines, line_break *breaks, int nof_breaks) {
+  line_break_cache_table *table;
+  line_break_cache_entry *entry;
+  line_break_cache_text *slot_text;
+  long index;
+  int i;
+
+  if (line_break_cache_texts == NULL) {
+    line_break_cache_texts = fizmo_malloc(
+        LINE_BREAK_CACHE_SIZE * sizeof(line_break_cache_text));
+    for (i=0; i<LINE_BREAK_CACHE_SIZE; i++) {
+      line_break_cache_texts[i].text = NULL;
+      line_break_cache_texts[i].text_length = -1;
+      line_break_cache_texts[i].generation = 0;
+    }
+  }
+
+  if ((table = find_line_break_cache_table(
+          line_length, font_configuration)) == NULL) {
+    // Replace the least recently used table.
+    table = &line_break_cache[0];
+    for (i=1; i<LINE_BREAK_CACHE_MAX_LINE_LENGTHS; i++) {
+      if (line_break_cache[i].entries == NULL) {
+        table = &line_break_cache[i];
+        break;
+      }
+      if (line_break_cache[i].last_use < table->last_use) {
+        table = &line_break_cache[i];
+      }
+    }
+
+    TRACE_LOG("Creating line break cache for line length %d.\n",
+        line_length);
+    free_line_break_cache_table(table);
+    table->entries = fizmo_malloc(
+        LINE_BREAK_CACHE_SIZE * sizeof(line_break_cache_entry));
+    for (i=0; i<LINE_BREAK_CACHE_SIZE; i++) {
+      table->entries[i].breaks = NULL;
+    }
+    table->line_length = line_length;
+    table->font_configuration = font_configuration;
+    table->last_use = ++line_break_cache_use_counter;
+  }
+
+  index = paragraph_hash & (LINE_BREAK_CACHE_SIZE - 1);
+  entry = &table->entries[index];
+  slot_text = &line_break_cache_texts[index];
+
+  // Replacing the slot's text invalidates the entries stored for the
+  // previous paragraph at all other line lengths.
+  if (is_slot_text(index, text, text_length) == false) {
+    slot_text->text = fizmo_realloc(
+        slot_text->text, (text_length > 0 ? text_length : 1) * sizeof(z_ucs));
+    if (text_length > 0) {
+      memcpy(slot_text->text, text, text_length * sizeof(z_ucs));
+    }
+    slot_text->text_length = text_length;
+    slot_text->generation = ++line_break_cache_text_generation;
+  }
+
+  // At least one element is always allocated since a NULL "breaks" marks
+  // an empty entry.
+  entry->breaks = fizmo_realloc(
+      entry->breaks, (nof_breaks > 0 ? nof_breaks : 1) * sizeof(line_break));
+  if (nof_breaks > 0) {
+    memcpy(entry->breaks, breaks, nof_breaks * sizeof(line_break));
+  }
+  entry->nof_breaks = nof_breaks;
+  entry->nof_lines = nof_lines;
+  entry->paragraph_hash = paragraph_hash;
+  entry->text_generation = slot_text->generation;
+
+  return entry;
+}
+
+
+void free_line_break_cache() {
+  int i;
+
+  for (i=0; i<LINE_BREAK_CACHE_MAX_LINE_LENGTHS; i++) {
+    free_line_break_cache_table(&line_break_cache[i]);
+  }
+
+  if (line_break_cache_texts != NULL) {
+    for (i=0; i<LINE_BREAK_CACHE_SIZE; i++) {
+      if (line_break_cache_texts[i].text != NULL) {
+        free(line_break_cache_texts[i].text);
+      }
+    }
+    free(line_break_cache_texts);
+    line_break_cache_texts = NULL;
+  }
+}
+
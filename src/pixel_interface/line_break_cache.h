@@ -0,0 +1,85 @@
+
+/* line_break_cache.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef line_break_cache_h_INCLUDED
+#define line_break_cache_h_INCLUDED
+
+#include "tools/types.h"
+
+// Number of different line lengths for which line breaks are kept. In case
+// breaks for another line length are stored, the least recently used line
+// length is discarded.
+#define LINE_BREAK_CACHE_MAX_LINE_LENGTHS 4
+
+// Number of paragraphs kept per line length, must be a power of two.
+#define LINE_BREAK_CACHE_SIZE 8192
+
+// A line break as reported by the wordwrapper, "type" is one of the
+// FREETYPE_WORDWRAP_BREAK_* values and "position" the index of the
+// paragraph's char in front of which the break occurs.
+typedef struct line_break_struct {
+  long position;
+  int type;
+} line_break;
+
+// Since the hash doesn't identify a paragraph reliably, the paragraph's
+// text is compared on lookup. All line lengths share a single copy of the
+// text per slot, "text_generation" tells whether it still belongs to the
+// paragraph this entry was stored for.
+typedef struct line_break_cache_entry_struct {
+  uint32_t paragraph_hash;
+  unsigned long text_generation;
+  int nof_lines;
+  int nof_breaks;
+  line_break *breaks; // NULL marks an empty entry.
+} line_break_cache_entry;
+
+// Returns the cached line breaks for the paragraph identified by hash and
+// text when wrapped at line_length using the given font configuration,
+// or NULL in case the paragraph's breaks are not known.
+line_break_cache_entry *get_line_break_cache_entry(int line_length,
+    uint32_t font_configuration, uint32_t paragraph_hash, const z_ucs *text,
+    long text_length);
+
+// Stores the line breaks for a paragraph and returns the new entry. The
+// "breaks" are copied, "text" only in case the slot's shared copy doesn't
+// already hold it.
+line_break_cache_entry *store_line_break_cache_entry(int line_length,
+    uint32_t font_configuration, uint32_t paragraph_hash, const z_ucs *text,
+    long text_length, int nof_lines, line_break *breaks, int nof_breaks);
+
+void free_line_break_cache();
+
+#endif // line_break_cache_h_INCLUDED
+
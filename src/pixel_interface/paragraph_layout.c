@@ -0,0 +1,1043 @@
+
+/* paragraph_layout.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Reflowing the history after a resize used to send every paragraph
+// through the measurement window's wordwrapper again, looking up the size
+// of every glyph and hyphenating the words at the line ends on the way. A
+// paragraph layout keeps the glyph sizes together with the text, the font
+// runs and the positions where hyphenation allows a break, so wrapping a
+// paragraph at a new width is a walk over the stored widths which neither
+// touches the fonts nor the hyphenation. The walk applies the same rules
+// as the wordwrapper, except that the rest of a word which has already
+// been broken keeps the hyphenation points found for the whole word
+// instead of being hyphenated on its own. Layouts are created when a
+// paragraph is first remeasured.
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "paragraph_layout.h"
+#include "line_break_cache.h"
+#include "hyphenation_cache.h"
+#include "true_type_wordwrapper.h"
+#include "tools/z_ucs.h"
+#include "tools/tracelog.h"
+#include "tools/unused.h"
+#include "interpreter/fizmo.h"
+
+// State of a running reflow. Like the wordwrapper, the reflow collects
+// chars in a buffer, which here is the part of the layout's text from
+// buffer_start on, until it finds a position to break at. Indices named
+// "*_index" are relative to buffer_start, as are the wordwrapper's. The
+// output is measured the same way process_glyph() measures glyphs for the
+// measurement window.
+typedef struct paragraph_layout_reflow_struct {
+  paragraph_layout *layout;
+  int line_length;
+  long buffer_start;
+  long buffer_length;
+  int input_run; // run of the last char added to the buffer
+  int next_output_run; // first run whose start hasn't been output yet
+  int buffer_start_run; // run of the last char output when breaking a line
+  paragraph_layout_run *output_run;
+  long last_word_end_index;
+  long last_word_end_advance_position;
+  long current_advance_position;
+  long current_width_position;
+  long last_width_position;
+  int xcursorpos;
+  int nof_lines;
+  void (*line_break_destination)(long position, int break_type,
+      void *parameter);
+  void *line_break_parameter;
+} paragraph_layout_reflow;
+
+static paragraph_layout *paragraph_layouts[PARAGRAPH_LAYOUT_CACHE_SIZE];
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+typedef struct background_reflow_result_struct {
+  paragraph_layout *layout;
+  int nof_lines;
+  int first_break;
+  int nof_breaks;
+} background_reflow_result;
+
+// Every worker reflows the layouts in its own range of cache slots and
+// collects the results, which are merged into the line break cache by
+// the main thread as soon as the worker is done.
+typedef struct background_reflow_worker_struct {
+  pthread_t thread;
+  int first_slot;
+  int end_slot;
+  bool finished; // protected by background_reflow_mutex
+  bool joined;
+  background_reflow_result *results;
+  int nof_results;
+  int results_size;
+  line_break *breaks;
+  int nof_breaks;
+  int breaks_size;
+} background_reflow_worker;
+
+static background_reflow_worker background_workers[
+  PARAGRAPH_LAYOUT_MAX_REFLOW_THREADS];
+static int nof_background_workers = 0;
+static bool background_reflow_active = false;
+static bool background_reflow_merged = false;
+static int background_line_length;
+static bool background_hyphenation_enabled;
+static uint32_t background_font_configuration;
+static uint32_t background_line_break_configuration;
+
+// The workers only access the layouts in this snapshot. Layouts replaced
+// in the cache while the workers are running are kept in
+// retired_layouts until the workers have been joined.
+static paragraph_layout *background_layouts[PARAGRAPH_LAYOUT_CACHE_SIZE];
+static paragraph_layout **retired_layouts = NULL;
+static int nof_retired_layouts = 0;
+static int retired_layouts_size = 0;
+
+static pthread_mutex_t background_reflow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool background_reflow_cancelled = false;
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+
+static void free_paragraph_layout(paragraph_layout *layout) {
+  free(layout->text);
+  if (layout->sizes != NULL) {
+    free(layout->sizes);
+  }
+  if (layout->soft_hyphens != NULL) {
+    free(layout->soft_hyphens);
+  }
+  if (layout->runs != NULL) {
+    free(layout->runs);
+  }
+  free(layout);
+}
+
+
+// Frees a layout removed from the cache, unless it may still be in use
+// by the background workers.
+static void retire_paragraph_layout(paragraph_layout *layout) {
+#ifdef ENABLE_THREADED_REMEASUREMENT
+  if (background_reflow_active == true) {
+    if (nof_retired_layouts == retired_layouts_size) {
+      retired_layouts_size
+        = retired_layouts_size > 0 ? retired_layouts_size * 2 : 64;
+      retired_layouts = fizmo_realloc(
+          retired_layouts, retired_layouts_size * sizeof(paragraph_layout*));
+    }
+    retired_layouts[nof_retired_layouts++] = layout;
+    return;
+  }
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+  free_paragraph_layout(layout);
+}
+
+
+paragraph_layout *get_paragraph_layout(uint32_t font_configuration,
+    history_paragraph *paragraph) {
+  paragraph_layout *layout = paragraph_layouts[
+    paragraph->hash & (PARAGRAPH_LAYOUT_CACHE_SIZE - 1)];
+
+  if ( (layout == NULL)
+      || (layout->font_configuration != font_configuration)
+      || (layout->paragraph_hash != paragraph->hash)
+      || (layout->text_length != paragraph->text_length)
+      || ( (paragraph->text_length > 0)
+        && (memcmp(layout->text, paragraph->text,
+            paragraph->text_length * sizeof(z_ucs)) != 0) ) ) {
+    return NULL;
+  }
+
+  return layout;
+}
+
+
+paragraph_layout *create_paragraph_layout(uint32_t font_configuration,
+    history_paragraph *paragraph) {
+  paragraph_layout *layout = fizmo_malloc(sizeof(paragraph_layout));
+
+  layout->font_configuration = font_configuration;
+  layout->paragraph_hash = paragraph->hash;
+  layout->text_length = paragraph->text_length;
+  layout->text = fizmo_malloc(
+      (paragraph->text_length > 0 ? paragraph->text_length : 1)
+      * sizeof(z_ucs));
+  if (paragraph->text_length > 0) {
+    memcpy(layout->text, paragraph->text,
+        paragraph->text_length * sizeof(z_ucs));
+  }
+  layout->sizes = NULL;
+  layout->soft_hyphens = NULL;
+  layout->runs = NULL;
+  layout->nof_runs = 0;
+  layout->runs_size = 0;
+  layout->end_line
+    = ( (paragraph->nof_events > 0)
+        && (paragraph->events[paragraph->nof_events - 1].type
+          == HISTORY_PARAGRAPH_LINE_END) );
+
+  return layout;
+}
+
+
+void add_paragraph_layout_run(paragraph_layout *layout, long position,
+    true_type_font *font) {
+  paragraph_layout_run *run;
+
+  if ( (layout->nof_runs > 0)
+      && (layout->runs[layout->nof_runs - 1].position == position) ) {
+    // A later font change at the same position replaces the former one.
+    layout->runs[layout->nof_runs - 1].font = font;
+    return;
+  }
+
+  if (layout->nof_runs == layout->runs_size) {
+    layout->runs_size = layout->runs_size > 0 ? layout->runs_size * 2 : 8;
+    layout->runs = fizmo_realloc(
+        layout->runs, layout->runs_size * sizeof(paragraph_layout_run));
+  }
+
+  run = &layout->runs[layout->nof_runs++];
+  run->position = position;
+  run->font = font;
+}
+
+
+// Marks the hyphenation points of the chars from start_index up to, but not
+// including, end_index in layout->soft_hyphens.
+static void store_soft_hyphens(paragraph_layout *layout, long start_index,
+    long end_index, z_ucs **word_buffer, size_t *word_buffer_size,
+    z_ucs **hyphenated_word_buffer, size_t *hyphenated_word_buffer_size) {
+  z_ucs *hyphenated_word;
+  long len = end_index - start_index, i;
+
+  if ((size_t)len + 1 > *word_buffer_size) {
+    *word_buffer_size = len + 1;
+    *word_buffer = fizmo_realloc(
+        *word_buffer, *word_buffer_size * sizeof(z_ucs));
+  }
+  memcpy(*word_buffer, layout->text + start_index, len * sizeof(z_ucs));
+  (*word_buffer)[len] = 0;
+
+  if ((hyphenated_word = copy_hyphenated_word(*word_buffer,
+          hyphenated_word_buffer, hyphenated_word_buffer_size)) == NULL) {
+    TRACE_LOG("Error hyphenating.\n");
+    return;
+  }
+
+  for (i=start_index; (*hyphenated_word != 0) && (i < end_index);
+      hyphenated_word++) {
+    if (*hyphenated_word == Z_UCS_SOFT_HYPEN) {
+      layout->soft_hyphens[i] = true;
+    }
+    else {
+      i++;
+    }
+  }
+}
+
+
+// Finds the hyphenation points of all words in the paragraph. Words are
+// split the same way the wordwrapper splits them when it hyphenates the
+// word crossing the right margin: A word starts behind a newline or behind
+// the first of a sequence of spaces and ends in front of the next space or
+// newline, not including trailing commas and dots.
+static void find_soft_hyphens(paragraph_layout *layout) {
+  z_ucs *word_buffer = NULL, *hyphenated_word_buffer = NULL;
+  size_t word_buffer_size = 0, hyphenated_word_buffer_size = 0;
+  long i, word_start = 0, word_end;
+  z_ucs current_char;
+
+  layout->soft_hyphens = fizmo_malloc(
+      (layout->text_length > 0 ? layout->text_length : 1) * sizeof(bool));
+  for (i=0; i<layout->text_length; i++) {
+    layout->soft_hyphens[i] = false;
+  }
+
+  for (i=0; i<=layout->text_length; i++) {
+    current_char = i < layout->text_length ? layout->text[i] : 0;
+
+    if ( (i < layout->text_length)
+        && (current_char != Z_UCS_SPACE)
+        && (current_char != Z_UCS_NEWLINE) ) {
+      continue;
+    }
+
+    if ( (current_char == Z_UCS_SPACE)
+        && (i > 0)
+        && (layout->text[i - 1] == Z_UCS_SPACE) ) {
+      // The spaces following the first one belong to the next word.
+      continue;
+    }
+
+    word_end = i;
+    while ( (word_end > word_start)
+        && ( (layout->text[word_end - 1] == Z_UCS_COMMA)
+          || (layout->text[word_end - 1] == Z_UCS_DOT) ) ) {
+      word_end--;
+    }
+
+    if (word_end > word_start) {
+      store_soft_hyphens(layout, word_start, word_end,
+          &word_buffer, &word_buffer_size,
+          &hyphenated_word_buffer, &hyphenated_word_buffer_size);
+    }
+
+    word_start = i + 1;
+  }
+
+  if (word_buffer != NULL) {
+    free(word_buffer);
+  }
+  if (hyphenated_word_buffer != NULL) {
+    free(hyphenated_word_buffer);
+  }
+}
+
+
+void store_paragraph_layout(paragraph_layout *layout) {
+  paragraph_layout **slot;
+  paragraph_layout_run *run;
+  int run_index, advance, bitmap_width;
+  long i, end_index;
+
+  layout->sizes = fizmo_malloc(
+      (layout->text_length > 0 ? layout->text_length : 1)
+      * sizeof(glyph_size));
+
+  for (run_index=0; run_index<layout->nof_runs; run_index++) {
+    run = &layout->runs[run_index];
+
+    tt_get_glyph_size(run->font, Z_UCS_MINUS, &advance, &bitmap_width);
+    run->dash_size.advance = advance;
+    run->dash_size.bitmap_width = bitmap_width;
+
+    tt_get_glyph_size(run->font, Z_UCS_SPACE, &advance, NULL);
+    run->space_advance = advance;
+
+    end_index
+      = run_index + 1 < layout->nof_runs
+      ? layout->runs[run_index + 1].position
+      : layout->text_length;
+
+    for (i=run->position; i<end_index; i++) {
+      tt_get_glyph_size(run->font, layout->text[i], &advance, &bitmap_width);
+      layout->sizes[i].advance = advance;
+      layout->sizes[i].bitmap_width = bitmap_width;
+    }
+  }
+
+  find_soft_hyphens(layout);
+
+  slot = &paragraph_layouts[
+    layout->paragraph_hash & (PARAGRAPH_LAYOUT_CACHE_SIZE - 1)];
+  if (*slot != NULL) {
+    retire_paragraph_layout(*slot);
+  }
+  *slot = layout;
+}
+
+
+static inline z_ucs reflow_char(paragraph_layout_reflow *reflow,
+    long index) {
+  return reflow->layout->text[reflow->buffer_start + index];
+}
+
+
+static inline glyph_size *reflow_size(paragraph_layout_reflow *reflow,
+    long index) {
+  return &reflow->layout->sizes[reflow->buffer_start + index];
+}
+
+
+static void reflow_new_line(paragraph_layout_reflow *reflow) {
+  reflow->nof_lines++;
+  reflow->xcursorpos = 0;
+}
+
+
+static void output_glyph(paragraph_layout_reflow *reflow, glyph_size *size) {
+  if (reflow->xcursorpos + size->bitmap_width > reflow->line_length) {
+    reflow_new_line(reflow);
+  }
+  reflow->xcursorpos += size->advance;
+}
+
+
+static void report_line_break(paragraph_layout_reflow *reflow,
+    long position, int break_type) {
+  if (reflow->line_break_destination != NULL) {
+    reflow->line_break_destination(
+        position, break_type, reflow->line_break_parameter);
+  }
+}
+
+
+// Outputs the buffer up to and including flush_index, like the
+// wordwrapper's flush_line().
+static void reflow_flush_line(paragraph_layout_reflow *reflow,
+    long flush_index, bool append_minus, bool append_newline) {
+  paragraph_layout *layout = reflow->layout;
+  long i;
+
+  if (flush_index == -1) {
+    flush_index = reflow->buffer_length - 1;
+  }
+
+  while ( (reflow->next_output_run < layout->nof_runs)
+      && (layout->runs[reflow->next_output_run].position
+        <= reflow->buffer_start + (flush_index >= 0 ? flush_index : 0)) ) {
+    reflow->output_run = &layout->runs[reflow->next_output_run];
+    reflow->buffer_start_run = reflow->next_output_run;
+    reflow->next_output_run++;
+  }
+
+  for (i=0; i<=flush_index; i++) {
+    if (reflow_char(reflow, i) == Z_UCS_NEWLINE) {
+      reflow_new_line(reflow);
+    }
+    else {
+      output_glyph(reflow, reflow_size(reflow, i));
+    }
+  }
+
+  if (append_minus == true) {
+    output_glyph(reflow, &reflow->output_run->dash_size);
+    report_line_break(reflow, reflow->buffer_start + flush_index + 1,
+        FREETYPE_WORDWRAP_BREAK_MINUS);
+  }
+
+  if (append_newline == true) {
+    reflow_new_line(reflow);
+    report_line_break(reflow, reflow->buffer_start + flush_index + 1,
+        FREETYPE_WORDWRAP_BREAK_NEWLINE);
+  }
+
+  reflow->buffer_start += flush_index + 1;
+  reflow->buffer_length -= flush_index + 1;
+}
+
+
+// Drops the first char of the buffer, like the wordwrapper's
+// forget_first_char_in_buffer().
+static void reflow_forget_first_char(paragraph_layout_reflow *reflow) {
+  paragraph_layout *layout = reflow->layout;
+
+  if (reflow->buffer_length < 1) {
+    return;
+  }
+
+  while ( (reflow->next_output_run < layout->nof_runs)
+      && (layout->runs[reflow->next_output_run].position
+        <= reflow->buffer_start) ) {
+    reflow->output_run = &layout->runs[reflow->next_output_run];
+    reflow->next_output_run++;
+  }
+
+  report_line_break(reflow, reflow->buffer_start,
+      FREETYPE_WORDWRAP_BREAK_SKIP);
+
+  reflow->buffer_start++;
+  reflow->buffer_length--;
+}
+
+
+// Finds the last hyphenation point or dash of the word from the last word
+// end up to, but not including, end_index which still fits into the line.
+// Returns the index to break at or -1 in case there's none and stores the
+// advance position of the break in *hyph_position.
+static long find_hyphenation_break(paragraph_layout_reflow *reflow,
+    long end_index, long *hyph_position) {
+  paragraph_layout *layout = reflow->layout;
+  long start_index = reflow->last_word_end_index + 1;
+  long hyph_index = start_index, last_valid_hyph_index = -1;
+  long wrap_width_position, last_valid_hyph_position = 0;
+  int hyph_run = reflow->buffer_start_run;
+  int metadata_run = reflow->next_output_run;
+  bool soft_hyphen_passed = false;
+
+  wrap_width_position
+    = reflow->last_word_end_advance_position
+    + layout->runs[reflow->input_run].space_advance;
+
+  while ( (hyph_index < end_index)
+      && (wrap_width_position + layout->runs[hyph_run].dash_size.advance
+        <= reflow->line_length) ) {
+    while ( (metadata_run < layout->nof_runs)
+        && (layout->runs[metadata_run].position
+          <= reflow->buffer_start + hyph_index) ) {
+      hyph_run = metadata_run++;
+    }
+
+    if ( (hyph_index > start_index)
+        && (soft_hyphen_passed == false)
+        && (layout->soft_hyphens[reflow->buffer_start + hyph_index]
+          == true) ) {
+      last_valid_hyph_index = hyph_index + 1;
+      last_valid_hyph_position = wrap_width_position;
+      soft_hyphen_passed = true;
+    }
+    else {
+      wrap_width_position += reflow_size(reflow, hyph_index)->advance;
+      if (reflow_char(reflow, hyph_index) == Z_UCS_MINUS) {
+        last_valid_hyph_index = hyph_index;
+        last_valid_hyph_position = wrap_width_position;
+      }
+      hyph_index++;
+      soft_hyphen_passed = false;
+    }
+  }
+
+  *hyph_position = last_valid_hyph_position;
+  return last_valid_hyph_index;
+}
+
+
+// Breaks the line at a word end behind the right margin, which is the
+// situation in which the wordwrapper looks for the best position to
+// break at.
+static void reflow_break_line(paragraph_layout_reflow *reflow,
+    z_ucs current_char, bool hyphenation_enabled) {
+  paragraph_layout *layout = reflow->layout;
+  long end_index, hyph_index, hyph_position, width_sum;
+
+  end_index = reflow->buffer_length - 2;
+
+  if (hyphenation_enabled == true) {
+    while ( (end_index >= 0)
+        && (end_index > reflow->last_word_end_index)
+        && ( (reflow_char(reflow, end_index) == Z_UCS_COMMA)
+          || (reflow_char(reflow, end_index) == Z_UCS_DOT) ) ) {
+      end_index--;
+    }
+
+    if (end_index > reflow->last_word_end_index) {
+      if ((hyph_index = find_hyphenation_break(
+              reflow, end_index + 1, &hyph_position)) == -1) {
+        hyph_index = reflow->last_word_end_index;
+        hyph_position = reflow->last_word_end_advance_position;
+      }
+    }
+    else {
+      hyph_index = end_index;
+      hyph_position = reflow->last_word_end_advance_position;
+    }
+  }
+  else {
+    // Check for dashes inside the last word.
+    hyph_index = end_index;
+    width_sum = 0;
+    while ( (hyph_index >= 0)
+        && (hyph_index > reflow->last_word_end_index) ) {
+      if ( (reflow_char(reflow, hyph_index) == Z_UCS_MINUS)
+          && (reflow->current_width_position - width_sum
+            <= reflow->line_length) ) {
+        break;
+      }
+      width_sum += reflow_size(reflow, hyph_index)->bitmap_width;
+      hyph_index--;
+    }
+    hyph_position = reflow->current_width_position - width_sum;
+  }
+
+  if (hyph_index < 0) {
+    // The word crossing the margin is the first one in this line, so
+    // we can only break right behind it.
+    if (current_char == Z_UCS_SPACE) {
+      reflow_flush_line(reflow, reflow->buffer_length - 2, false, true);
+      reflow_forget_first_char(reflow);
+      reflow->current_advance_position = 0;
+      reflow->current_width_position = 0;
+      reflow->last_word_end_advance_position = 0;
+    }
+  }
+  else {
+    if (reflow_char(reflow, hyph_index) == Z_UCS_MINUS) {
+      reflow_flush_line(reflow, hyph_index, false, true);
+    }
+    else if (reflow_char(reflow, hyph_index) == Z_UCS_SPACE) {
+      reflow_flush_line(reflow, hyph_index - 1, false, true);
+      reflow_forget_first_char(reflow);
+    }
+    else if ( (hyph_index >= 2)
+        && (reflow_char(reflow, hyph_index - 2) == Z_UCS_MINUS) ) {
+      reflow_flush_line(reflow, hyph_index - 3, true, true);
+      reflow_forget_first_char(reflow);
+    }
+    else {
+      reflow_flush_line(reflow, hyph_index - 2, true, true);
+    }
+
+    reflow->current_advance_position
+      -= hyph_position - layout->runs[reflow->input_run].dash_size.advance;
+    reflow->current_width_position = reflow->current_advance_position;
+    reflow->last_word_end_advance_position
+      = reflow->current_advance_position;
+  }
+
+  reflow->last_word_end_index = -1;
+}
+
+
+static int reflow_layout(paragraph_layout *layout, int line_length,
+    bool hyphenation_enabled,
+    void (*line_break_destination)(long position, int break_type,
+      void *parameter),
+    void *parameter) {
+  paragraph_layout_reflow reflow_state, *reflow = &reflow_state;
+  z_ucs current_char, last_char = 0;
+  int advance, bitmap_width;
+  long i = 0;
+  bool process_line_end = layout->end_line;
+
+  if (layout->nof_runs == 0) {
+    return 0;
+  }
+
+  memset(reflow, 0, sizeof(paragraph_layout_reflow));
+  reflow->layout = layout;
+  reflow->line_length = line_length;
+  reflow->output_run = &layout->runs[0];
+  reflow->last_word_end_index = -1;
+  reflow->line_break_destination = line_break_destination;
+  reflow->line_break_parameter = parameter;
+
+  while ( (i < layout->text_length) || (process_line_end == true) ) {
+    if (i < layout->text_length) {
+      while ( (reflow->input_run + 1 < layout->nof_runs)
+          && (layout->runs[reflow->input_run + 1].position <= i) ) {
+        reflow->input_run++;
+      }
+
+      current_char = layout->text[i];
+      advance = layout->sizes[i].advance;
+      bitmap_width = layout->sizes[i].bitmap_width;
+
+      reflow->buffer_length++;
+      reflow->current_width_position
+        = reflow->current_advance_position + bitmap_width;
+      reflow->current_advance_position += advance;
+    }
+    else {
+      reflow->input_run = layout->nof_runs - 1;
+      current_char = 0;
+      advance = 0;
+      bitmap_width = 0;
+    }
+
+    if ( ( (bitmap_width == 0)
+          && (reflow->last_width_position >= line_length) )
+        || (reflow->current_width_position >= line_length) ) {
+      reflow->last_width_position = reflow->current_width_position;
+
+      if ( (current_char == Z_UCS_SPACE)
+          || (current_char == Z_UCS_NEWLINE)
+          || (i >= layout->text_length) ) {
+        reflow_break_line(reflow, current_char, hyphenation_enabled);
+      }
+      else if (reflow->current_advance_position > line_length * 2) {
+        // Without a word end, a line break is only forced once two full
+        // lines of text have been collected.
+        reflow_flush_line(reflow, reflow->buffer_length - 2, false, true);
+        reflow->current_advance_position = advance;
+        reflow->current_width_position
+          = reflow->current_advance_position + bitmap_width;
+        reflow->last_word_end_index = -1;
+        reflow->last_word_end_advance_position = 0;
+      }
+    }
+    else {
+      reflow->last_width_position = reflow->current_width_position;
+    }
+
+    if (current_char == Z_UCS_NEWLINE) {
+      reflow_flush_line(reflow, reflow->buffer_length - 1, false, false);
+      reflow->last_word_end_advance_position = 0;
+      reflow->current_advance_position = 0;
+      reflow->current_width_position = 0;
+      reflow->last_width_position = 0;
+      reflow->last_word_end_index = -1;
+    }
+
+    if ( (current_char == Z_UCS_SPACE) && (last_char != Z_UCS_SPACE) ) {
+      reflow->last_word_end_advance_position
+        = reflow->current_advance_position;
+      reflow->last_word_end_index = reflow->buffer_length - 1;
+    }
+
+    if (i < layout->text_length) {
+      last_char = current_char;
+      i++;
+    }
+    else {
+      process_line_end = false;
+    }
+  }
+
+  if (reflow->buffer_length > 0) {
+    reflow_flush_line(reflow, -1, false, false);
+  }
+
+  return reflow->nof_lines;
+}
+
+
+int reflow_paragraph_layout(paragraph_layout *layout, int line_length,
+    bool hyphenation_enabled,
+    void (*line_break_destination)(long position, int break_type,
+      void *parameter),
+    void *parameter) {
+  int result = reflow_layout(layout, line_length, hyphenation_enabled,
+      line_break_destination, parameter);
+
+  TRACE_LOG("Reflowed paragraph layout to %d lines.\n", result);
+
+  return result;
+}
+
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+
+static bool is_background_reflow_cancelled() {
+  bool result;
+
+  pthread_mutex_lock(&background_reflow_mutex);
+  result = background_reflow_cancelled;
+  pthread_mutex_unlock(&background_reflow_mutex);
+
+  return result;
+}
+
+
+static void add_background_line_break(long position, int break_type,
+    void *worker_as_void) {
+  background_reflow_worker *worker = (background_reflow_worker*)worker_as_void;
+
+  if (worker->nof_breaks == worker->breaks_size) {
+    worker->breaks_size
+      = worker->breaks_size > 0 ? worker->breaks_size * 2 : 1024;
+    worker->breaks = fizmo_realloc(
+        worker->breaks, worker->breaks_size * sizeof(line_break));
+  }
+
+  worker->breaks[worker->nof_breaks].position = position;
+  worker->breaks[worker->nof_breaks].type = break_type;
+  worker->nof_breaks++;
+}
+
+
+static void *run_background_worker(void *worker_as_void) {
+  background_reflow_worker *worker = (background_reflow_worker*)worker_as_void;
+  background_reflow_result *result;
+  paragraph_layout *layout;
+  int slot;
+
+  for (slot=worker->first_slot; slot<worker->end_slot; slot++) {
+    if ( ((layout = background_layouts[slot]) == NULL)
+        || (layout->font_configuration != background_font_configuration) ) {
+      continue;
+    }
+
+    if (is_background_reflow_cancelled() == true) {
+      break;
+    }
+
+    if (worker->nof_results == worker->results_size) {
+      worker->results_size
+        = worker->results_size > 0 ? worker->results_size * 2 : 256;
+      worker->results = fizmo_realloc(
+          worker->results,
+          worker->results_size * sizeof(background_reflow_result));
+    }
+
+    result = &worker->results[worker->nof_results];
+    result->layout = layout;
+    result->first_break = worker->nof_breaks;
+    result->nof_lines = reflow_layout(
+        layout,
+        background_line_length,
+        background_hyphenation_enabled,
+        &add_background_line_break,
+        worker);
+    result->nof_breaks = worker->nof_breaks - result->first_break;
+    worker->nof_results++;
+  }
+
+  pthread_mutex_lock(&background_reflow_mutex);
+  worker->finished = true;
+  pthread_mutex_unlock(&background_reflow_mutex);
+
+  return NULL;
+}
+
+
+static int get_nof_background_workers() {
+  long nof_processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (nof_processors < 1) {
+    return 1;
+  }
+  else if (nof_processors > PARAGRAPH_LAYOUT_MAX_REFLOW_THREADS) {
+    return PARAGRAPH_LAYOUT_MAX_REFLOW_THREADS;
+  }
+  else {
+    return (int)nof_processors;
+  }
+}
+
+
+static void join_background_worker(background_reflow_worker *worker,
+    bool merge_results) {
+  background_reflow_result *result;
+  int i;
+
+  pthread_join(worker->thread, NULL);
+  worker->joined = true;
+
+  if (merge_results == true) {
+    for (i=0; i<worker->nof_results; i++) {
+      result = &worker->results[i];
+      store_line_break_cache_entry(
+          background_line_length,
+          background_line_break_configuration,
+          result->layout->paragraph_hash,
+          result->layout->text,
+          result->layout->text_length,
+          result->nof_lines,
+          worker->breaks + result->first_break,
+          result->nof_breaks);
+    }
+  }
+
+  if (worker->results != NULL) {
+    free(worker->results);
+  }
+  if (worker->breaks != NULL) {
+    free(worker->breaks);
+  }
+}
+
+
+// Invoked once all workers have been joined.
+static void end_background_reflow(bool merged) {
+  int i;
+
+  TRACE_LOG("Joined %d background reflow workers.\n", nof_background_workers);
+
+  nof_background_workers = 0;
+  background_reflow_active = false;
+  background_reflow_merged = merged;
+
+  for (i=0; i<nof_retired_layouts; i++) {
+    free_paragraph_layout(retired_layouts[i]);
+  }
+  nof_retired_layouts = 0;
+}
+
+
+static void join_background_workers(bool merge_results) {
+  int i;
+
+  for (i=0; i<nof_background_workers; i++) {
+    if (background_workers[i].joined == false) {
+      join_background_worker(&background_workers[i], merge_results);
+    }
+  }
+
+  end_background_reflow(merge_results);
+}
+
+
+void start_background_layout_reflow(int line_length,
+    bool hyphenation_enabled, uint32_t font_configuration,
+    uint32_t line_break_configuration) {
+  background_reflow_worker *worker;
+  int i, nof_workers;
+
+  if ( ( (background_reflow_active == true)
+        || (background_reflow_merged == true) )
+      && (background_line_length == line_length)
+      && (background_hyphenation_enabled == hyphenation_enabled)
+      && (background_font_configuration == font_configuration)
+      && (background_line_break_configuration
+        == line_break_configuration) ) {
+    return;
+  }
+
+  cancel_background_layout_reflow();
+  background_reflow_merged = false;
+
+  background_line_length = line_length;
+  background_hyphenation_enabled = hyphenation_enabled;
+  background_font_configuration = font_configuration;
+  background_line_break_configuration = line_break_configuration;
+  background_reflow_cancelled = false;
+  memcpy(background_layouts, paragraph_layouts, sizeof(paragraph_layouts));
+
+  nof_workers = get_nof_background_workers();
+  background_reflow_active = true;
+
+  TRACE_LOG("Starting %d background reflow workers for line length %d.\n",
+      nof_workers, line_length);
+
+  for (i=0; i<nof_workers; i++) {
+    worker = &background_workers[i];
+    memset(worker, 0, sizeof(background_reflow_worker));
+    worker->first_slot = i * PARAGRAPH_LAYOUT_CACHE_SIZE / nof_workers;
+    worker->end_slot = (i + 1) * PARAGRAPH_LAYOUT_CACHE_SIZE / nof_workers;
+
+    if (pthread_create(&worker->thread, NULL, &run_background_worker,
+          worker) != 0) {
+      TRACE_LOG("Could not create background reflow worker.\n");
+      break;
+    }
+    nof_background_workers++;
+  }
+
+  if (nof_background_workers == 0) {
+    background_reflow_active = false;
+  }
+}
+
+
+void merge_finished_background_layout_reflows() {
+  background_reflow_worker *worker;
+  int i, nof_joined = 0;
+  bool finished;
+
+  if (background_reflow_active == false) {
+    return;
+  }
+
+  for (i=0; i<nof_background_workers; i++) {
+    worker = &background_workers[i];
+
+    if (worker->joined == false) {
+      pthread_mutex_lock(&background_reflow_mutex);
+      finished = worker->finished;
+      pthread_mutex_unlock(&background_reflow_mutex);
+
+      if (finished == true) {
+        join_background_worker(worker, true);
+      }
+    }
+
+    if (worker->joined == true) {
+      nof_joined++;
+    }
+  }
+
+  if (nof_joined == nof_background_workers) {
+    end_background_reflow(true);
+  }
+}
+
+
+bool wait_for_background_layout_reflow(int line_length,
+    bool hyphenation_enabled, uint32_t line_break_configuration,
+    paragraph_layout *layout) {
+  background_reflow_worker *worker;
+  int slot, i;
+
+  if ( (background_reflow_active == false)
+      || (background_line_length != line_length)
+      || (background_hyphenation_enabled != hyphenation_enabled)
+      || (background_line_break_configuration != line_break_configuration)
+      || (layout->font_configuration != background_font_configuration) ) {
+    return false;
+  }
+
+  slot = layout->paragraph_hash & (PARAGRAPH_LAYOUT_CACHE_SIZE - 1);
+  if (background_layouts[slot] != layout) {
+    // Created after the workers were started, so nobody reflows it.
+    return false;
+  }
+
+  for (i=0; i<nof_background_workers; i++) {
+    worker = &background_workers[i];
+    if ( (slot >= worker->first_slot) && (slot < worker->end_slot) ) {
+      if (worker->joined == true) {
+        return false;
+      }
+      join_background_worker(worker, true);
+      merge_finished_background_layout_reflows();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void cancel_background_layout_reflow() {
+  if (background_reflow_active == true) {
+    pthread_mutex_lock(&background_reflow_mutex);
+    background_reflow_cancelled = true;
+    pthread_mutex_unlock(&background_reflow_mutex);
+    join_background_workers(false);
+  }
+}
+
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+
+void free_paragraph_layout_cache() {
+  int i;
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+  cancel_background_layout_reflow();
+  if (retired_layouts != NULL) {
+    free(retired_layouts);
+    retired_layouts = NULL;
+    retired_layouts_size = 0;
+  }
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+  for (i=0; i<PARAGRAPH_LAYOUT_CACHE_SIZE; i++) {
+    if (paragraph_layouts[i] != NULL) {
+      free_paragraph_layout(paragraph_layouts[i]);
+      paragraph_layouts[i] = NULL;
+    }
+  }
+}
+
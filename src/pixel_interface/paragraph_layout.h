@@ -0,0 +1,124 @@
+
+/* paragraph_layout.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef paragraph_layout_h_INCLUDED
+#define paragraph_layout_h_INCLUDED
+
+#include "tools/types.h"
+#include "true_type_font.h"
+#include "history_paragraph.h"
+
+// Number of paragraph layouts kept, must be a power of two.
+#define PARAGRAPH_LAYOUT_CACHE_SIZE 2048
+
+// A part of the paragraph set in a single font, starting at "position".
+// The dash and space sizes are required for finding hyphenation breaks
+// and for the hyphens added there.
+typedef struct paragraph_layout_run_struct {
+  long position;
+  true_type_font *font;
+  glyph_size dash_size;
+  int space_advance;
+} paragraph_layout_run;
+
+// A paragraph's text together with the sizes of all its glyphs, the font
+// runs and the hyphenation points. Since nothing in here depends on the
+// line length, a layout can be reflowed to any width without measuring
+// glyphs or hyphenating words again.
+typedef struct paragraph_layout_struct {
+  uint32_t font_configuration;
+  uint32_t paragraph_hash;
+  long text_length;
+  z_ucs *text;
+  glyph_size *sizes; // one entry per char in text
+  bool *soft_hyphens; // true for chars which may start a hyphenated line
+  paragraph_layout_run *runs;
+  int nof_runs;
+  int runs_size;
+  bool end_line; // the paragraph ends with a HISTORY_PARAGRAPH_LINE_END
+} paragraph_layout;
+
+// Returns the stored layout for the paragraph or NULL in case it's not
+// known yet.
+paragraph_layout *get_paragraph_layout(uint32_t font_configuration,
+    history_paragraph *paragraph);
+
+// Creates a layout for the paragraph's text. The fonts in use have to be
+// added using add_paragraph_layout_run before store_paragraph_layout
+// measures the glyphs, hyphenates the words and keeps the layout for
+// later use.
+paragraph_layout *create_paragraph_layout(uint32_t font_configuration,
+    history_paragraph *paragraph);
+void add_paragraph_layout_run(paragraph_layout *layout, long position,
+    true_type_font *font);
+void store_paragraph_layout(paragraph_layout *layout);
+
+// Wraps the layout at the given line length the same way the wordwrapper
+// and the measurement window would, starting at the beginning of an empty
+// line. Line breaks are reported relative to the paragraph's start. Returns
+// the number of lines output.
+int reflow_paragraph_layout(paragraph_layout *layout, int line_length,
+    bool hyphenation_enabled,
+    void (*line_break_destination)(long position, int break_type,
+      void *parameter),
+    void *parameter);
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+#define PARAGRAPH_LAYOUT_MAX_REFLOW_THREADS 4
+
+// Reflows all stored layouts for the given font configuration in
+// background threads. Once finished, the results are added to the line
+// break cache under the given line break configuration so that remeasuring
+// the history will find them there. Starting a reflow with different
+// parameters cancels the running one.
+void start_background_layout_reflow(int line_length, bool hyphenation_enabled,
+    uint32_t font_configuration, uint32_t line_break_configuration);
+// Stores the results of the background threads which are already done,
+// without waiting for the others.
+void merge_finished_background_layout_reflows();
+// In case a running background thread is going to reflow the given layout
+// for the given parameters, waits for this thread only and stores its
+// results. Returns true if it did, false in case the caller has to reflow
+// the layout itself.
+bool wait_for_background_layout_reflow(int line_length,
+    bool hyphenation_enabled, uint32_t line_break_configuration,
+    paragraph_layout *layout);
+// Stops the background threads, discarding their results.
+void cancel_background_layout_reflow();
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+void free_paragraph_layout_cache();
+
+#endif // paragraph_layout_h_INCLUDED
+
@@ -40,6 +40,7 @@
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tools/i18n.h"
@@ -62,6 +63,13 @@
 #include "true_type_wordwrapper.h"
 #include "true_type_factory.h"
 #include "true_type_font.h"
+#include "hyphenation_cache.h"
+#include "history_paragraph.h"
+#include "line_break_cache.h"
+#include "history_line_index.h"
+#include "scrollback_cache.h"
+#include "screen_damage.h"
+#include "paragraph_layout.h"
 #include "../screen_interface/screen_pixel_interface.h"
 #include "../locales/libpixelif_locales.h"
 #include "../locales/locale_data.h"
@@ -74,6 +82,10 @@
 
 #define Z_STYLE_NONRESET (Z_STYLE_REVERSE_VIDEO | Z_STYLE_BOLD | Z_STYLE_ITALIC)
 
+// While the history is remeasured during idle time, the scrollbar is
+// redrawn with the refined estimate every this many paragraphs.
+#define SCROLLBAR_ESTIMATE_REFRESH_INTERVAL 256
+
 // 8.8.1
 // The display is an array of pixels. Coordinates are usually given (in units)
 // in the form (y,x), with (1,1) in the top left.
@@ -193,6 +205,7 @@ static int redraw_pixel_lines_to_draw = -1; // will be painted at most.
 static history_output *measurement_history = NULL;
 
 static int history_screen_line; //, last_history_screen_line;
+static long history_screen_paragraph; // paragraphs rewound from the bottom
 
 // This flag is set to true when an read_line is currently underway. It's
 // used by screen refresh functions like "new_pixel_screen_size".
@@ -206,6 +219,8 @@ static bool timed_input_active;
 
 static struct z_window **z_windows;
 static struct z_screen_pixel_interface *screen_pixel_interface = NULL;
+// Set while scrolling, when screen_pixel_interface captures the output.
+static struct z_screen_pixel_interface *real_screen_pixel_interface = NULL;
 static z_image *frontispiece = NULL;
 
 //static int *current_input_scroll_x, *current_input_index;
@@ -225,6 +240,20 @@ static char *fixed_italic_font_filename = NULL;
 static char *fixed_bold_font_filename = NULL;
 static char *fixed_bold_italic_font_filename = NULL;
 static char *font_search_path = FONT_DEFAULT_SEARCH_PATH;
+static char *glyph_preload_ranges = NULL;
+static char *font_index_cache_filename = NULL;
+static long font_cache_size = 0;
+static char last_font_cache_size_config_value_as_string[
+  MAX_VALUE_AS_STRING_LEN];
+// Resize events arriving within this many milliseconds of each other are
+// handled as a single one.
+static long resize_coalescing_time = 100;
+static char last_resize_coalescing_time_config_value_as_string[
+  MAX_VALUE_AS_STRING_LEN];
+// An event received while waiting for further resize events, which has
+// to be returned after the resize.
+static int pending_event_type = EVENT_WAS_NOTHING;
+static z_ucs pending_event_input;
 static int font_height = 13;
 static int font_height_in_pixel;
 static char last_font_size_config_value_as_string[MAX_VALUE_AS_STRING_LEN];
@@ -244,23 +273,89 @@ static bool history_is_being_remeasured = false;
 // valid. When this flag is set idle time during the get_next_event_wrapper
 // function is used to refresh these values.
 static bool history_finished_remeasuring = false;
+// The history line index holds the lines of each paragraph from the last
+// measurement and is only valid while the history isn't being remeasured.
+static bool history_line_index_valid = true;
+// While remeasuring, the topmost nof_remeasured_paragraphs in the index
+// have been measured at the new line length and the rest still holds the
+// counts measured at history_line_index_line_length. Until remeasurement
+// is finished, total_lines_in_history is estimated from both.
+static long nof_remeasured_paragraphs = 0;
+static int history_line_index_line_length = 0;
+static bool total_lines_in_history_is_estimated = false;
+// Set after a restore or undo has modified the history while the index was
+// valid. In this case only the paragraphs from the first one differing from
+// the index downwards have to be remeasured.
+static bool remeasure_modified_tail_only = false;
+// After a resize, the paragraphs shown on the screen and on the first page
+// up are remeasured before the rest of the history, which is then done
+// from the top as usual. From first_viewport_paragraph on, the index holds
+// the counts for the new line length, -1 if there's no such range.
+static bool viewport_remeasurement_pending = false;
+static long first_viewport_paragraph = -1;
+
+// Identifies the fonts and wrapping options in use, so line breaks from
+// the line break cache are only reused for identical configurations.
+static uint32_t font_configuration = 0;
+
+// The line counts stored in the history's paragraph attributes, collected
+// bottom-up before remeasuring. Paragraphs whose stored width equals the
+// current one don't have to be laid out again. Entries are -1 where the
+// stored count can't be used.
+static int *stored_paragraph_lines = NULL;
+static long nof_stored_paragraph_lines = 0;
+static long stored_paragraph_lines_size = 0;
+// The font configuration and margins the paragraph attributes have been
+// measured with. Updated once a remeasurement has finished.
+static uint32_t paragraph_attributes_font_configuration = 0;
+static int paragraph_attributes_margins = 0;
+
+// While recording_paragraph is true, output from the history is collected
+// in recorded_paragraph instead of being sent to the windows. Line breaks
+// found when reflowing its layout are collected in recorded_line_breaks.
+static bool recording_paragraph = false;
+static history_paragraph recorded_paragraph;
+static line_break *recorded_line_breaks = NULL;
+static int nof_recorded_line_breaks = 0;
+static int recorded_line_breaks_size = 0;
+#ifdef ENABLE_THREADED_REMEASUREMENT
+// Set while finish_history_remeasurement runs. Instead of reflowing a
+// paragraph itself, the main thread then waits for the background worker
+// which is about to do so. Otherwise it never waits.
+static bool wait_for_background_reflows = false;
+#endif // ENABLE_THREADED_REMEASUREMENT
 
 static char *my_config_option_names[] = {
   "left-margin", "right-margin", "disable-hyphenation", "regular-font",
   "italic-font", "bold-font", "bold-italic-font", "fixed-regular-font",
   "fixed-italic-font", "fixed-bold-font", "fixed-bold-italic-font",
   "font-search-path", "font-size", "history-reformatting-during-refresh",
-  "cursor-color", NULL };
+  "cursor-color", "glyph-preload-ranges", "font-index-cache-file",
+  "font-cache-size", "resize-coalescing-time", NULL };
 
 static char **config_option_names = my_config_option_names;
 
 
 static int process_glyph_string(z_ucs *z_ucs_output, int window_number,
     true_type_font *font, bool *no_more_space);
+static int process_glyphs(const z_ucs *glyphs, size_t len, int window_number,
+    true_type_font *font, bool *no_more_space);
 static void wordwrap_output_style(void *window_number, uint32_t style_data);
 static true_type_font *evaluate_font(z_style text_style, z_font font);
 static history_output_target history_target;
+static history_output_target recording_history_target;
 static void z_ucs_output(z_ucs *z_ucs_output);
+static void output_history_paragraph(history_paragraph *paragraph,
+    bool wrap_text);
+static void output_history_paragraph_with_line_breaks(
+    history_paragraph *paragraph, line_break_cache_entry *cache_entry,
+    int window_number);
+static void start_paragraph_recording(int window_number);
+static void update_font_configuration();
+static uint32_t get_line_break_configuration();
+static line_break_cache_entry *get_recorded_paragraph_line_breaks(
+    int line_length);
+static void remeasure_viewport_paragraphs();
 static void refresh_screen();
 static void refresh_screen_without_paragraph_attributes() __attribute__((unused));
 static void refresh_screen_with_paragraph_attributes() __attribute__((unused));
@@ -337,7 +432,19 @@ static void flush_window(int window_number) {
 static void history_has_to_be_remeasured() {
 
   if (bool_equal(is_history_empty(outputhistory[0]), false)) {
+    if (history_line_index_valid == true) {
+      // Invoked before the new screen size is applied, so this is the
+      // line length the index's counts have been measured at.
+      history_line_index_line_length
+        = z_windows[0]->xsize
+        - z_windows[0]->leftmargin
+        - z_windows[0]->rightmargin;
+    }
     history_is_being_remeasured = true;
+    history_line_index_valid = false;
+    remeasure_modified_tail_only = false;
+    viewport_remeasurement_pending = true;
+    first_viewport_paragraph = -1;
     z_windows[measurement_window_id]->nof_consecutive_lines_output = 0;
   }
 }
@@ -351,7 +458,11 @@ static void refresh_scrollbar() {
   z_rgb_colour scrollbar_background, scrollbar_foreground;
 
   scrollbar_background = new_z_rgb_colour(0xc0, 0xc0, 0xc0);
-  scrollbar_foreground = new_z_rgb_colour(0x40, 0x40, 0x40);
+  // An estimated history size is indicated by a lighter bar.
+  scrollbar_foreground
+    = total_lines_in_history_is_estimated == true
+    ? new_z_rgb_colour(0x80, 0x80, 0x80)
+    : new_z_rgb_colour(0x40, 0x40, 0x40);
 
   TRACE_LOG("Refreshing scrollbar.\n");
 
@@ -364,7 +475,8 @@ static void refresh_scrollbar() {
       green_from_z_rgb_colour(scrollbar_background),
       blue_from_z_rgb_colour(scrollbar_background));
 
-  if (history_is_being_remeasured == false) {
+  if ( (history_is_being_remeasured == false)
+      || (total_lines_in_history_is_estimated == true) ) {
 
     /*
     TRACE_LOG("bar_height #1:%d %d %d %d %d\n", bar_height,
@@ -447,8 +559,102 @@ static void switch_to_window(int window_id) {
   //refresh_cursor(active_z_window_id);
 }
 
+// Collects the line counts stored in the history's paragraph attributes.
+// Rewinding without output doesn't involve any layout, so this is much
+// cheaper than remeasuring the paragraphs.
+static void collect_stored_paragraph_lines() {
+  history_output *attribute_history;
+  int paragraph_attr1, paragraph_attr2;
+  bool attributes_usable = true;
+
+  nof_stored_paragraph_lines = 0;
+
+  // Attributes measured with other fonts or margins can't be trusted, but
+  // the paragraphs are still counted.
+  if ( (paragraph_attributes_font_configuration != font_configuration)
+      || (paragraph_attributes_margins
+        != z_windows[0]->leftmargin + z_windows[0]->rightmargin) ) {
+    TRACE_LOG("Paragraph attributes from different configuration.\n");
+    attributes_usable = false;
+  }
+
+  if ((attribute_history = init_history_output(
+          outputhistory[0],
+          &recording_history_target,
+          Z_HISTORY_OUTPUT_WITHOUT_EXTRAS)) == NULL) {
+    return;
+  }
+
+  paragraph_attr1 = 0;
+  paragraph_attr2 = 0;
+  while (output_rewind_paragraph(attribute_history, NULL,
+        &paragraph_attr1, &paragraph_attr2) == 0) {
+    if (nof_stored_paragraph_lines == stored_paragraph_lines_size) {
+      stored_paragraph_lines_size
+        = stored_paragraph_lines_size > 0
+        ? stored_paragraph_lines_size * 2
+        : 1024;
+      stored_paragraph_lines = fizmo_realloc(
+          stored_paragraph_lines,
+          stored_paragraph_lines_size * sizeof(int));
+    }
+
+    // The unfinished last paragraph has no line count stored yet.
+    stored_paragraph_lines[nof_stored_paragraph_lines++]
+      = ( (attributes_usable == true)
+          && (paragraph_attr1 > 0)
+          && (paragraph_attr2 == z_windows[0]->xsize) )
+      ? paragraph_attr1
+      : -1;
+
+    paragraph_attr1 = 0;
+    paragraph_attr2 = 0;
+  }
+
+  destroy_history_output(attribute_history);
+
+  TRACE_LOG("Collected %ld stored paragraph attributes.\n",
+      nof_stored_paragraph_lines);
+}
+
+
+// Returns the stored line count of a paragraph counted from the history's
+// top, or -1 in case it has to be remeasured.
+static int get_stored_paragraph_lines(long paragraph) {
+  return paragraph < nof_stored_paragraph_lines
+    ? stored_paragraph_lines[nof_stored_paragraph_lines - 1 - paragraph]
+    : -1;
+}
+
+
+// Returns the number of paragraphs, counted from the top, whose stored
+// line counts agree with the history line index. These are the ones which
+// haven't been modified since the index was valid.
+static long count_unmodified_paragraphs() {
+  long paragraph, nof_paragraphs = get_history_line_index_nof_paragraphs();
+  long lines_above = 0, next_lines_above;
+  int stored_lines;
+
+  for (paragraph=0;
+      (paragraph < nof_paragraphs)
+      && (paragraph < nof_stored_paragraph_lines);
+      paragraph++) {
+    stored_lines = get_stored_paragraph_lines(paragraph);
+    next_lines_above = get_history_line_index_lines_above(paragraph + 1);
+    if ( (stored_lines < 1)
+        || (next_lines_above - lines_above != stored_lines) ) {
+      break;
+    }
+    lines_above = next_lines_above;
+  }
+
+  return paragraph;
+}
+
+
 static int init_history_remeasurement() {
   int last_active_z_window_id;
+  long i, first_paragraph = 0;
 
   TRACE_LOG("total_nof_lines_stored: %ld\n", total_nof_lines_stored);
 
@@ -540,35 +746,154 @@ static int init_history_remeasurement() {
     return -1;
   }
 
+  collect_stored_paragraph_lines();
+
+  if (remeasure_modified_tail_only == true) {
+    first_paragraph = count_unmodified_paragraphs();
+  }
+  else if (viewport_remeasurement_pending == true) {
+    remeasure_viewport_paragraphs();
+  }
+  viewport_remeasurement_pending = false;
+
   TRACE_LOG("creating output history for re-measurement.\n");
 
-  if ((measurement_history = init_history_output(
-          outputhistory[0],
-          &history_target,
-          Z_HISTORY_OUTPUT_FROM_BUFFERBACK
-          + Z_HISTORY_OUTPUT_WITHOUT_VALIDATION)) == NULL) {
-    TRACE_LOG("Could not create history.\n");
+  if (first_paragraph > 0) {
+    // Since the history can only be walked one paragraph at a time, the
+    // unmodified paragraphs are skipped by rewinding from the bottom to
+    // the first modified one.
+    TRACE_LOG("Remeasuring from paragraph %ld of %ld.\n",
+        first_paragraph, nof_stored_paragraph_lines);
+    z_windows[measurement_window_id]->nof_consecutive_lines_output
+      = get_history_line_index_lines_above(first_paragraph);
+    nof_remeasured_paragraphs = first_paragraph;
+
+    if ((measurement_history = init_history_output(
+            outputhistory[0],
+            &recording_history_target,
+            Z_HISTORY_OUTPUT_WITHOUT_VALIDATION)) == NULL) {
+      TRACE_LOG("Could not create history.\n");
+    }
+    else {
+      for (i=first_paragraph; i<nof_stored_paragraph_lines; i++) {
+        output_rewind_paragraph(measurement_history, NULL, NULL, NULL);
+      }
+    }
+  }
+  else {
+    // Remeasurement starts at the history's top.
+    z_windows[measurement_window_id]->nof_consecutive_lines_output = 0;
+    nof_remeasured_paragraphs = 0;
+
+    if ((measurement_history = init_history_output(
+            outputhistory[0],
+            &recording_history_target,
+            Z_HISTORY_OUTPUT_FROM_BUFFERBACK
+            + Z_HISTORY_OUTPUT_WITHOUT_VALIDATION)) == NULL) {
+      TRACE_LOG("Could not create history.\n");
+    }
   }
 
   return last_active_z_window_id;
 }
 
 
-static void remeasure_next_paragraph() {
-  int return_code, last_lines_in_history, lines_in_paragraph;
+// Returns the number of the topmost paragraph in the index from which on
+// all paragraphs down to the history's bottom have been remeasured.
+static long get_first_remeasured_bottom_paragraph() {
+  return ( (first_viewport_paragraph >= 0)
+      && (first_viewport_paragraph > nof_remeasured_paragraphs) )
+    ? first_viewport_paragraph
+    : nof_remeasured_paragraphs;
+}
+
+
+// Sums up the paragraphs already remeasured at the top and the bottom and
+// scales the remaining paragraphs' line counts from the old to the new
+// line length, assuming the number of lines is inversely proportional to
+// the line length.
+static void estimate_total_lines_in_history(int line_length) {
+  long remeasured_lines
+    = get_history_line_index_lines_above(nof_remeasured_paragraphs);
+  long bottom_lines_above
+    = get_history_line_index_lines_above(
+        get_first_remeasured_bottom_paragraph());
+  long remaining_lines = bottom_lines_above - remeasured_lines;
+
+  if ( (line_length <= 0) || (history_line_index_line_length <= 0) ) {
+    return;
+  }
+
+  total_lines_in_history
+    = remeasured_lines
+    + get_history_line_index_nof_lines() - bottom_lines_above
+    + (remaining_lines * history_line_index_line_length + line_length - 1)
+    / line_length;
+  total_lines_in_history_is_estimated = true;
+
+  TRACE_LOG("Estimated %ld lines in history.\n", total_lines_in_history);
+}
 
-  last_lines_in_history
-    = z_windows[measurement_window_id]->nof_consecutive_lines_output;
 
-  return_code
+// Measures the next paragraph from measurement_history, which is the
+// paragraph'th from the history's top, and stores its line count in the
+// paragraph's attributes. Returns the number of lines, *return_code is
+// set to the result of output_repeat_paragraphs.
+static int measure_next_paragraph(long paragraph, int *return_code) {
+  int last_lines_in_history, lines_in_paragraph, line_length;
+  int stored_lines = -1;
+  struct z_window *window = z_windows[measurement_window_id];
+  line_break_cache_entry *cache_entry = NULL;
+  bool use_line_break_cache;
+
+  last_lines_in_history = window->nof_consecutive_lines_output;
+  line_length = window->xsize - window->leftmargin - window->rightmargin;
+
+  // Cached line breaks may only be used in case the paragraph starts at
+  // the beginning of an empty line.
+  use_line_break_cache
+    = freetype_wordwrap_is_at_line_start(window->wordwrapper);
+
+  start_paragraph_recording(measurement_window_id);
+  *return_code
     = output_repeat_paragraphs(measurement_history, 1, true, true);
-  if (return_code >= 0) {
-    z_ucs_output(newline_string);
+  recording_paragraph = false;
+
+  if (*return_code >= 0) {
+    add_history_paragraph_text(&recorded_paragraph, newline_string, 1);
+  }
+  else {
+    use_line_break_cache = false;
+  }
+
+  if (use_line_break_cache == true) {
+    stored_lines = get_stored_paragraph_lines(paragraph);
+  }
+
+  if (stored_lines > 0) {
+    // The paragraph was measured at the current width before, so its
+    // stored line count is used as is.
+    output_history_paragraph(&recorded_paragraph, false);
+    flush_window(measurement_window_id);
+    window->nof_consecutive_lines_output += stored_lines;
+    window->nof_lines_in_current_paragraph += stored_lines;
+  }
+  else if (use_line_break_cache == true) {
+    // The paragraph's lines are known from the cache or its layout, so
+    // only the style changes have to be applied.
+    cache_entry = get_recorded_paragraph_line_breaks(line_length);
+    output_history_paragraph(&recorded_paragraph, false);
+    flush_window(measurement_window_id);
+    window->nof_consecutive_lines_output += cache_entry->nof_lines;
+    window->nof_lines_in_current_paragraph += cache_entry->nof_lines;
+  }
+  else {
+    output_history_paragraph(&recorded_paragraph, true);
+    flush_window(measurement_window_id);
   }
-  flush_window(measurement_window_id);
 
   lines_in_paragraph
-    = z_windows[measurement_window_id]->nof_consecutive_lines_output
+    = window->nof_consecutive_lines_output
     - last_lines_in_history;
 
   alter_last_read_paragraph_attributes(
@@ -576,6 +901,30 @@ static void remeasure_next_paragraph() {
       lines_in_paragraph,
       z_windows[0]->xsize);
 
+  return lines_in_paragraph;
+}
+
+
+static void remeasure_next_paragraph() {
+  int return_code, lines_in_paragraph;
+  struct z_window *window = z_windows[measurement_window_id];
+
+  lines_in_paragraph
+    = measure_next_paragraph(nof_remeasured_paragraphs, &return_code);
+
+  if (return_code >= 0) {
+    if (nof_remeasured_paragraphs < get_history_line_index_nof_paragraphs()) {
+      set_history_line_index_paragraph(
+          nof_remeasured_paragraphs,
+          lines_in_paragraph != 0 ? lines_in_paragraph : 1);
+    }
+    else {
+      append_history_line_index_paragraph(
+          lines_in_paragraph != 0 ? lines_in_paragraph : 1);
+    }
+    nof_remeasured_paragraphs++;
+  }
+
   TRACE_LOG("Remeasured paragraph had %d lines.\n", lines_in_paragraph);
 
   if (return_code < 0) {
@@ -583,6 +932,14 @@ static void remeasure_next_paragraph() {
     TRACE_LOG("output_repeat_paragraphs returned < 0.\n");
     flush_window(measurement_window_id);
     history_is_being_remeasured = false;
+    truncate_history_line_index(nof_remeasured_paragraphs);
+    history_line_index_valid = true;
+    total_lines_in_history_is_estimated = false;
+    paragraph_attributes_font_configuration = font_configuration;
+    paragraph_attributes_margins
+      = z_windows[0]->leftmargin + z_windows[0]->rightmargin;
+    remeasure_modified_tail_only = false;
+    first_viewport_paragraph = -1;
     total_lines_in_history
       = z_windows[measurement_window_id]->nof_consecutive_lines_output - 1;
     //printf("remeasure: total_lines_in_history: %ld.\n",
@@ -595,7 +952,105 @@ static void remeasure_next_paragraph() {
     // Not finished, process next paragraph.
     //printf("nof_consecutive_lines_output: %d.\n",
     //    z_windows[measurement_window_id]->nof_consecutive_lines_output);
+    estimate_total_lines_in_history(
+        window->xsize - window->leftmargin - window->rightmargin);
+  }
+}
+
+
+// Remeasures the paragraphs at the history's bottom which are required to
+// show the screen and the first page up. Like remeasuring the modified
+// tail, this rewinds from the bottom and then reads forward, so the
+// paragraphs' attributes can be updated on the way. The new counts are
+// also kept as stored line counts, so the following pass from the top
+// doesn't have to lay them out again.
+static void remeasure_viewport_paragraphs() {
+  struct z_window *window = z_windows[measurement_window_id];
+  int line_length = window->xsize - window->leftmargin - window->rightmargin;
+  int return_code, lines_in_paragraph;
+  long nof_lines, nof_paragraphs, paragraph, i;
+
+  if ( (line_length <= 0) || (history_line_index_line_length <= 0) ) {
+    return;
+  }
+
+  // The lines required at the new line length are converted to the old
+  // one, which the index's counts have been measured at.
+  nof_lines
+    = (2 * (z_windows[0]->ysize / line_height + 1) * (long)line_length)
+    / history_line_index_line_length + 1;
+  nof_paragraphs = find_history_line_index_paragraphs_below(nof_lines) + 1;
+  if (nof_paragraphs > nof_stored_paragraph_lines) {
+    nof_paragraphs = nof_stored_paragraph_lines;
+  }
+
+  if ((measurement_history = init_history_output(
+          outputhistory[0],
+          &recording_history_target,
+          Z_HISTORY_OUTPUT_WITHOUT_VALIDATION)) == NULL) {
+    TRACE_LOG("Could not create history.\n");
+    return;
+  }
+
+  TRACE_LOG("Remeasuring the bottommost %ld paragraphs first.\n",
+      nof_paragraphs);
+
+  for (i=0; i<nof_paragraphs; i++) {
+    output_rewind_paragraph(measurement_history, NULL, NULL, NULL);
   }
+
+  window->nof_consecutive_lines_output = 0;
+  paragraph = nof_stored_paragraph_lines - nof_paragraphs;
+  first_viewport_paragraph = paragraph;
+  nof_remeasured_paragraphs = 0;
+
+  do {
+    lines_in_paragraph = measure_next_paragraph(paragraph, &return_code);
+
+    if (return_code >= 0) {
+      if (paragraph < get_history_line_index_nof_paragraphs()) {
+        set_history_line_index_paragraph(
+            paragraph,
+            lines_in_paragraph != 0 ? lines_in_paragraph : 1);
+      }
+      if ( (lines_in_paragraph > 0)
+          && (paragraph < nof_stored_paragraph_lines) ) {
+        stored_paragraph_lines[nof_stored_paragraph_lines - 1 - paragraph]
+          = lines_in_paragraph;
+      }
+      paragraph++;
+    }
+  }
+  while (return_code >= 0);
+
+  flush_window(measurement_window_id);
+  destroy_history_output(measurement_history);
+  measurement_history = NULL;
+
+  // Remeasurement continues at the history's top on an empty line.
+  freetype_wordwrap_reset_position(window->wordwrapper);
+  window->xcursorpos = window->leftmargin;
+  window->rightmost_filled_xpos = window->xcursorpos;
+  window->last_gylphs_xcursorpos = -1;
+  window->nof_lines_in_current_paragraph = 0;
+
+  estimate_total_lines_in_history(line_length);
+}
+
+
+// Reflows the paragraph layouts known from earlier measurements in the
+// background, so that remeasure_next_paragraph will mostly find the line
+// breaks for the new line length in the cache.
+static void start_background_remeasurement() {
+#ifdef ENABLE_THREADED_REMEASUREMENT
+  struct z_window *window = z_windows[measurement_window_id];
+
+  start_background_layout_reflow(
+      window->xsize - window->leftmargin - window->rightmargin,
+      hyphenation_enabled,
+      font_configuration,
+      get_line_break_configuration());
+#endif // ENABLE_THREADED_REMEASUREMENT
 }
 
 
@@ -610,29 +1065,129 @@ static void end_history_remeasurement(int last_active_z_window_id) {
 }
 
 
+static long get_monotonic_millis() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+// Returns the next event from the screen interface. Since dragging a
+// window's border produces a stream of resize events, each of which would
+// cause the history to be remeasured and the screen to be redrawn, a
+// resize is only reported once no further resize has arrived for
+// resize_coalescing_time milliseconds. An event other than a resize which
+// ends the wait is kept and returned by the next invocation. The waits
+// never extend beyond the caller's timeout; once it has passed,
+// EVENT_WAS_TIMEOUT is returned and the resize is reported next time.
+static int get_coalesced_event(z_ucs *input, int timeout_millis,
+    bool poll_only, bool history_finished_remeasuring) {
+  int event_type, coalescing_millis;
+  long deadline = 0, remaining_millis;
+  bool has_deadline = ( (poll_only == false) && (timeout_millis > 0) );
+
+  if (pending_event_type != EVENT_WAS_NOTHING) {
+    event_type = pending_event_type;
+    *input = pending_event_input;
+    pending_event_type = EVENT_WAS_NOTHING;
+    return event_type;
+  }
+
+  if (has_deadline == true) {
+    deadline = get_monotonic_millis() + timeout_millis;
+  }
+
+  event_type = screen_pixel_interface->get_next_event(
+      input, timeout_millis, poll_only, history_finished_remeasuring);
+
+  if ( (event_type != EVENT_WAS_WINCH) || (resize_coalescing_time <= 0) ) {
+    return event_type;
+  }
+
+  do {
+    coalescing_millis = resize_coalescing_time;
+    if (has_deadline == true) {
+      remaining_millis = deadline - get_monotonic_millis();
+      if (remaining_millis <= 0) {
+        TRACE_LOG("Timeout while coalescing resize.\n");
+        pending_event_type = EVENT_WAS_WINCH;
+        return EVENT_WAS_TIMEOUT;
+      }
+      if (remaining_millis < coalescing_millis) {
+        coalescing_millis = remaining_millis;
+      }
+    }
+
+    // Without timeout support, only resizes which are already queued can
+    // be coalesced.
+    event_type
+      = screen_pixel_interface->is_input_timeout_available() == true
+      ? screen_pixel_interface->get_next_event(
+          &pending_event_input, coalescing_millis, false, false)
+      : screen_pixel_interface->get_next_event(
+          &pending_event_input, 0, true, false);
+    TRACE_LOG("Coalescing resize, next event: %d.\n", event_type);
+  }
+  while (event_type == EVENT_WAS_WINCH);
+
+  if ( (event_type == EVENT_WAS_TIMEOUT)
+      && (coalescing_millis < resize_coalescing_time) ) {
+    // The caller's timeout ended the wait, not the absence of resizes.
+    pending_event_type = EVENT_WAS_WINCH;
+    return EVENT_WAS_TIMEOUT;
+  }
+
+  if ( (event_type != EVENT_WAS_TIMEOUT)
+      && (event_type != EVENT_WAS_NOTHING) ) {
+    pending_event_type = event_type;
+  }
+
+  return EVENT_WAS_WINCH;
+}
+
+
 static int get_next_event_wrapper(z_ucs *input, int timeout_millis) {
   int event_type = EVENT_WAS_NOTHING, last_active_z_window_id;
   int result;
+  bool index_was_valid;
 
   TRACE_LOG("get_next_event_wrapper, history_is_being_remeasured: %d.\n",
       history_is_being_remeasured);
 
   if (refresh_due_to_history_modification == true) {
     refresh_due_to_history_modification = false;
+    index_was_valid = history_line_index_valid;
     history_has_to_be_remeasured();
+    // Restores and undos only modify the history's tail, so the line counts
+    // of the paragraphs above it may be kept.
+    if ( (index_was_valid == true) && (history_is_being_remeasured == true) ) {
+      remeasure_modified_tail_only = true;
+    }
     refresh_screen();
     screen_pixel_interface->update_screen();
   }
 
-  if (history_is_being_remeasured == true) {
+  // While scrolled back, the scrollback's history output is in use, so
+  // remeasurement has to wait until scrolling ends.
+  if ( (history_is_being_remeasured == true) && (history == NULL) ) {
 
     last_active_z_window_id = init_history_remeasurement();
+    start_background_remeasurement();
 
     do {
+#ifdef ENABLE_THREADED_REMEASUREMENT
+      merge_finished_background_layout_reflows();
+#endif // ENABLE_THREADED_REMEASUREMENT
       remeasure_next_paragraph();
+      if ( (history_is_being_remeasured == true)
+          && (nof_remeasured_paragraphs
+            % SCROLLBAR_ESTIMATE_REFRESH_INTERVAL == 0) ) {
+        refresh_scrollbar();
+        screen_pixel_interface->update_screen();
+      }
       TRACE_LOG("Polling for next event.\n");
-      event_type = screen_pixel_interface->get_next_event(
-          input, timeout_millis, true, false);
+      event_type = get_coalesced_event(input, timeout_millis, true, false);
       TRACE_LOG("event_type: %d\n", event_type);
     }
     while ( (history_is_being_remeasured == true)
@@ -652,7 +1207,7 @@ static int get_next_event_wrapper(z_ucs *input, int timeout_millis) {
 
   TRACE_LOG("Waiting for next event.\n");
 
-  result = screen_pixel_interface->get_next_event(
+  result = get_coalesced_event(
       input, timeout_millis, false, history_finished_remeasuring);
   history_finished_remeasuring = false;
   return result;
@@ -1124,20 +1679,32 @@ static int process_glyph(z_ucs charcode, int window_number,
 // bottom-right position).
 static int process_glyph_string(z_ucs *z_ucs_output, int window_number,
     true_type_font *font, bool *no_more_space) {
-  bool my_no_more_space = false;
-  int result = 0;
-
   TRACE_LOG("Processing glyph string: \"");
   TRACE_LOG_Z_UCS(z_ucs_output);
   TRACE_LOG("\" for window %d.\n", window_number);
 
-  while ((*z_ucs_output) && (my_no_more_space == false)) {
+  return process_glyphs(z_ucs_output, z_ucs_len(z_ucs_output), window_number,
+      font, no_more_space);
+}
+
+
+// Same as process_glyph_string, but processes the len glyphs at "glyphs",
+// which don't have to be zero-terminated.
+static int process_glyphs(const z_ucs *glyphs, size_t len, int window_number,
+    true_type_font *font, bool *no_more_space) {
+  bool my_no_more_space = false;
+  int result = 0;
+  size_t i = 0;
+
+  TRACE_LOG("Processing %zu glyphs for window %d.\n", len, window_number);
+
+  while ((i < len) && (my_no_more_space == false)) {
     result += process_glyph(
-        *z_ucs_output,
+        glyphs[i],
         window_number,
         font,
         &my_no_more_space);
-    z_ucs_output++;
+    i++;
   }
 
   if ((my_no_more_space == true) && (no_more_space != NULL)) {
@@ -1163,6 +1730,34 @@ static void wordwrap_output_colour(void *window_number, uint32_t color_data) {
 }
 
 
+// Style fonts are loaded the first time they're requested. In case
+// filename is not set, is the same as the one of the font the style
+// derives from or cannot be loaded, the fallback font is used instead.
+static true_type_font *require_font(true_type_font **font, char *filename,
+    char *fallback_filename, true_type_font *fallback_font) {
+
+  if (*font == NULL) {
+    if ( (filename == NULL)
+        || ( (fallback_filename != NULL)
+          && (strcmp(filename, fallback_filename) == 0) )
+        || ((*font = create_true_type_font(font_factory, filename,
+              font_height_in_pixel, line_height)) == NULL) ) {
+      *font = fallback_font;
+    }
+    TRACE_LOG("Loaded font %s: %p.\n",
+        filename != NULL ? filename : "(null)", *font);
+  }
+
+  return *font;
+}
+
+
+static true_type_font *require_fixed_regular_font() {
+  return require_font(&fixed_regular_font, fixed_regular_font_filename,
+      regular_font_filename, regular_font);
+}
+
+
 static true_type_font *evaluate_font(z_style text_style, z_font font) {
   true_type_font *result;
   TRACE_LOG("evaluate-font: style %d, font %d.\n", text_style, font);
@@ -1171,36 +1766,45 @@ static true_type_font *evaluate_font(z_style text_style, z_font font) {
       || (text_style & Z_STYLE_FIXED_PITCH) ) {
     if (text_style & Z_STYLE_BOLD) {
       if (text_style & Z_STYLE_ITALIC) {
-        result = fixed_bold_italic_font;
+        result = require_font(&fixed_bold_italic_font,
+            fixed_bold_italic_font_filename, fixed_regular_font_filename,
+            require_fixed_regular_font());
         TRACE_LOG("evaluted font: fixed_bold_italic_font\n");
       }
       else {
-        result = fixed_bold_font;
+        result = require_font(&fixed_bold_font,
+            fixed_bold_font_filename, fixed_regular_font_filename,
+            require_fixed_regular_font());
         TRACE_LOG("evaluted font: fixed_bold_font\n");
       }
     }
     else if (text_style & Z_STYLE_ITALIC) {
-      result = fixed_italic_font;
+      result = require_font(&fixed_italic_font,
+          fixed_italic_font_filename, fixed_regular_font_filename,
+          require_fixed_regular_font());
       TRACE_LOG("evaluted font: fixed_italic_font\n");
     }
     else {
-      result = fixed_regular_font;
+      result = require_fixed_regular_font();
       TRACE_LOG("evaluted font: fixed_regular_font\n");
     }
   }
   else {
     if (text_style & Z_STYLE_BOLD) {
       if (text_style & Z_STYLE_ITALIC) {
-        result = bold_italic_font;
+        result = require_font(&bold_italic_font,
+            bold_italic_font_filename, regular_font_filename, regular_font);
         TRACE_LOG("evaluted font: bold_italic_font\n");
       }
       else {
-        result = bold_font;
+        result = require_font(&bold_font,
+            bold_font_filename, regular_font_filename, regular_font);
         TRACE_LOG("evaluted font: bold_font\n");
       }
     }
     else if (text_style & Z_STYLE_ITALIC) {
-      result = italic_font;
+      result = require_font(&italic_font,
+          italic_font_filename, regular_font_filename, regular_font);
       TRACE_LOG("evaluted font: italic_font\n");
     }
     else {
@@ -1256,15 +1860,14 @@ static void flush_all_buffered_windows() {
 }
 
 
-void z_ucs_output_window_target(z_ucs *z_ucs_output,
+void z_ucs_output_window_target(const z_ucs *z_ucs_output, size_t len,
     void *window_number_as_void) {
   int window_number = *((int*)window_number_as_void);
 
-  TRACE_LOG("drawing glyph string: \"");
-  TRACE_LOG_Z_UCS(z_ucs_output);
-  TRACE_LOG("\".\n");
-  process_glyph_string(
+  TRACE_LOG("drawing %zu glyphs.\n", len);
+  process_glyphs(
       z_ucs_output,
+      len,
       window_number,
       z_windows[window_number]->output_true_type_font,
       NULL);
@@ -1425,6 +2028,9 @@ static int parse_config_parameter(char *key, char *value) {
     else
       hyphenation_enabled = true;
     free(value);
+    if (interface_open == true) {
+      update_font_configuration();
+    }
     return 0;
   }
   else if (strcasecmp(key, "regular-font") == 0) {
@@ -1517,6 +2123,46 @@ static int parse_config_parameter(char *key, char *value) {
     pixel_cursor_colour = color_code;
     return 0;
   }
+  else if (strcasecmp(key, "glyph-preload-ranges") == 0) {
+    if (parse_glyph_preload_ranges(value, NULL) == -1) {
+      if (value != NULL)
+        free(value);
+      return -1;
+    }
+    if (glyph_preload_ranges != NULL)
+      free(glyph_preload_ranges);
+    glyph_preload_ranges = value;
+    return 0;
+  }
+  else if (strcasecmp(key, "font-cache-size") == 0) {
+    if ( (value == NULL) || (strlen(value) == 0) )
+      return -1;
+    long_value = strtol(value, &endptr, 10);
+    free(value);
+    if ( (*endptr != 0) || (long_value < 0) )
+      return -1;
+    font_cache_size = long_value;
+    return 0;
+  }
+  else if (strcasecmp(key, "resize-coalescing-time") == 0) {
+    if ( (value == NULL) || (strlen(value) == 0) )
+      return -1;
+    long_value = strtol(value, &endptr, 10);
+    free(value);
+    if ( (*endptr != 0) || (long_value < 0) )
+      return -1;
+    resize_coalescing_time = long_value;
+    return 0;
+  }
+  else if (strcasecmp(key, "font-index-cache-file") == 0) {
+    if (font_index_cache_filename != NULL)
+      free(font_index_cache_filename);
+    font_index_cache_filename
+      = ( (value != NULL) && (*value == 0) ) ? NULL : value;
+    if ( (value != NULL) && (*value == 0) )
+      free(value);
+    return 0;
+  }
   else {
     return screen_pixel_interface->parse_config_parameter(key, value);
   }
@@ -1580,6 +2226,24 @@ static char *get_config_value(char *key)
   else if (strcasecmp(key, "cursor-color") == 0) {
     return z_colour_names[pixel_cursor_colour];
   }
+  else if (strcasecmp(key, "glyph-preload-ranges") == 0) {
+    return glyph_preload_ranges != NULL
+      ? glyph_preload_ranges
+      : DEFAULT_GLYPH_PRELOAD_RANGES;
+  }
+  else if (strcasecmp(key, "font-index-cache-file") == 0) {
+    return font_index_cache_filename;
+  }
+  else if (strcasecmp(key, "font-cache-size") == 0) {
+    snprintf(last_font_cache_size_config_value_as_string,
+        MAX_VALUE_AS_STRING_LEN, "%ld", font_cache_size);
+    return last_font_cache_size_config_value_as_string;
+  }
+  else if (strcasecmp(key, "resize-coalescing-time") == 0) {
+    snprintf(last_resize_coalescing_time_config_value_as_string,
+        MAX_VALUE_AS_STRING_LEN, "%ld", resize_coalescing_time);
+    return last_resize_coalescing_time_config_value_as_string;
+  }
   else {
     return screen_pixel_interface->get_config_value(key);
   }
@@ -1616,11 +2280,15 @@ static void z_ucs_output(z_ucs *z_ucs_output) {
       if (bool_equal(z_windows[active_z_window_id]->buffering, false)) {
         z_ucs_output_window_target(
             z_ucs_output,
+            z_ucs_len(z_ucs_output),
             (void*)(&z_windows[active_z_window_id]->window_number));
       }
       else {
         freetype_wrap_z_ucs(
-            z_windows[active_z_window_id]->wordwrapper, z_ucs_output, false);
+            z_windows[active_z_window_id]->wordwrapper,
+            z_ucs_output,
+            z_ucs_len(z_ucs_output),
+            false);
       }
     }
     TRACE_LOG("z_ucs_output finished.\n");
@@ -1629,10 +2297,8 @@ static void z_ucs_output(z_ucs *z_ucs_output) {
 
 
 static void update_fixed_width_char_width() {
-  int bitmap_width;
-
-  tt_get_glyph_size(
-      fixed_regular_font, '0', &fixed_width_char_width, &bitmap_width);
+  tt_get_glyph_size(require_fixed_regular_font(),
+      '0', &fixed_width_char_width, NULL);
 
   //printf("fixed_width_char_width: %d\n", fixed_width_char_width);
 }
@@ -1705,6 +2371,7 @@ static void link_interface_to_story(struct z_story *story) {
   int x, y, x_offset, y_offset, pixel_left_shift;
   uint8_t red, green, blue;
   uint8_t *image_data;
+  uint8_t *row_data = NULL, *row_ptr;
   z_ucs input;
   z_rgb_colour background_colour;
   int event_code = EVENT_WAS_NOTHING;
@@ -1725,7 +2392,9 @@ static void link_interface_to_story(struct z_story *story) {
       green_from_z_rgb_colour(background_colour),
       blue_from_z_rgb_colour(background_colour));
 
-  font_factory = create_true_type_factory(font_search_path);
+  font_factory = create_true_type_factory(
+      font_search_path, glyph_preload_ranges, font_index_cache_filename,
+      font_cache_size);
 
   if (regular_font_filename == NULL) {
     set_configuration_value("regular-font", "FiraGO-Regular.ttf");
@@ -1747,79 +2416,19 @@ static void link_interface_to_story(struct z_story *story) {
 
   regular_font = create_true_type_font(font_factory, regular_font_filename,
       font_height_in_pixel, line_height);
-
-  if ( (italic_font_filename == NULL)
-      || (strcmp(italic_font_filename, regular_font_filename) == 0) ) {
-    italic_font = regular_font;
-    italic_font_available = false;
-  }
-  else {
-    italic_font = create_true_type_font(font_factory, italic_font_filename,
-        font_height_in_pixel, line_height);
-    italic_font_available = true;
-  }
-
-  if ( (bold_font_filename == NULL)
-      || (strcmp(bold_font_filename, regular_font_filename) == 0) ) {
-    bold_font = regular_font;
-    bold_font_available = false;
-  }
-  else {
-    bold_font = create_true_type_font(font_factory, bold_font_filename,
-        font_height_in_pixel, line_height);
-    bold_font_available = true;
-  }
-
-  if ( (bold_italic_font_filename == NULL)
-      || (strcmp(bold_italic_font_filename, regular_font_filename) == 0) ) {
-    bold_italic_font = regular_font;
-  }
-  else {
-    bold_italic_font
-      = create_true_type_font(font_factory, bold_italic_font_filename,
-          font_height_in_pixel, line_height);
-  }
-
-  if ( (fixed_regular_font_filename == NULL)
-      || (strcmp(fixed_regular_font_filename, regular_font_filename) == 0) ) {
-    fixed_regular_font = regular_font;
-    fixed_font_available = false;
-  }
-  else {
-    fixed_regular_font = create_true_type_font(font_factory,
-        fixed_regular_font_filename, font_height_in_pixel, line_height);
-    fixed_font_available = true;
-  }
-
-  if ( (fixed_italic_font_filename == NULL)
-      || (strcmp(fixed_italic_font_filename,
-          fixed_regular_font_filename) == 0) ) {
-    fixed_italic_font = fixed_regular_font;
-  }
-  else {
-    fixed_italic_font = create_true_type_font(font_factory,
-        fixed_italic_font_filename, font_height_in_pixel, line_height);
-  }
-
-  if ( (fixed_bold_font_filename == NULL)
-      || (strcmp(fixed_bold_font_filename,
-          fixed_regular_font_filename) == 0) ) {
-    fixed_bold_font = fixed_regular_font;
-  }
-  else {
-    fixed_bold_font = create_true_type_font(font_factory,
-        fixed_bold_font_filename, font_height_in_pixel, line_height);
-  }
-
-  if ( (fixed_bold_italic_font_filename == NULL)
-      || (strcmp(fixed_bold_italic_font_filename,
-          fixed_regular_font_filename) == 0) ) {
-    fixed_bold_italic_font = fixed_regular_font;
-  }
-  else {
-    fixed_bold_italic_font = create_true_type_font(font_factory,
-        fixed_bold_italic_font_filename, font_height_in_pixel, line_height);
-  }
+  update_font_configuration();
+  init_history_paragraph(&recorded_paragraph);
+
+  // All other styles are loaded on first use by evaluate_font().
+  italic_font_available
+    = ( (italic_font_filename != NULL)
+        && (strcmp(italic_font_filename, regular_font_filename) != 0) );
+  bold_font_available
+    = ( (bold_font_filename != NULL)
+        && (strcmp(bold_font_filename, regular_font_filename) != 0) );
+  fixed_font_available
+    = ( (fixed_regular_font_filename != NULL)
+        && (strcmp(fixed_regular_font_filename, regular_font_filename) != 0) );
 
   update_fixed_width_char_width();
 
@@ -1910,7 +2519,8 @@ static void link_interface_to_story(struct z_story *story) {
         if (ver != 6) {
           z_windows[i]->font_type = Z_FONT_COURIER_FIXED_PITCH;
           z_windows[i]->output_font = Z_FONT_COURIER_FIXED_PITCH;
-          z_windows[i]->output_true_type_font = fixed_regular_font;
+          z_windows[i]->output_true_type_font
+            = require_fixed_regular_font();
         }
       }
       else if (i == statusline_window_id) {
@@ -1936,7 +2546,8 @@ static void link_interface_to_story(struct z_story *story) {
       z_windows[i]->output_text_style = Z_STYLE_REVERSE_VIDEO;
       z_windows[i]->font_type = Z_FONT_NORMAL;
       z_windows[i]->output_font = Z_FONT_NORMAL;
-      z_windows[i]->output_true_type_font = bold_font;
+      z_windows[i]->output_true_type_font
+        = evaluate_font(Z_STYLE_BOLD, Z_FONT_NORMAL);
     }
     else {
       z_windows[i]->foreground_colour = default_foreground_colour;
@@ -2026,6 +2637,9 @@ static void link_interface_to_story(struct z_story *story) {
         libpixelif_module_name,
         i18n_libpixelif_TURNS);
 
+  paragraph_attributes_font_configuration = font_configuration;
+  paragraph_attributes_margins
+    = z_windows[0]->leftmargin + z_windows[0]->rightmargin;
   interface_open = true;
 
   // Advance the cursor for ZTUU. This will allow the player to read
@@ -2087,7 +2701,19 @@ static void link_interface_to_story(struct z_story *story) {
           pixel_left_shift = 8 - scaled_image->bits_per_sample;
           image_data = scaled_image->data;
 
+          // In case the screen interface can draw entire spans, we'll
+          // collect each image row before sending it. Rows are only filled
+          // for RGB and grayscale images, so other types never use spans.
+          if ( (screen_pixel_interface->draw_rgb_span != NULL)
+              && ( (scaled_image->image_type == DRILBO_IMAGE_TYPE_RGB)
+                || (scaled_image->image_type
+                  == DRILBO_IMAGE_TYPE_GRAYSCALE) ) ) {
+            row_data = (uint8_t*)fizmo_malloc(
+                sizeof(uint8_t) * 3 * scaled_image->width);
+          }
+
           for (y=0; y<scaled_image->height; y++) {
+            row_ptr = row_data;
             for (x=0; x<scaled_image->width; x++) {
 
               red = *(image_data++);
@@ -2107,12 +2733,19 @@ static void link_interface_to_story(struct z_story *story) {
                   blue >>= pixel_left_shift;
                 }
 
-                screen_pixel_interface->draw_rgb_pixel(
-                    y_offset + y,
-                    x_offset + x,
-                    red,
-                    green,
-                    blue);
+                if (row_data != NULL) {
+                  *(row_ptr++) = red;
+                  *(row_ptr++) = green;
+                  *(row_ptr++) = blue;
+                }
+                else {
+                  screen_pixel_interface->draw_rgb_pixel(
+                      y_offset + y,
+                      x_offset + x,
+                      red,
+                      green,
+                      blue);
+                }
               }
               else if (scaled_image->image_type==DRILBO_IMAGE_TYPE_GRAYSCALE) {
                 if (pixel_left_shift > 0) {
@@ -2122,14 +2755,34 @@ static void link_interface_to_story(struct z_story *story) {
                   red >>= pixel_left_shift;
                 }
 
-                screen_pixel_interface->draw_rgb_pixel(
-                    y_offset + y,
-                    x_offset + x,
-                    red,
-                    red,
-                    red);
+                if (row_data != NULL) {
+                  *(row_ptr++) = red;
+                  *(row_ptr++) = red;
+                  *(row_ptr++) = red;
+                }
+                else {
+                  screen_pixel_interface->draw_rgb_pixel(
+                      y_offset + y,
+                      x_offset + x,
+                      red,
+                      red,
+                      red);
+                }
               }
             }
+
+            if (row_data != NULL) {
+              screen_pixel_interface->draw_rgb_span(
+                  y_offset + y,
+                  x_offset,
+                  scaled_image->width,
+                  row_data);
+            }
+          }
+
+          if (row_data != NULL) {
+            free(row_data);
+            row_data = NULL;
           }
 
           free_zimage(scaled_image);
@@ -2164,6 +2817,12 @@ static int pixel_close_interface(z_ucs *error_message) {
   int event_type, i;
   z_ucs input;
 
+#ifdef ENABLE_THREADED_REMEASUREMENT
+  // The background workers read the paragraph layouts, so they have to
+  // be stopped before anything is freed.
+  cancel_background_layout_reflow();
+#endif // ENABLE_THREADED_REMEASUREMENT
+
   if ( (error_message == NULL) && (interface_open == true) ) {
     streams_latin1_output("[");
     i18n_translate(
@@ -2189,31 +2848,36 @@ static int pixel_close_interface(z_ucs *error_message) {
   }
   free(z_windows);
 
-  if (fixed_bold_italic_font != fixed_regular_font) {
+  if ( (fixed_bold_italic_font != NULL)
+      && (fixed_bold_italic_font != fixed_regular_font) ) {
     tt_destroy_font(fixed_bold_italic_font);
   }
 
-  if (fixed_bold_font != fixed_regular_font) {
+  if ( (fixed_bold_font != NULL)
+      && (fixed_bold_font != fixed_regular_font) ) {
     tt_destroy_font(fixed_bold_font);
   }
 
-  if (fixed_italic_font != fixed_regular_font) {
+  if ( (fixed_italic_font != NULL)
+      && (fixed_italic_font != fixed_regular_font) ) {
     tt_destroy_font(fixed_italic_font);
   }
 
-  if (fixed_regular_font != regular_font) {
+  if ( (fixed_regular_font != NULL)
+      && (fixed_regular_font != regular_font) ) {
     tt_destroy_font(fixed_regular_font);
   }
 
-  if (bold_italic_font != regular_font) {
+  if ( (bold_italic_font != NULL)
+      && (bold_italic_font != regular_font) ) {
     tt_destroy_font(bold_italic_font);
   }
 
-  if (bold_font != regular_font) {
+  if ( (bold_font != NULL) && (bold_font != regular_font) ) {
     tt_destroy_font(bold_font);
   }
 
-  if (italic_font != regular_font) {
+  if ( (italic_font != NULL) && (italic_font != regular_font) ) {
     tt_destroy_font(italic_font);
   }
 
@@ -2225,6 +2889,25 @@ static int pixel_close_interface(z_ucs *error_message) {
     destroy_true_type_factory(font_factory);
   }
 
+  free_hyphenation_cache();
+  free_line_break_cache();
+  free_history_line_index();
+  free_scrollback_cache();
+  if (stored_paragraph_lines != NULL) {
+    free(stored_paragraph_lines);
+    stored_paragraph_lines = NULL;
+    nof_stored_paragraph_lines = 0;
+    stored_paragraph_lines_size = 0;
+  }
+  free_paragraph_layout_cache();
+  free_history_paragraph(&recorded_paragraph);
+  if (recorded_line_breaks != NULL) {
+    free(recorded_line_breaks);
+    recorded_line_breaks = NULL;
+    nof_recorded_line_breaks = 0;
+    recorded_line_breaks_size = 0;
+  }
+
   interface_open = false;
   return 0;
 }
@@ -2480,8 +3163,433 @@ static history_output_target history_target =
 };
 
 
-static void preload_history_set_text_style(z_style UNUSED(text_style)) {
-}
+// The story's output and colour changes alter what scrolling back will
+// show, other than the same calls replaying the history, which is why the
+// interface uses these functions instead of z_ucs_output and set_colour.
+static void pixel_z_ucs_output(z_ucs *output) {
+  if ( (interface_open == true)
+      && (active_z_window_id == 0)
+      && (output != NULL)
+      && (*output != 0) ) {
+    invalidate_scrollback_cache();
+  }
+
+  z_ucs_output(output);
+}
+
+
+static void pixel_set_colour(z_colour foreground, z_colour background,
+    int16_t window_number) {
+  if ( (interface_open == true)
+      && ( (window_number == 0) || (window_number == -1) )
+      && ( (foreground != z_windows[0]->output_foreground_colour)
+        || (background != z_windows[0]->output_background_colour) ) ) {
+    invalidate_scrollback_cache();
+  }
+
+  set_colour(foreground, background, window_number);
+}
+
+
+// The recording target is used for history output which may be answered
+// from the line break cache. While recording_paragraph is set, everything
+// is stored in recorded_paragraph, otherwise it's passed on to the regular
+// output functions.
+static void record_text_style(z_style text_style) {
+  if (recording_paragraph == true) {
+    add_history_paragraph_event(&recorded_paragraph,
+        HISTORY_PARAGRAPH_TEXT_STYLE, text_style, 0, 0);
+  }
+  else {
+    set_text_style(text_style);
+  }
+}
+
+
+static void record_colour(z_colour foreground, z_colour background,
+    int16_t window_number) {
+  if (recording_paragraph == true) {
+    add_history_paragraph_event(&recorded_paragraph,
+        HISTORY_PARAGRAPH_COLOUR, foreground, background, window_number);
+  }
+  else {
+    set_colour(foreground, background, window_number);
+  }
+}
+
+
+static void record_font(z_font font) {
+  if (recording_paragraph == true) {
+    add_history_paragraph_event(&recorded_paragraph,
+        HISTORY_PARAGRAPH_FONT, font, 0, 0);
+  }
+  else {
+    set_font(font);
+  }
+}
+
+
+static void record_z_ucs_output(z_ucs *output) {
+  if (recording_paragraph == true) {
+    add_history_paragraph_text(&recorded_paragraph, output, z_ucs_len(output));
+  }
+  else {
+    z_ucs_output(output);
+  }
+}
+
+
+static history_output_target recording_history_target =
+{
+  &record_text_style,
+  &record_colour,
+  &record_font,
+  &record_z_ucs_output
+};
+
+
+static void start_paragraph_recording(int window_number) {
+  reset_history_paragraph(
+      &recorded_paragraph,
+      z_windows[window_number]->current_wrapper_style,
+      z_windows[window_number]->current_wrapper_font);
+  recording_paragraph = true;
+}
+
+
+// Font configurations and paragraphs are identified by FNV-1a hashes.
+static uint32_t add_to_configuration_hash(uint32_t hash, uint32_t value) {
+  return (hash ^ value) * 16777619u;
+}
+
+
+static uint32_t add_filename_to_configuration_hash(uint32_t hash,
+    char *filename) {
+  if (filename != NULL) {
+    while (*filename != 0) {
+      hash = add_to_configuration_hash(hash, (uint8_t)*filename);
+      filename++;
+    }
+  }
+  return add_to_configuration_hash(hash, 0xff);
+}
+
+
+static void update_font_configuration() {
+  char *filenames[] = {
+    regular_font_filename, italic_font_filename,
+    bold_font_filename, bold_italic_font_filename,
+    fixed_regular_font_filename, fixed_italic_font_filename,
+    fixed_bold_font_filename, fixed_bold_italic_font_filename };
+  uint32_t new_configuration = 2166136261u;
+  size_t i;
+
+  new_configuration = add_to_configuration_hash(
+      new_configuration, font_height_in_pixel);
+  new_configuration = add_to_configuration_hash(
+      new_configuration, hyphenation_enabled == true ? 1 : 0);
+  for (i=0; i<sizeof(filenames) / sizeof(char*); i++) {
+    new_configuration = add_filename_to_configuration_hash(
+        new_configuration, filenames[i]);
+  }
+
+  if (new_configuration != font_configuration) {
+    // Rows rendered with other fonts or line breaks can't be reused.
+    invalidate_scrollback_cache();
+    font_configuration = new_configuration;
+  }
+}
+
+
+// Since hyphenation depends on the current locale, which may be changed at
+// any time, it's added to the font configuration for every lookup.
+static uint32_t get_line_break_configuration() {
+  uint32_t configuration = font_configuration;
+  z_ucs *locale_name;
+
+  if ( (hyphenation_enabled == true)
+      && ((locale_name = get_current_locale_name()) != NULL) ) {
+    while (*locale_name != 0) {
+      configuration = add_to_configuration_hash(configuration, *locale_name);
+      locale_name++;
+    }
+  }
+
+  return configuration;
+}
+
+
+static void record_line_break(long position, int break_type,
+    void *UNUSED(parameter)) {
+  if (nof_recorded_line_breaks == recorded_line_breaks_size) {
+    recorded_line_breaks_size
+      = recorded_line_breaks_size > 0 ? recorded_line_breaks_size * 2 : 64;
+    recorded_line_breaks = fizmo_realloc(
+        recorded_line_breaks,
+        recorded_line_breaks_size * sizeof(line_break));
+  }
+
+  recorded_line_breaks[nof_recorded_line_breaks].position = position;
+  recorded_line_breaks[nof_recorded_line_breaks].type = break_type;
+  nof_recorded_line_breaks++;
+}
+
+
+// Returns the layout of the recorded paragraph, which is created in case
+// it's not known yet. Fonts are evaluated in the same way set_text_style()
+// and set_font() do for the wordwrapper.
+static paragraph_layout *get_recorded_paragraph_layout() {
+  paragraph_layout *layout;
+  history_paragraph_event *event;
+  z_style style = recorded_paragraph.start_style;
+  z_font font = recorded_paragraph.start_font;
+  int event_index;
+
+  if ((layout = get_paragraph_layout(
+          font_configuration, &recorded_paragraph)) != NULL) {
+    return layout;
+  }
+
+  layout = create_paragraph_layout(font_configuration, &recorded_paragraph);
+  add_paragraph_layout_run(layout, 0, evaluate_font(style, font));
+
+  for (event_index=0;
+      event_index<recorded_paragraph.nof_events;
+      event_index++) {
+    event = &recorded_paragraph.events[event_index];
+
+    if (event->type == HISTORY_PARAGRAPH_TEXT_STYLE) {
+      if (event->parameter1 & Z_STYLE_NONRESET) {
+        style |= event->parameter1;
+      }
+      else {
+        style = event->parameter1;
+      }
+    }
+    else if (event->type == HISTORY_PARAGRAPH_FONT) {
+      font = event->parameter1;
+    }
+    else {
+      continue;
+    }
+
+    add_paragraph_layout_run(
+        layout, event->position, evaluate_font(style, font));
+  }
+
+  store_paragraph_layout(layout);
+  return layout;
+}
+
+
+// Returns the line breaks of the recorded paragraph, which has to start at
+// the beginning of an empty line. In case they're not cached yet, they're
+// found by reflowing the paragraph's layout.
+static line_break_cache_entry *get_recorded_paragraph_line_breaks(
+    int line_length) {
+  line_break_cache_entry *cache_entry;
+  paragraph_layout *layout;
+  int nof_lines;
+
+  if ((cache_entry = get_line_break_cache_entry(
+          line_length,
+          get_line_break_configuration(),
+          recorded_paragraph.hash,
+          recorded_paragraph.text,
+          recorded_paragraph.text_length)) != NULL) {
+    TRACE_LOG("Using cached line breaks for paragraph.\n");
+    return cache_entry;
+  }
+
+  layout = get_recorded_paragraph_layout();
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+  if ( (wait_for_background_reflows == true)
+      && (wait_for_background_layout_reflow(
+          line_length,
+          hyphenation_enabled,
+          get_line_break_configuration(),
+          layout) == true)
+      && ((cache_entry = get_line_break_cache_entry(
+            line_length,
+            get_line_break_configuration(),
+            recorded_paragraph.hash,
+            recorded_paragraph.text,
+            recorded_paragraph.text_length)) != NULL) ) {
+    TRACE_LOG("Using line breaks from background reflow for paragraph.\n");
+    return cache_entry;
+  }
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+  nof_recorded_line_breaks = 0;
+  nof_lines = reflow_paragraph_layout(
+      layout,
+      line_length,
+      hyphenation_enabled,
+      &record_line_break,
+      NULL);
+
+  return store_line_break_cache_entry(
+      line_length,
+      get_line_break_configuration(),
+      recorded_paragraph.hash,
+      recorded_paragraph.text,
+      recorded_paragraph.text_length,
+      nof_lines,
+      recorded_line_breaks,
+      nof_recorded_line_breaks);
+}
+
+
+static void apply_history_paragraph_event(history_paragraph_event *event) {
+  if (event->type == HISTORY_PARAGRAPH_TEXT_STYLE) {
+    set_text_style((z_style)event->parameter1);
+  }
+  else if (event->type == HISTORY_PARAGRAPH_COLOUR) {
+    set_colour(
+        (z_colour)event->parameter1,
+        (z_colour)event->parameter2,
+        (int16_t)event->parameter3);
+  }
+  else if (event->type == HISTORY_PARAGRAPH_FONT) {
+    set_font((z_font)event->parameter1);
+  }
+}
+
+
+static void output_recorded_text(const z_ucs *text, size_t len) {
+  if (bool_equal(z_windows[active_z_window_id]->buffering, false)) {
+    z_ucs_output_window_target(
+        text,
+        len,
+        (void*)(&z_windows[active_z_window_id]->window_number));
+  }
+  else {
+    freetype_wrap_z_ucs(
+        z_windows[active_z_window_id]->wordwrapper, text, len, false);
+  }
+}
+
+
+// Sends a recorded paragraph to the active window the same way the history
+// would have. In case wrap_text is false, only the style, colour and font
+// changes are applied.
+static void output_history_paragraph(history_paragraph *paragraph,
+    bool wrap_text) {
+  long text_index = 0;
+  int event_index;
+  history_paragraph_event *event;
+
+  for (event_index=0; event_index<paragraph->nof_events; event_index++) {
+    event = &paragraph->events[event_index];
+
+    if ( (wrap_text == true) && (event->position > text_index) ) {
+      output_recorded_text(
+          paragraph->text + text_index, event->position - text_index);
+      text_index = event->position;
+    }
+
+    if (event->type == HISTORY_PARAGRAPH_LINE_END) {
+      if (wrap_text == true) {
+        freetype_wrap_z_ucs(
+            z_windows[active_z_window_id]->wordwrapper, NULL, 0, true);
+      }
+    }
+    else {
+      apply_history_paragraph_event(event);
+    }
+  }
+
+  if ( (wrap_text == true) && (paragraph->text_length > text_index) ) {
+    output_recorded_text(
+        paragraph->text + text_index, paragraph->text_length - text_index);
+  }
+}
+
+
+static void output_paragraph_text(history_paragraph *paragraph,
+    long *text_index, long end_index, int window_number) {
+  if (end_index > *text_index) {
+    z_ucs_output_window_target(
+        paragraph->text + *text_index,
+        end_index - *text_index,
+        (void*)(&z_windows[window_number]->window_number));
+    *text_index = end_index;
+  }
+}
+
+
+// Sends a recorded paragraph to a window without using the wordwrapper by
+// applying the line breaks from the cache. The breaks, style changes and
+// text are output in the same order the wordwrapper would use: At every
+// position, added minus and newline chars come first, then the style
+// changes and finally the char itself, unless it was skipped.
+static void output_history_paragraph_with_line_breaks(
+    history_paragraph *paragraph, line_break_cache_entry *cache_entry,
+    int window_number) {
+  static z_ucs minus_string[] = { Z_UCS_MINUS, 0 };
+  true_type_wordwrapper *wrapper = z_windows[window_number]->wordwrapper;
+  long text_index = 0, position = 0, next_position;
+  int event_index = 0, break_index = 0;
+  line_break *breaks = cache_entry->breaks;
+  history_paragraph_event *event;
+
+  for (;;) {
+    while ( (break_index < cache_entry->nof_breaks)
+        && (breaks[break_index].position == position)
+        && (breaks[break_index].type != FREETYPE_WORDWRAP_BREAK_SKIP) ) {
+      output_paragraph_text(paragraph, &text_index, position, window_number);
+      z_ucs_output_window_target(
+          breaks[break_index].type == FREETYPE_WORDWRAP_BREAK_MINUS
+          ? minus_string : newline_string,
+          1,
+          (void*)(&z_windows[window_number]->window_number));
+      break_index++;
+    }
+
+    while ( (event_index < paragraph->nof_events)
+        && (paragraph->events[event_index].position == position) ) {
+      event = &paragraph->events[event_index];
+      if (event->type != HISTORY_PARAGRAPH_LINE_END) {
+        output_paragraph_text(paragraph, &text_index, position, window_number);
+        // The wordwrapper is empty, so flushing it will only output the
+        // style change.
+        apply_history_paragraph_event(event);
+        freetype_wordwrap_flush_output(wrapper);
+      }
+      event_index++;
+    }
+
+    if ( (break_index < cache_entry->nof_breaks)
+        && (breaks[break_index].position == position) ) {
+      output_paragraph_text(paragraph, &text_index, position, window_number);
+      text_index = position + 1;
+      break_index++;
+    }
+
+    if (position >= paragraph->text_length) {
+      break;
+    }
+
+    next_position = paragraph->text_length;
+    if ( (break_index < cache_entry->nof_breaks)
+        && (breaks[break_index].position < next_position) ) {
+      next_position = breaks[break_index].position;
+    }
+    if ( (event_index < paragraph->nof_events)
+        && (paragraph->events[event_index].position < next_position) ) {
+      next_position = paragraph->events[event_index].position;
+    }
+    position = next_position;
+  }
+
+  output_paragraph_text(
+      paragraph, &text_index, paragraph->text_length, window_number);
+}
+
+
+static void preload_history_set_text_style(z_style UNUSED(text_style)) {
+}
 
 
 static void preload_history_set_font(z_font UNUSED(font_type)) {
@@ -2494,7 +3602,7 @@ static void preload_history_set_colour(z_colour UNUSED(foreground),
 
 
 static void preload_history_z_ucs_output(z_ucs *output) {
-  freetype_wrap_z_ucs(preloaded_wordwrapper, output, false);
+  freetype_wrap_z_ucs(preloaded_wordwrapper, output, z_ucs_len(output), false);
 }
 
 
@@ -2607,7 +3715,7 @@ static void refresh_input_line(bool display_cursor) {
       nof_line_breaks += process_glyph(
           *input_buffer_index,
           0,
-          bold_font,
+          evaluate_font(Z_STYLE_BOLD, Z_FONT_NORMAL),
           &my_no_more_space);
 
       output_index++;
@@ -2876,8 +3984,8 @@ static void refresh_upper_window() {
 }
 
 
-void preload_wrap_zucs_output(z_ucs *UNUSED(z_ucs_output),
-    void *UNUSED(window_number_as_void)) {
+void preload_wrap_zucs_output(const z_ucs *UNUSED(z_ucs_output),
+    size_t UNUSED(len), void *UNUSED(window_number_as_void)) {
 }
 
 
@@ -2896,6 +4004,7 @@ static void init_screen_redraw() {
   TRACE_LOG("History: %p\n", history);
   TRACE_LOG("z_windows[0]->ysize: %d.\n", z_windows[0]->ysize);
   history_screen_line = 0;
+  history_screen_paragraph = 0;
 }
 
 
@@ -2912,8 +4021,51 @@ static void end_screen_redraw() {
 }
 
 
+// Rewinds the history by the number of paragraphs which, according to the
+// history line index, contain the lines down from top_upscroll_line. Since
+// the index might not cover the last, unfinished paragraph, the caller
+// still has to verify the history's position afterwards. Returns false in
+// case the history's buffer back was hit.
+static bool rewind_history_using_line_index() {
+  int paragraph_attr1, paragraph_attr2;
+  int return_code;
+  long nof_lines_below, nof_paragraphs_to_rewind;
+
+  nof_lines_below
+    = (top_upscroll_line - z_windows[0]->lower_padding + line_height - 1)
+    / line_height
+    - (nof_input_lines - 1);
+
+  nof_paragraphs_to_rewind
+    = find_history_line_index_paragraphs_below(nof_lines_below)
+    - history_screen_paragraph;
+
+  TRACE_LOG("Rewinding %ld paragraphs using the line index.\n",
+      nof_paragraphs_to_rewind);
+
+  while (nof_paragraphs_to_rewind > 0) {
+    paragraph_attr1 = 0;
+    return_code = output_rewind_paragraph(history, NULL,
+        &paragraph_attr1, &paragraph_attr2);
+    if (return_code == 0) {
+      history_screen_line += paragraph_attr1 != 0 ? paragraph_attr1 : 1;
+      history_screen_paragraph++;
+    }
+    else if (return_code == 1) {
+      TRACE_LOG("Hit buffer back while rewinding / %d.\n",
+          history_screen_line);
+      history_screen_line += paragraph_attr1 != 0 ? paragraph_attr1 : 1;
+      return false;
+    }
+    nof_paragraphs_to_rewind--;
+  }
+
+  return true;
+}
+
+
 static void redraw_screen_area(int top_line_to_redraw) {
-  bool stored_more_disable_state;
+  bool stored_more_disable_state, hit_buffer_back = false;
   int paragraph_attr1, paragraph_attr2;
   int return_code;
 
@@ -2932,11 +4084,16 @@ static void redraw_screen_area(int top_line_to_redraw) {
   stored_more_disable_state = disable_more_prompt;
   disable_more_prompt = true;
 
+  if (history_line_index_valid == true) {
+    hit_buffer_back = !rewind_history_using_line_index();
+  }
+
   // Check if the history is pointing at some place below the
   // current window to redraw.
-  while (top_upscroll_line
-      > (nof_input_lines - 1 + history_screen_line) * line_height
-      + z_windows[0]->lower_padding) {
+  while ( (hit_buffer_back == false)
+      && (top_upscroll_line
+        > (nof_input_lines - 1 + history_screen_line) * line_height
+        + z_windows[0]->lower_padding) ) {
 
     /*
     printf("(nil - 1 + hsl) * line_height + low_padding = %d.\n",
@@ -2980,6 +4137,7 @@ static void redraw_screen_area(int top_line_to_redraw) {
 
       history_screen_line
         += paragraph_attr1 != 0 ? paragraph_attr1 : 1;
+      history_screen_paragraph++;
       //printf("rewind, history_screen_line: %d.\n", history_screen_line);
     }
     else if (return_code == 1) {
@@ -3036,6 +4194,7 @@ static void redraw_screen_area(int top_line_to_redraw) {
     flush_window(0);
     //printf("redraw, history_screen_line: %d.\n", history_screen_line);
     history_screen_line -= z_windows[0]->nof_consecutive_lines_output;
+    history_screen_paragraph--;
     //printf("redraw, history_screen_line: %d.\n", history_screen_line);
 
     /*
@@ -3055,11 +4214,26 @@ void finish_history_remeasurement() {
   int last_active_z_window_id = -1;
 
   if (history_is_being_remeasured == true) {
+    // Everything is remeasured right away, so there's no point in doing
+    // the visible paragraphs first.
+    viewport_remeasurement_pending = false;
     last_active_z_window_id = init_history_remeasurement();
+    start_background_remeasurement();
+    // Finished workers are merged as the main thread goes along, which
+    // only waits in case it needs a paragraph a running worker owns.
+#ifdef ENABLE_THREADED_REMEASUREMENT
+    wait_for_background_reflows = true;
+#endif // ENABLE_THREADED_REMEASUREMENT
     do {
+#ifdef ENABLE_THREADED_REMEASUREMENT
+      merge_finished_background_layout_reflows();
+#endif // ENABLE_THREADED_REMEASUREMENT
       remeasure_next_paragraph();
     }
     while (history_is_being_remeasured == true);
+#ifdef ENABLE_THREADED_REMEASUREMENT
+    wait_for_background_reflows = false;
+#endif // ENABLE_THREADED_REMEASUREMENT
     end_history_remeasurement(last_active_z_window_id);
     TRACE_LOG("total_lines_in_history recalc: %ld.\n", total_lines_in_history);
   }
@@ -3087,6 +4261,10 @@ static void refresh_screen() {
 }
 
 
+// This method isn't currently used since it still contains one bug where
+// the last word in a paragraph is not correctly wrapped. Currently the
+// pixel_interface instead relies upon remeasuring the entire history first
+// and then redrawing the screen (which currently appears to be fast enough).
 static void refresh_screen_with_paragraph_attributes() {
   int i, last_active_z_window_id = -1;
   int y_height_to_fill;
@@ -3215,10 +4393,38 @@ static void refresh_screen_with_paragraph_attributes() {
 }
 
 
-// This method isn't currently used since it still contains one bug where
-// the last word in a paragraph is not correctly wrapped. Currently the
-// pixel_interface instead relies upon remeasuring the entire history first
-// and then redrawing the screen (which currently appears to be fast enough).
+// Outputs the next paragraphs from the history to window 0 and ends the
+// line. In case the output starts on an empty line, the wordwrapper is
+// bypassed using the paragraphs' line breaks.
+static void refresh_paragraphs(history_output *paragraph_history,
+    int nof_paragraphs) {
+  struct z_window *window = z_windows[0];
+  int line_length;
+  bool use_line_break_cache;
+
+  line_length = window->xsize - window->leftmargin - window->rightmargin;
+  use_line_break_cache
+    = freetype_wordwrap_is_at_line_start(window->wordwrapper);
+
+  start_paragraph_recording(0);
+  output_repeat_paragraphs(paragraph_history, nof_paragraphs, true, false);
+  recording_paragraph = false;
+  add_history_paragraph_event(
+      &recorded_paragraph, HISTORY_PARAGRAPH_LINE_END, 0, 0, 0);
+
+  if (use_line_break_cache == true) {
+    output_history_paragraph_with_line_breaks(
+        &recorded_paragraph,
+        get_recorded_paragraph_line_breaks(line_length),
+        0);
+  }
+  else {
+    output_history_paragraph(&recorded_paragraph, true);
+  }
+  flush_window(0);
+}
+
+
 static void refresh_screen_without_paragraph_attributes() {
   int last_active_z_window_id = -1;
   int y_height_to_fill;
@@ -3240,7 +4446,7 @@ static void refresh_screen_without_paragraph_attributes() {
 
   if ((history = init_history_output(
           outputhistory[0],
-          &history_target,
+          &recording_history_target,
           Z_HISTORY_OUTPUT_WITHOUT_EXTRAS))
       != NULL) {
 
@@ -3291,9 +4497,7 @@ static void refresh_screen_without_paragraph_attributes() {
 
       //printf("Start paragraph repetition.\n");
       nof_break_line_invocations = 0;
-      output_repeat_paragraphs(history, nof_paragraphs_to_repeat, true, false);
-      freetype_wrap_z_ucs(z_windows[0]->wordwrapper, NULL, true);
-      flush_window(0);
+      refresh_paragraphs(history, nof_paragraphs_to_repeat);
 
       //screen_pixel_interface->update_screen();
       //event_type = get_next_event_wrapper(&input, 0);
@@ -3363,6 +4567,70 @@ static void refresh_screen_without_paragraph_attributes() {
 }
 
 
+// Returns true in case the lines from the history's bottom up to the given
+// scroll position have been remeasured at the current width, so they may
+// be shown while the rest of the history is still being remeasured.
+static bool is_upscroll_line_remeasured(int upscroll_line) {
+  long nof_lines_below;
+
+  if (history_is_being_remeasured == false) {
+    return true;
+  }
+  else if ( (first_viewport_paragraph < 0)
+      || (viewport_remeasurement_pending == true) ) {
+    return false;
+  }
+
+  nof_lines_below
+    = (upscroll_line - z_windows[0]->lower_padding + line_height - 1)
+    / line_height
+    - (nof_input_lines - 1);
+
+  return nof_lines_below
+    <= get_history_line_index_nof_lines()
+    - get_history_line_index_lines_above(
+        get_first_remeasured_bottom_paragraph());
+}
+
+
+// Returns the scrollback cache's row number of window 0's topmost pixel
+// row. Rows are counted from the bottom of the history's output, so they
+// don't depend on the input line's height.
+static long get_scrollback_top_row() {
+  return top_upscroll_line
+    - (nof_input_lines - 1) * line_height
+    - z_windows[0]->lower_padding;
+}
+
+
+// While scrolling, all drawing goes through the scrollback cache's
+// capturing interface, so that the rows drawn may be reused later on.
+static void start_scrolling_capture() {
+  if (real_screen_pixel_interface == NULL) {
+    real_screen_pixel_interface = screen_pixel_interface;
+    screen_pixel_interface = start_scrollback_capture(
+        real_screen_pixel_interface,
+        z_windows[0]->xpos,
+        z_windows[0]->ypos,
+        z_windows[0]->xsize,
+        z_windows[0]->ysize);
+  }
+}
+
+
+static void end_scrolling_capture(bool store_rows) {
+  if (real_screen_pixel_interface != NULL) {
+    if (store_rows == true) {
+      // The bottom line is shared with the input line and not stored.
+      store_scrollback_rows(get_scrollback_top_row(), line_height);
+    }
+    end_scrollback_capture();
+    screen_pixel_interface = real_screen_pixel_interface;
+    real_screen_pixel_interface = NULL;
+  }
+}
+
+
 void handle_scrolling(int event_type) {
   int lines_to_copy; //, saved_padding; //, line_shift,
   int top_line_to_draw;
@@ -3370,6 +4638,7 @@ void handle_scrolling(int event_type) {
   //int nof_paragraphs;
   int max_top_scroll_line;
   int previous_upscroll_position;
+  int upscroll_target;
   //int history_screen_line_buf;
   //int return_code;
   //int extra_padding;
@@ -3379,12 +4648,47 @@ void handle_scrolling(int event_type) {
 
   TRACE_LOG("Starting handle_scrolling.\n");
 
+  if (event_type == EVENT_WAS_CODE_SCROLL_BOTTOM) {
+    if (top_upscroll_line != -1) {
+      end_screen_redraw();
+      refresh_screen();
+      screen_pixel_interface->update_screen();
+    }
+    return;
+  }
+
   if ( (event_type == EVENT_WAS_CODE_PAGE_DOWN)
       && (top_upscroll_line <= z_windows[0]->ysize) ) {
     TRACE_LOG("Already at bottom.\n");
     return;
   }
 
+  if (event_type == EVENT_WAS_CODE_PAGE_UP) {
+    upscroll_target
+      = (top_upscroll_line != -1 ? top_upscroll_line : z_windows[0]->ysize - 1)
+      + z_windows[0]->ysize / 2;
+  }
+  else if (event_type == EVENT_WAS_CODE_PAGE_DOWN) {
+    upscroll_target = top_upscroll_line - z_windows[0]->ysize / 2;
+  }
+  else {
+    upscroll_target = 0;
+  }
+
+  // Since we need the paragraph measurements, we'll have to complete
+  // remeasuring in case the lines to be shown haven't been remeasured yet.
+  if ( ( (event_type != EVENT_WAS_CODE_PAGE_UP)
+        && (event_type != EVENT_WAS_CODE_PAGE_DOWN) )
+      || (is_upscroll_line_remeasured(upscroll_target) == false) ) {
+    if ( (history_is_being_remeasured == true) && (history != NULL) ) {
+      // Only a single history output may exist at a time, so the one used
+      // for scrolling is recreated at the bottom afterwards.
+      destroy_history_output(history);
+      history = NULL;
+    }
+    finish_history_remeasurement();
+  }
+
   //printf("total_lines_in_history: %ld.\n", total_lines_in_history);
   max_top_scroll_line
     = (nof_input_lines - 1 + total_lines_in_history) * line_height
@@ -3400,16 +4704,13 @@ void handle_scrolling(int event_type) {
     return;
   }
 
-  if ( (event_type == EVENT_WAS_CODE_PAGE_UP)
+  if ( ( (event_type == EVENT_WAS_CODE_PAGE_UP)
+        || (event_type == EVENT_WAS_CODE_SCROLL_TOP) )
       && (top_upscroll_line >= max_top_scroll_line) ) {
     TRACE_LOG("Already at top.\n");
     return;
   }
 
-  // Since we need the paragraph measurements, we'll have to complete
-  // remeasuring in case it hasn't yet been finished.
-  finish_history_remeasurement();
-
   refresh_active = true;
 
   if (top_upscroll_line == -1) {
@@ -3418,6 +4719,11 @@ void handle_scrolling(int event_type) {
     init_screen_redraw();
     top_upscroll_line = z_windows[0]->ysize - 1;
   }
+  else if (history == NULL) {
+    init_screen_redraw();
+  }
+
+  start_scrolling_capture();
 
   previous_upscroll_position = top_upscroll_line;
 
@@ -3476,6 +4782,7 @@ void handle_scrolling(int event_type) {
 
     if (top_upscroll_line < z_windows[0]->ysize) {
       // End up-scroll.
+      end_scrolling_capture(false);
       end_screen_redraw();
       refresh_screen();
       screen_pixel_interface->update_screen();
@@ -3519,12 +4826,40 @@ void handle_scrolling(int event_type) {
     //saved_padding = z_windows[0]->lower_padding;
     //z_windows[0]->lower_padding += lines_to_copy;
   }
+  else if (event_type == EVENT_WAS_CODE_SCROLL_TOP) {
+
+    top_upscroll_line = max_top_scroll_line;
+    redraw_pixel_lines_to_draw = z_windows[0]->ysize;
+
+    TRACE_LOG("top_upscroll_line: %d.\n", top_upscroll_line);
+
+    screen_pixel_interface->fill_area(
+        z_windows[0]->xpos,
+        z_windows[0]->ypos,
+        z_windows[0]->xsize,
+        redraw_pixel_lines_to_draw,
+        red_from_z_rgb_colour(background_colour),
+        green_from_z_rgb_colour(background_colour),
+        blue_from_z_rgb_colour(background_colour));
+
+    top_line_to_draw = 0;
+  }
   else {
     // Neither up nor down?
+    end_scrolling_capture(false);
     return;
   }
 
-  redraw_screen_area(top_line_to_draw);
+  if (draw_scrollback_rows(
+        get_scrollback_top_row(),
+        top_line_to_draw,
+        redraw_pixel_lines_to_draw) == true) {
+    redraw_pixel_lines_to_draw = 0;
+  }
+  else {
+    redraw_screen_area(top_line_to_draw);
+  }
+  end_scrolling_capture(true);
 
   freetype_wordwrap_reset_position(z_windows[0]->wordwrapper);
   refresh_scrollbar();
@@ -3537,6 +4872,112 @@ void handle_scrolling(int event_type) {
 }
 
 
+// Adapts the screen to a resize event received during input. In case only
+// the height of window 0 has changed, its content is moved along with the
+// window's bottom, so only the rows uncovered at the top and the input
+// line have to be drawn. All other changes cause a full refresh.
+static void process_resize_event() {
+  int old_screen_width = total_screen_width_in_pixel;
+  int old_window_0_ypos = z_windows[0]->ypos;
+  int old_window_0_ysize = z_windows[0]->ysize;
+  int old_window_1_ysize = z_windows[1]->ysize;
+  bool was_scrolled_back = (top_upscroll_line != -1);
+  int last_active_z_window_id = -1;
+  int dy, nof_rows_to_copy;
+  z_rgb_colour background_colour;
+
+  new_pixel_screen_size(
+      screen_pixel_interface->get_screen_height_in_pixels(),
+      screen_pixel_interface->get_screen_width_in_pixels());
+
+  dy = z_windows[0]->ysize - old_window_0_ysize;
+
+  if ( (ver == 6)
+      || (was_scrolled_back == true)
+      || (history_is_being_remeasured == true)
+      || (total_screen_width_in_pixel != old_screen_width)
+      || (z_windows[0]->ypos != old_window_0_ypos)
+      || (z_windows[1]->ysize != old_window_1_ysize)
+      || (dy == 0)
+      || (dy >= z_windows[0]->ysize
+        - (nof_input_lines > 1 ? nof_input_lines : 1) * line_height
+        - z_windows[0]->lower_padding) ) {
+    refresh_screen();
+    screen_pixel_interface->update_screen();
+    return;
+  }
+
+  TRACE_LOG("Shifting window 0 by %d pixel rows.\n", dy);
+
+  nof_rows_to_copy = dy > 0 ? old_window_0_ysize : z_windows[0]->ysize;
+  screen_pixel_interface->copy_area(
+      z_windows[0]->ypos + (dy > 0 ? dy : 0),
+      z_windows[0]->xpos,
+      z_windows[0]->ypos - (dy < 0 ? dy : 0),
+      z_windows[0]->xpos,
+      nof_rows_to_copy,
+      z_windows[0]->xsize);
+
+  if (active_z_window_id != 0) {
+    last_active_z_window_id = active_z_window_id;
+    switch_to_window(0);
+  }
+
+  if (dy > 0) {
+    // The uncovered rows are drawn like the ones exposed when scrolling
+    // back from the bottom, so they may also be taken from the cache.
+    refresh_active = true;
+    init_screen_redraw();
+    top_upscroll_line = z_windows[0]->ysize - 1;
+    start_scrolling_capture();
+
+    background_colour
+      = z_to_rgb_colour(z_windows[0]->output_background_colour);
+    screen_pixel_interface->fill_area(
+        z_windows[0]->xpos,
+        z_windows[0]->ypos,
+        z_windows[0]->xsize,
+        dy,
+        red_from_z_rgb_colour(background_colour),
+        green_from_z_rgb_colour(background_colour),
+        blue_from_z_rgb_colour(background_colour));
+
+    redraw_pixel_lines_to_draw = dy;
+    if (draw_scrollback_rows(get_scrollback_top_row(), 0, dy) == true) {
+      redraw_pixel_lines_to_draw = 0;
+    }
+    else {
+      redraw_screen_area(0);
+    }
+
+    end_scrolling_capture(true);
+    end_screen_redraw();
+    refresh_active = false;
+  }
+
+  freetype_wordwrap_reset_position(z_windows[0]->wordwrapper);
+  z_windows[0]->nof_consecutive_lines_output = 0;
+  z_windows[0]->ycursorpos
+    = z_windows[0]->ysize
+    - (nof_input_lines > 1 ? nof_input_lines : 1) * line_height
+    - z_windows[0]->lower_padding;
+  if (input_line_on_screen == true) {
+    *current_input_y = z_windows[0]->ypos + z_windows[0]->ycursorpos;
+    refresh_input_line(true);
+  }
+  else {
+    reset_xcursorpos(0);
+  }
+
+  if (last_active_z_window_id != -1) {
+    switch_to_window(last_active_z_window_id);
+  }
+
+  refresh_scrollbar();
+  screen_pixel_interface->update_screen();
+}
+
+
 // NOTE: Keep in mind that the verification routine may recursively
 // call a read (Border Zone does this).
 // This function reads a maximum of maximum_length characters from stdin
@@ -3796,7 +5237,9 @@ static int16_t read_line(zscii *dest, uint16_t maximum_length,
       }
     }
     else if ( (event_type == EVENT_WAS_CODE_PAGE_UP)
-        || (event_type == EVENT_WAS_CODE_PAGE_DOWN)) {
+        || (event_type == EVENT_WAS_CODE_PAGE_DOWN)
+        || (event_type == EVENT_WAS_CODE_SCROLL_TOP)
+        || (event_type == EVENT_WAS_CODE_SCROLL_BOTTOM) ) {
       handle_scrolling(event_type);
       /*
       printf("XXX : nlicp: %d\n",
@@ -3956,11 +5399,7 @@ static int16_t read_line(zscii *dest, uint16_t maximum_length,
       }
       else if (event_type == EVENT_WAS_WINCH) {
         TRACE_LOG("winch.\n");
-        new_pixel_screen_size(
-            screen_pixel_interface->get_screen_height_in_pixels(),
-            screen_pixel_interface->get_screen_width_in_pixels());
-        refresh_screen();
-        screen_pixel_interface->update_screen();
+        process_resize_event();
       }
       else if (event_type == EVENT_WAS_CODE_CTRL_A) {
         if (input_index > 0) {
@@ -3978,6 +5417,7 @@ static int16_t read_line(zscii *dest, uint16_t maximum_length,
       }
       else if (event_type == EVENT_WAS_CODE_CTRL_L) {
         TRACE_LOG("Got CTRL-L.\n");
+        invalidate_scrollback_cache();
         screen_pixel_interface->update_screen();
       }
       else if (event_type == EVENT_WAS_CODE_CTRL_R) {
@@ -4093,7 +5533,9 @@ static int read_char(uint16_t tenth_seconds, uint32_t verification_routine,
       input_in_progress = false;
     }
     else if ( (event_type == EVENT_WAS_CODE_PAGE_UP)
-        || (event_type == EVENT_WAS_CODE_PAGE_DOWN)) {
+        || (event_type == EVENT_WAS_CODE_PAGE_DOWN)
+        || (event_type == EVENT_WAS_CODE_SCROLL_TOP)
+        || (event_type == EVENT_WAS_CODE_SCROLL_BOTTOM) ) {
       handle_scrolling(event_type);
     }
     else {
@@ -4106,6 +5548,7 @@ static int read_char(uint16_t tenth_seconds, uint32_t verification_routine,
       if (event_type == EVENT_WAS_INPUT) {
         if (input == 12) {
           TRACE_LOG("Got CTRL-L.\n");
+          invalidate_scrollback_cache();
           screen_pixel_interface->redraw_screen_from_scratch();
         }
         else {
@@ -4180,11 +5623,7 @@ static int read_char(uint16_t tenth_seconds, uint32_t verification_routine,
       }
       else if (event_type == EVENT_WAS_WINCH) {
         TRACE_LOG("winch.\n");
-        new_pixel_screen_size(
-            screen_pixel_interface->get_screen_height_in_pixels(),
-            screen_pixel_interface->get_screen_width_in_pixels());
-        refresh_screen();
-        screen_pixel_interface->update_screen();
+        process_resize_event();
       }
     }
   }
@@ -4319,6 +5758,9 @@ static bool input_must_be_repeated_by_story() {
 static void game_was_restored_and_history_modified() {
   TRACE_LOG("Setting history_is_being_remeasured to true.\n");
   refresh_due_to_history_modification = true;
+  // Cached rows are identified by their distance from the history's
+  // bottom, which now refers to different text.
+  invalidate_scrollback_cache();
 }
 
 
@@ -4359,12 +5801,12 @@ static struct z_screen_interface z_pixel_interface = {
   &reset_interface,
   &pixel_close_interface,
   &set_buffer_mode,
-  &z_ucs_output,
+  &pixel_z_ucs_output,
   &read_line,
   &read_char,
   &show_status,
   &set_text_style,
-  &set_colour,
+  &pixel_set_colour,
   &set_font,
   &split_window,
   &set_window,
@@ -4398,6 +5840,7 @@ static void pixelif_paragraph_attribute_function(int *parameter1,
     *parameter1 = z_windows[active_z_window_id]->nof_lines_in_current_paragraph;
     *parameter2 = z_windows[0]->xsize;
     total_nof_lines_stored += *parameter1;
+    append_history_line_index_paragraph(*parameter1 != 0 ? *parameter1 : 1);
 
     //printf("Resetting nof_lines_in_current_paragraph.\n");
     z_windows[active_z_window_id]->nof_lines_in_current_paragraph = 0;
@@ -4411,6 +5854,7 @@ static void pixelif_paragraph_removal_function(int parameter1,
     int parameter2) {
   //printf("remove: %d\n", parameter1);
   total_lines_in_history -= parameter1;
+  remove_history_line_index_paragraph();
   //printf("total_lines_in_history: %ld.\n", total_lines_in_history);
   return;
 }
@@ -4445,7 +5889,8 @@ void fizmo_register_screen_pixel_interface(struct z_screen_pixel_interface
     register_locale_module(
       locale_module_libpixelif.module_name, &locale_module_libpixelif);
 
-    screen_pixel_interface = new_screen_pixel_interface;
+    screen_pixel_interface
+      = start_screen_damage_tracking(new_screen_pixel_interface);
     set_configuration_value("enable-font3-conversion", "true");
 
     interface_config_options
@@ -4492,15 +5937,32 @@ void set_custom_right_pixel_margin(int width) {
 void new_pixel_screen_size(int newysize, int newxsize) {
   int i, dy, status_offset = statusline_window_id > 0 ? line_height : 0;
   int consecutive_lines_buffer[nof_active_z_windows];
+  bool width_has_changed;
 
   if ( (newysize < 1) || (newxsize < 1) )
     return;
 
+  // A change of the height alone doesn't move any line break, so the
+  // history's line counts and the scrollback cache's rows remain valid
+  // and only the visible part of the screen has to be redrawn.
+  width_has_changed = (newxsize != total_screen_width_in_pixel);
+
   // End up-scroll.
   end_screen_redraw();
 
-  TRACE_LOG("Setting history_is_being_remeasured to true.\n");
-  history_has_to_be_remeasured();
+  if (width_has_changed == true) {
+    invalidate_scrollback_cache();
+
+#ifdef ENABLE_THREADED_REMEASUREMENT
+    // Layouts reflowed for the old width are of no use anymore, so the
+    // workers are stopped right away instead of when remeasurement is
+    // restarted for the new width.
+    cancel_background_layout_reflow();
+#endif // ENABLE_THREADED_REMEASUREMENT
+
+    TRACE_LOG("Setting history_is_being_remeasured to true.\n");
+    history_has_to_be_remeasured();
+  }
 
   for (i=0; i<nof_active_z_windows; i++) {
     consecutive_lines_buffer[i] = z_windows[i]->nof_consecutive_lines_output;
@@ -4604,6 +6066,15 @@ void new_pixel_screen_size(int newysize, int newxsize) {
     z_windows[i]->nof_consecutive_lines_output = consecutive_lines_buffer[i];
   }
   disable_more_prompt = false;
+
+  if (history_is_being_remeasured == true) {
+    // Give the scrollbar an estimate until the remeasurement is done.
+    nof_remeasured_paragraphs = 0;
+    estimate_total_lines_in_history(
+        z_windows[0]->xsize
+        - z_windows[0]->leftmargin
+        - z_windows[0]->rightmargin);
+  }
 }
 
 
@@ -0,0 +1,280 @@
+
+/* screen_damage.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Frontends which are able to present parts of their framebuffer only are
+// told which areas have been drawn to since the last update, so that they
+// don't have to push the whole screen when only the cursor blinked or a
+// single character was typed. Drawn areas are merged into at most
+// SCREEN_DAMAGE_MAX_RECTS boxes, combining those pairs first whose union
+// adds the least area.
+
+#include <string.h>
+
+#include "screen_damage.h"
+#include "tools/tracelog.h"
+
+static struct z_screen_pixel_interface *tracked_screen = NULL;
+static struct z_screen_pixel_interface tracking_interface;
+static struct z_screen_rect damaged_rects[SCREEN_DAMAGE_MAX_RECTS + 1];
+static int nof_damaged_rects = 0;
+static int last_damaged_rect = 0;
+
+
+static long get_rect_area(int x, int y, int end_x, int end_y) {
+  return (long)(end_x - x) * (end_y - y);
+}
+
+
+// Returns how much larger the bounding box of both rectangles is than
+// their areas combined. Overlapping rectangles may yield negative values.
+static long get_merge_cost(struct z_screen_rect *a, struct z_screen_rect *b) {
+  int x = a->x < b->x ? a->x : b->x;
+  int y = a->y < b->y ? a->y : b->y;
+  int end_x
+    = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+  int end_y
+    = a->y + a->height > b->y + b->height
+    ? a->y + a->height
+    : b->y + b->height;
+
+  return get_rect_area(x, y, end_x, end_y)
+    - get_rect_area(a->x, a->y, a->x + a->width, a->y + a->height)
+    - get_rect_area(b->x, b->y, b->x + b->width, b->y + b->height);
+}
+
+
+// Merges rect "src" into rect "dst" and removes "src".
+static void merge_rects(int dst, int src) {
+  struct z_screen_rect *a = &damaged_rects[dst], *b = &damaged_rects[src];
+  int end_x
+    = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+  int end_y
+    = a->y + a->height > b->y + b->height
+    ? a->y + a->height
+    : b->y + b->height;
+
+  if (b->x < a->x) {
+    a->x = b->x;
+  }
+  if (b->y < a->y) {
+    a->y = b->y;
+  }
+  a->width = end_x - a->x;
+  a->height = end_y - a->y;
+
+  damaged_rects[src] = damaged_rects[--nof_damaged_rects];
+  last_damaged_rect = dst < nof_damaged_rects ? dst : 0;
+}
+
+
+static bool rect_contains(struct z_screen_rect *rect, int x, int y,
+    int width, int height) {
+  return (x >= rect->x) && (y >= rect->y)
+    && (x + width <= rect->x + rect->width)
+    && (y + height <= rect->y + rect->height);
+}
+
+
+static void add_damaged_rect(int x, int y, int width, int height) {
+  int i, j, best_i = 0, best_j = 1;
+  long cost, best_cost;
+  bool merged;
+
+  if ( (width <= 0) || (height <= 0) ) {
+    return;
+  }
+
+  // Glyphs are drawn pixel by pixel or span by span, so the rect hit last
+  // is likely to contain the next one as well.
+  if ( (nof_damaged_rects > 0)
+      && (rect_contains(
+          &damaged_rects[last_damaged_rect], x, y, width, height) == true) ) {
+    return;
+  }
+
+  for (i=0; i<nof_damaged_rects; i++) {
+    if (rect_contains(&damaged_rects[i], x, y, width, height) == true) {
+      last_damaged_rect = i;
+      return;
+    }
+  }
+
+  damaged_rects[nof_damaged_rects].x = x;
+  damaged_rects[nof_damaged_rects].y = y;
+  damaged_rects[nof_damaged_rects].width = width;
+  damaged_rects[nof_damaged_rects].height = height;
+  last_damaged_rect = nof_damaged_rects;
+  nof_damaged_rects++;
+
+  // Rects whose bounding box doesn't add any area, like adjacent glyph
+  // spans on the same rows, are merged in any case.
+  do {
+    merged = false;
+    for (i=0; (i<nof_damaged_rects) && (merged == false); i++) {
+      for (j=i+1; (j<nof_damaged_rects) && (merged == false); j++) {
+        if (get_merge_cost(&damaged_rects[i], &damaged_rects[j]) <= 0) {
+          merge_rects(i, j);
+          merged = true;
+        }
+      }
+    }
+  }
+  while (merged == true);
+
+  if (nof_damaged_rects > SCREEN_DAMAGE_MAX_RECTS) {
+    best_cost = -1;
+    for (i=0; i<nof_damaged_rects; i++) {
+      for (j=i+1; j<nof_damaged_rects; j++) {
+        cost = get_merge_cost(&damaged_rects[i], &damaged_rects[j]);
+        if ( (best_cost < 0) || (cost < best_cost) ) {
+          best_cost = cost;
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    merge_rects(best_i, best_j);
+  }
+}
+
+
+static void tracking_draw_rgb_pixel(int y, int x, uint8_t r, uint8_t g,
+    uint8_t b) {
+  tracked_screen->draw_rgb_pixel(y, x, r, g, b);
+  add_damaged_rect(x, y, 1, 1);
+}
+
+
+static void tracking_draw_rgb_span(int y, int x, int width,
+    uint8_t *rgb_data) {
+  tracked_screen->draw_rgb_span(y, x, width, rgb_data);
+  add_damaged_rect(x, y, width, 1);
+}
+
+
+static void tracking_draw_alpha_mask(int y, int x, int width, int height,
+    uint8_t *mask, int mask_pitch,
+    uint8_t foreground_r, uint8_t foreground_g, uint8_t foreground_b,
+    uint8_t background_r, uint8_t background_g, uint8_t background_b) {
+  tracked_screen->draw_alpha_mask(y, x, width, height, mask, mask_pitch,
+      foreground_r, foreground_g, foreground_b,
+      background_r, background_g, background_b);
+  add_damaged_rect(x, y, width, height);
+}
+
+
+static void tracking_fill_area(int startx, int starty, int xsize, int ysize,
+    uint8_t r, uint8_t g, uint8_t b) {
+  tracked_screen->fill_area(startx, starty, xsize, ysize, r, g, b);
+  add_damaged_rect(startx, starty, xsize, ysize);
+}
+
+
+static void tracking_copy_area(int dsty, int dstx, int srcy, int srcx,
+    int height, int width) {
+  tracked_screen->copy_area(dsty, dstx, srcy, srcx, height, width);
+  add_damaged_rect(dstx, dsty, width, height);
+}
+
+
+static void tracking_update_screen() {
+  int screen_width = tracked_screen->get_screen_width_in_pixels();
+  int screen_height = tracked_screen->get_screen_height_in_pixels();
+  int i, end_x, end_y, nof_rects = 0;
+  struct z_screen_rect *rect;
+
+  // Areas drawn outside the screen are never presented.
+  for (i=0; i<nof_damaged_rects; i++) {
+    rect = &damaged_rects[i];
+    end_x = rect->x + rect->width;
+    end_y = rect->y + rect->height;
+    if (rect->x < 0) {
+      rect->x = 0;
+    }
+    if (rect->y < 0) {
+      rect->y = 0;
+    }
+    if (end_x > screen_width) {
+      end_x = screen_width;
+    }
+    if (end_y > screen_height) {
+      end_y = screen_height;
+    }
+    if ( (end_x > rect->x) && (end_y > rect->y) ) {
+      damaged_rects[nof_rects].x = rect->x;
+      damaged_rects[nof_rects].y = rect->y;
+      damaged_rects[nof_rects].width = end_x - rect->x;
+      damaged_rects[nof_rects].height = end_y - rect->y;
+      nof_rects++;
+    }
+  }
+
+  nof_damaged_rects = 0;
+  last_damaged_rect = 0;
+
+  if (nof_rects > 0) {
+    TRACE_LOG("Presenting %d damaged rects.\n", nof_rects);
+    tracked_screen->update_screen_rects(damaged_rects, nof_rects);
+  }
+}
+
+
+struct z_screen_pixel_interface *start_screen_damage_tracking(
+    struct z_screen_pixel_interface *screen) {
+
+  if (screen->update_screen_rects == NULL) {
+    return screen;
+  }
+
+  tracked_screen = screen;
+  nof_damaged_rects = 0;
+  last_damaged_rect = 0;
+
+  memcpy(&tracking_interface, screen, sizeof(struct z_screen_pixel_interface));
+  tracking_interface.draw_rgb_pixel = &tracking_draw_rgb_pixel;
+  tracking_interface.fill_area = &tracking_fill_area;
+  tracking_interface.copy_area = &tracking_copy_area;
+  tracking_interface.update_screen = &tracking_update_screen;
+  if (screen->draw_rgb_span != NULL) {
+    tracking_interface.draw_rgb_span = &tracking_draw_rgb_span;
+  }
+  if (screen->draw_alpha_mask != NULL) {
+    tracking_interface.draw_alpha_mask = &tracking_draw_alpha_mask;
+  }
+
+  TRACE_LOG("Tracking screen damage for %p.\n", screen);
+
+  return &tracking_interface;
+}
@@ -0,0 +1,480 @@
+
+/* scrollback_cache.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Scrolling back and forth through the history makes the same lines to be
+// wrapped and rasterized over and over again. While scrolling, the pixels
+// drawn into window 0 are mirrored into a shadow buffer, and completely
+// drawn rows are kept here so that returning to a recently seen region of
+// the history only requires copying rows to the screen. Rows are stored
+// run length encoded in case this makes them smaller, which is the usual
+// case for text on a plain background.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scrollback_cache.h"
+#include "glyph_blending.h"
+#include "tools/tracelog.h"
+#include "interpreter/fizmo.h"
+
+// Run length encoded rows consist of count/r/g/b quadruples.
+#define SCROLLBACK_RUN_MAX_LENGTH 255
+
+typedef struct scrollback_row_struct {
+  long row;
+  int width;
+  int size; // in bytes
+  bool is_encoded;
+  uint8_t *data; // NULL marks an empty entry.
+} scrollback_row;
+
+static scrollback_row scrollback_rows[SCROLLBACK_CACHE_SIZE];
+static long scrollback_cache_bytes = 0;
+
+static struct z_screen_pixel_interface *captured_screen = NULL;
+static struct z_screen_pixel_interface capture_interface;
+static int capture_xpos, capture_ypos, capture_width, capture_height;
+static uint8_t *shadow_pixels = NULL;
+static bool *shadow_row_is_complete = NULL;
+static size_t shadow_size = 0;
+static uint8_t *row_buffer = NULL; // for encoding and decoding rows
+static size_t row_buffer_size = 0;
+
+
+static uint8_t *get_shadow_pixel(int y, int x) {
+  return shadow_pixels
+    + ((size_t)(y - capture_ypos) * capture_width + (x - capture_xpos)) * 3;
+}
+
+
+static bool is_row_captured(int y) {
+  return (y >= capture_ypos) && (y < capture_ypos + capture_height);
+}
+
+
+static void capture_draw_rgb_pixel(int y, int x, uint8_t r, uint8_t g,
+    uint8_t b) {
+  uint8_t *pixel;
+
+  captured_screen->draw_rgb_pixel(y, x, r, g, b);
+
+  if ( (is_row_captured(y) == true)
+      && (x >= capture_xpos) && (x < capture_xpos + capture_width) ) {
+    pixel = get_shadow_pixel(y, x);
+    pixel[0] = r;
+    pixel[1] = g;
+    pixel[2] = b;
+  }
+}
+
+
+// Copies a row of r/g/b triplets to the shadow buffer, clipping it to the
+// captured area.
+static void capture_rgb_row(int y, int x, int width, const uint8_t *rgb_data) {
+  int skip;
+
+  if (is_row_captured(y) == false) {
+    return;
+  }
+
+  if (x < capture_xpos) {
+    skip = capture_xpos - x;
+    x += skip;
+    width -= skip;
+    rgb_data += skip * 3;
+  }
+  if (x + width > capture_xpos + capture_width) {
+    width = capture_xpos + capture_width - x;
+  }
+
+  if (width > 0) {
+    memcpy(get_shadow_pixel(y, x), rgb_data, width * 3);
+  }
+}
+
+
+static void capture_draw_rgb_span(int y, int x, int width,
+    uint8_t *rgb_data) {
+  captured_screen->draw_rgb_span(y, x, width, rgb_data);
+  capture_rgb_row(y, x, width, rgb_data);
+}
+
+
+static void capture_draw_alpha_mask(int y, int x, int width, int height,
+    uint8_t *mask, int mask_pitch,
+    uint8_t foreground_r, uint8_t foreground_g, uint8_t foreground_b,
+    uint8_t background_r, uint8_t background_g, uint8_t background_b) {
+  uint8_t foreground[3] = { foreground_r, foreground_g, foreground_b };
+  uint8_t background[3] = { background_r, background_g, background_b };
+  uint8_t blended_row[(width + 1) * 3];
+  uint8_t *mask_row;
+  int row, pixel_x, run_start;
+
+  captured_screen->draw_alpha_mask(y, x, width, height, mask, mask_pitch,
+      foreground_r, foreground_g, foreground_b,
+      background_r, background_g, background_b);
+
+  for (row=0; row<height; row++) {
+    if (is_row_captured(y + row) == false) {
+      continue;
+    }
+
+    // Pixels without coverage are left untouched, just as on screen.
+    mask_row = mask + row * mask_pitch;
+    blend_gray_row(mask_row, width, blended_row, foreground, background);
+    run_start = -1;
+    for (pixel_x=0; pixel_x<=width; pixel_x++) {
+      if ( (pixel_x < width) && (mask_row[pixel_x] != 0) ) {
+        if (run_start < 0) {
+          run_start = pixel_x;
+        }
+      }
+      else if (run_start >= 0) {
+        capture_rgb_row(y + row, x + run_start, pixel_x - run_start,
+            blended_row + run_start * 3);
+        run_start = -1;
+      }
+    }
+  }
+}
+
+
+static void capture_fill_area(int startx, int starty, int xsize, int ysize,
+    uint8_t r, uint8_t g, uint8_t b) {
+  int y, x, end_x;
+  uint8_t *pixel;
+
+  captured_screen->fill_area(startx, starty, xsize, ysize, r, g, b);
+
+  end_x = startx + xsize;
+  if (startx < capture_xpos) {
+    startx = capture_xpos;
+  }
+  if (end_x > capture_xpos + capture_width) {
+    end_x = capture_xpos + capture_width;
+  }
+  if (startx >= end_x) {
+    return;
+  }
+
+  for (y=starty; y<starty+ysize; y++) {
+    if (is_row_captured(y) == true) {
+      pixel = get_shadow_pixel(y, startx);
+      for (x=startx; x<end_x; x++) {
+        *(pixel++) = r;
+        *(pixel++) = g;
+        *(pixel++) = b;
+      }
+      // A row is only known completely once it has been filled.
+      if ( (startx == capture_xpos)
+          && (end_x == capture_xpos + capture_width) ) {
+        shadow_row_is_complete[y - capture_ypos] = true;
+      }
+    }
+  }
+}
+
+
+static void capture_copy_area(int dsty, int dstx, int srcy, int srcx,
+    int height, int width) {
+  int y;
+
+  captured_screen->copy_area(dsty, dstx, srcy, srcx, height, width);
+
+  if ( (dstx == capture_xpos) && (srcx == capture_xpos)
+      && (width == capture_width)
+      && (srcy >= capture_ypos) && (dsty >= capture_ypos)
+      && (srcy + height <= capture_ypos + capture_height)
+      && (dsty + height <= capture_ypos + capture_height) ) {
+    memmove(get_shadow_pixel(dsty, dstx), get_shadow_pixel(srcy, srcx),
+        (size_t)height * capture_width * 3);
+    memmove(shadow_row_is_complete + (dsty - capture_ypos),
+        shadow_row_is_complete + (srcy - capture_ypos),
+        height * sizeof(bool));
+  }
+  else {
+    // Anything other than moving whole rows within the captured area
+    // leaves the destination rows unknown.
+    for (y=dsty; y<dsty+height; y++) {
+      if (is_row_captured(y) == true) {
+        shadow_row_is_complete[y - capture_ypos] = false;
+      }
+    }
+  }
+}
+
+
+struct z_screen_pixel_interface *start_scrollback_capture(
+    struct z_screen_pixel_interface *screen, int xpos, int ypos, int width,
+    int height) {
+  size_t size = (size_t)width * height;
+
+  if ( (captured_screen != NULL)
+      && (capture_xpos == xpos) && (capture_ypos == ypos)
+      && (capture_width == width) && (capture_height == height) ) {
+    return &capture_interface;
+  }
+
+  if (size > shadow_size) {
+    shadow_pixels = fizmo_realloc(shadow_pixels, size * 3);
+    shadow_size = size;
+  }
+  shadow_row_is_complete = fizmo_realloc(
+      shadow_row_is_complete, height * sizeof(bool));
+  memset(shadow_row_is_complete, 0, height * sizeof(bool));
+
+  if ((size_t)width * 4 > row_buffer_size) {
+    row_buffer_size = (size_t)width * 4;
+    row_buffer = fizmo_realloc(row_buffer, row_buffer_size);
+  }
+
+  capture_xpos = xpos;
+  capture_ypos = ypos;
+  capture_width = width;
+  capture_height = height;
+
+  captured_screen = screen;
+  memcpy(&capture_interface, screen, sizeof(struct z_screen_pixel_interface));
+  capture_interface.draw_rgb_pixel = &capture_draw_rgb_pixel;
+  capture_interface.fill_area = &capture_fill_area;
+  capture_interface.copy_area = &capture_copy_area;
+  if (screen->draw_rgb_span != NULL) {
+    capture_interface.draw_rgb_span = &capture_draw_rgb_span;
+  }
+  if (screen->draw_alpha_mask != NULL) {
+    capture_interface.draw_alpha_mask = &capture_draw_alpha_mask;
+  }
+
+  TRACE_LOG("Started scrollback capture at %d/%d, %dx%d.\n",
+      xpos, ypos, width, height);
+
+  return &capture_interface;
+}
+
+
+void end_scrollback_capture() {
+  captured_screen = NULL;
+}
+
+
+static int encode_row(const uint8_t *rgb_data, int width) {
+  int x = 0, run_length, size = 0;
+
+  while (x < width) {
+    run_length = 1;
+    while ( (x + run_length < width)
+        && (run_length < SCROLLBACK_RUN_MAX_LENGTH)
+        && (memcmp(rgb_data + x * 3, rgb_data + (x + run_length) * 3, 3)
+          == 0) ) {
+      run_length++;
+    }
+
+    if (size + 4 > width * 3) {
+      // Doesn't get any smaller.
+      return -1;
+    }
+
+    row_buffer[size++] = run_length;
+    memcpy(row_buffer + size, rgb_data + x * 3, 3);
+    size += 3;
+    x += run_length;
+  }
+
+  return size;
+}
+
+
+static void decode_row(const scrollback_row *entry) {
+  uint8_t *output = row_buffer;
+  int i, j;
+
+  if (entry->is_encoded == false) {
+    memcpy(row_buffer, entry->data, entry->size);
+    return;
+  }
+
+  for (i=0; i<entry->size; i+=4) {
+    for (j=0; j<entry->data[i]; j++) {
+      memcpy(output, entry->data + i + 1, 3);
+      output += 3;
+    }
+  }
+}
+
+
+static void free_scrollback_row(scrollback_row *entry) {
+  if (entry->data != NULL) {
+    scrollback_cache_bytes -= entry->size;
+    free(entry->data);
+    entry->data = NULL;
+  }
+}
+
+
+void store_scrollback_rows(long top_row, long lowest_row) {
+  scrollback_row *entry;
+  const uint8_t *rgb_data;
+  long row;
+  int y, size;
+
+  if (captured_screen == NULL) {
+    return;
+  }
+
+  for (y=0; y<capture_height; y++) {
+    row = top_row - y;
+    if ( (row < lowest_row) || (shadow_row_is_complete[y] == false) ) {
+      continue;
+    }
+
+    entry = &scrollback_rows[row & (SCROLLBACK_CACHE_SIZE - 1)];
+    if ( (entry->data != NULL)
+        && (entry->row == row)
+        && (entry->width == capture_width) ) {
+      continue;
+    }
+
+    rgb_data = get_shadow_pixel(capture_ypos + y, capture_xpos);
+    size = encode_row(rgb_data, capture_width);
+    free_scrollback_row(entry);
+
+    if (scrollback_cache_bytes
+        + (size >= 0 ? size : capture_width * 3)
+        > SCROLLBACK_CACHE_MAX_BYTES) {
+      continue;
+    }
+
+    if (size >= 0) {
+      entry->data = fizmo_malloc(size);
+      memcpy(entry->data, row_buffer, size);
+      entry->is_encoded = true;
+    }
+    else {
+      size = capture_width * 3;
+      entry->data = fizmo_malloc(size);
+      memcpy(entry->data, rgb_data, size);
+      entry->is_encoded = false;
+    }
+
+    entry->row = row;
+    entry->width = capture_width;
+    entry->size = size;
+    scrollback_cache_bytes += size;
+  }
+}
+
+
+bool draw_scrollback_rows(long top_row, int first_row, int nof_rows) {
+  scrollback_row *entry;
+  long row;
+  int y, x;
+
+  if ( (captured_screen == NULL)
+      || (first_row < 0)
+      || (first_row + nof_rows > capture_height) ) {
+    return false;
+  }
+
+  for (y=first_row; y<first_row+nof_rows; y++) {
+    row = top_row - y;
+    entry = &scrollback_rows[row & (SCROLLBACK_CACHE_SIZE - 1)];
+    if ( (entry->data == NULL)
+        || (entry->row != row)
+        || (entry->width != capture_width) ) {
+      return false;
+    }
+  }
+
+  TRACE_LOG("Drawing %d rows from the scrollback cache.\n", nof_rows);
+
+  for (y=first_row; y<first_row+nof_rows; y++) {
+    decode_row(&scrollback_rows[(top_row - y) & (SCROLLBACK_CACHE_SIZE - 1)]);
+
+    if (captured_screen->draw_rgb_span != NULL) {
+      capture_draw_rgb_span(
+          capture_ypos + y, capture_xpos, capture_width, row_buffer);
+    }
+    else {
+      for (x=0; x<capture_width; x++) {
+        capture_draw_rgb_pixel(
+            capture_ypos + y,
+            capture_xpos + x,
+            row_buffer[x * 3],
+            row_buffer[x * 3 + 1],
+            row_buffer[x * 3 + 2]);
+      }
+    }
+    shadow_row_is_complete[y] = true;
+  }
+
+  return true;
+}
+
+
+void invalidate_scrollback_cache() {
+  int i;
+
+  if (scrollback_cache_bytes == 0) {
+    return;
+  }
+
+  for (i=0; i<SCROLLBACK_CACHE_SIZE; i++) {
+    free_scrollback_row(&scrollback_rows[i]);
+  }
+
+  TRACE_LOG("Invalidated scrollback cache.\n");
+}
+
+
+void free_scrollback_cache() {
+  invalidate_scrollback_cache();
+  end_scrollback_capture();
+
+  if (shadow_pixels != NULL) {
+    free(shadow_pixels);
+    shadow_pixels = NULL;
+    shadow_size = 0;
+  }
+  if (shadow_row_is_complete != NULL) {
+    free(shadow_row_is_complete);
+    shadow_row_is_complete = NULL;
+  }
+  if (row_buffer != NULL) {
+    free(row_buffer);
+    row_buffer = NULL;
+    row_buffer_size = 0;
+  }
+}
+
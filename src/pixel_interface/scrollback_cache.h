@@ -0,0 +1,74 @@
+
+/* scrollback_cache.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef scrollback_cache_h_INCLUDED
+#define scrollback_cache_h_INCLUDED
+
+#include "tools/types.h"
+#include "../screen_interface/screen_pixel_interface.h"
+
+// Number of rendered pixel rows kept, must be a power of two.
+#define SCROLLBACK_CACHE_SIZE 4096
+
+// Upper limit for the memory used by the stored rows.
+#define SCROLLBACK_CACHE_MAX_BYTES (16 * 1024 * 1024)
+
+// Returns an interface which forwards all calls to "screen" and keeps a
+// copy of the pixels drawn into the given area, usually window 0. Until
+// end_scrollback_capture is invoked, all drawing has to go through the
+// returned interface.
+struct z_screen_pixel_interface *start_scrollback_capture(
+    struct z_screen_pixel_interface *screen, int xpos, int ypos, int width,
+    int height);
+void end_scrollback_capture();
+
+// Stores all rows of the captured area which have been completely drawn.
+// Rows are identified by their distance from the bottom of the scrollback,
+// so row y of the area is stored as "top_row - y". Rows below
+// "lowest_row" are not stored.
+void store_scrollback_rows(long top_row, long lowest_row);
+
+// Draws the rows first_row..first_row+nof_rows-1 of the captured area from
+// the cache. Returns false without drawing anything in case any of these
+// rows isn't stored.
+bool draw_scrollback_rows(long top_row, int first_row, int nof_rows);
+
+// Discards all rows, required whenever the scrollback's content changes.
+void invalidate_scrollback_cache();
+
+void free_scrollback_cache();
+
+#endif // scrollback_cache_h_INCLUDED
+
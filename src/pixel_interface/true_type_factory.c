@@ -32,19 +32,113 @@
  */
 
 
+#include <stdlib.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif // HAVE_MMAP
+
+#if defined(HAVE_MMAP) || defined(HAVE_SYS_STAT_H)
+#include <sys/stat.h>
+#endif
+
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_LCD_FILTER_H
+#include FT_CACHE_H
 
 #include "true_type_factory.h"
 #include "true_type_font.h"
+#include "glyph_blending.h"
 #include "tools/tracelog.h"
+#include "tools/unused.h"
 #include "tools/i18n.h"
 #include "tools/filesys.h"
 #include "interpreter/fizmo.h"
 #include "../locales/libpixelif_locales.h"
 
-true_type_factory *create_true_type_factory(char *font_search_path) {
+#define FONT_INDEX_HASH_SIZE 256
+#define FONT_INDEX_CACHE_HEADER "libpixelif-font-index 1"
+
+typedef struct font_index_entry_struct {
+  char *filename;
+  char *path;
+  struct font_index_entry_struct *next;
+} font_index_entry;
+
+#ifdef HAVE_SYS_STAT_H
+typedef struct indexed_directory_struct {
+  char *dirname;
+  time_t mtime;
+} indexed_directory;
+#endif // HAVE_SYS_STAT_H
+
+// Kept out of the public header, since its layout depends on the build's
+// platform checks.
+struct font_index_struct {
+  font_index_entry *entries[FONT_INDEX_HASH_SIZE];
+#ifdef HAVE_SYS_STAT_H
+  // Directories scanned while building the index, stored in the cache.
+  indexed_directory *indexed_directories;
+  int nof_indexed_directories;
+  int indexed_directories_size;
+#endif // HAVE_SYS_STAT_H
+};
+
+static FT_Error request_face(FTC_FaceID ftc_face_id, FT_Library library,
+    FT_Pointer request_data, FT_Face *face);
+
+
+// Parses a comma-separated list of hexadecimal char code ranges like
+// "0020-00ff,2000-206f" into first/last pairs stored in range_bounds,
+// which may be NULL in case the ranges should only be validated.
+// Returns the number of ranges or -1 in case the list is invalid.
+int parse_glyph_preload_ranges(char *ranges, z_ucs *range_bounds) {
+  int nof_ranges = 0;
+  unsigned long first, last;
+  char *ptr = ranges, *endptr;
+
+  if (ranges == NULL) {
+    return -1;
+  }
+
+  while (*ptr != 0) {
+    if (nof_ranges == MAX_GLYPH_PRELOAD_RANGES) {
+      return -1;
+    }
+
+    first = strtoul(ptr, &endptr, 16);
+    if ( (endptr == ptr) || (*endptr != '-') ) {
+      return -1;
+    }
+    ptr = endptr + 1;
+
+    last = strtoul(ptr, &endptr, 16);
+    if ( (endptr == ptr) || (last < first) || (last > 0x10ffff)
+        || ( (*endptr != ',') && (*endptr != 0) ) ) {
+      return -1;
+    }
+    ptr = *endptr == ',' ? endptr + 1 : endptr;
+
+    if (range_bounds != NULL) {
+      range_bounds[nof_ranges * 2] = first;
+      range_bounds[nof_ranges * 2 + 1] = last;
+    }
+    nof_ranges++;
+  }
+
+  return nof_ranges;
+}
+
+
+true_type_factory *create_true_type_factory(char *font_search_path,
+    char *glyph_preload_ranges, char *font_index_cache_filename,
+    long font_cache_size) {
   true_type_factory *result;
   int ft_error;
 
@@ -66,6 +160,41 @@ true_type_factory *create_true_type_factory(char *font_search_path) {
     result->render_mode = FT_RENDER_MODE_LCD;
   }
 
+  init_glyph_blending();
+
+  if ( (glyph_preload_ranges == NULL)
+      || ((result->nof_glyph_preload_ranges = parse_glyph_preload_ranges(
+            glyph_preload_ranges, result->glyph_preload_ranges)) == -1) ) {
+    result->nof_glyph_preload_ranges = parse_glyph_preload_ranges(
+        DEFAULT_GLYPH_PRELOAD_RANGES, result->glyph_preload_ranges);
+  }
+
+  result->mapped_font_files = NULL;
+  result->font_face_ids = NULL;
+  result->ftc_manager = NULL;
+
+  // In case a cache size is given, faces, sizes and small glyph bitmaps
+  // for all fonts are managed by FreeType's cache subsystem, and the memory
+  // used for bitmaps is bounded by font_cache_size bytes.
+  if (font_cache_size > 0) {
+    if ( (FTC_Manager_New(result->ftlibrary, FTC_MAX_FACES, FTC_MAX_SIZES,
+            font_cache_size, request_face, result, &result->ftc_manager) != 0)
+        || (FTC_CMapCache_New(
+            result->ftc_manager, &result->ftc_cmap_cache) != 0)
+        || (FTC_SBitCache_New(
+            result->ftc_manager, &result->ftc_sbit_cache) != 0) ) {
+      TRACE_LOG("Could not initialize FreeType cache subsystem.\n");
+      if (result->ftc_manager != NULL) {
+        FTC_Manager_Done(result->ftc_manager);
+        result->ftc_manager = NULL;
+      }
+    }
+  }
+  result->font_index = NULL;
+  result->font_index_cache_filename
+    = font_index_cache_filename != NULL
+    ? strdup(font_index_cache_filename)
+    : NULL;
   result->font_search_path = strdup(font_search_path);
   TRACE_LOG("factory path: %s\n", result->font_search_path);
 
@@ -86,18 +215,139 @@ static void close_ft_stream(FT_Stream stream) {
 }
 
 
-// Will return NULL if unsuccessful or a freshly malloced string (which you
-// have to free() yourself later on) of the dirname + filename in case the
-// file was found.
-static char *find_file_recursively(char *dirname, char *filename) {
+static unsigned int font_index_hash(char *filename) {
+  unsigned int result = 5381;
+
+  while (*filename != 0) {
+    result = result * 33 + (unsigned char)*filename;
+    filename++;
+  }
+
+  return result % FONT_INDEX_HASH_SIZE;
+}
+
+
+static font_index_entry *find_font_index_entry(true_type_factory *factory,
+    char *filename) {
+  font_index_entry *entry
+    = factory->font_index->entries[font_index_hash(filename)];
+
+  while (entry != NULL) {
+    if (strcmp(entry->filename, filename) == 0) {
+      return entry;
+    }
+    entry = entry->next;
+  }
+
+  return NULL;
+}
+
+
+// Adds filename to the index unless it's already present, in which case
+// the earlier entry wins. This keeps the search path order and the
+// depth-first order of the directory scan.
+static void add_font_index_entry(true_type_factory *factory, char *filename,
+    char *path) {
+  font_index_entry *entry;
+  unsigned int hash;
+
+  if (find_font_index_entry(factory, filename) != NULL) {
+    return;
+  }
+
+  hash = font_index_hash(filename);
+  entry = (font_index_entry*)fizmo_malloc(sizeof(font_index_entry));
+  entry->filename = strdup(filename);
+  entry->path = strdup(path);
+  entry->next = factory->font_index->entries[hash];
+  factory->font_index->entries[hash] = entry;
+}
+
+
+#ifdef HAVE_SYS_STAT_H
+static void add_indexed_directory(true_type_factory *factory, char *dirname,
+    time_t mtime) {
+  struct font_index_struct *index = factory->font_index;
+
+  if (index->nof_indexed_directories == index->indexed_directories_size) {
+    index->indexed_directories_size += 32;
+    index->indexed_directories = (indexed_directory*)fizmo_realloc(
+        index->indexed_directories,
+        sizeof(indexed_directory) * index->indexed_directories_size);
+  }
+
+  index->indexed_directories[index->nof_indexed_directories].dirname
+    = strdup(dirname);
+  index->indexed_directories[index->nof_indexed_directories].mtime
+    = mtime;
+  index->nof_indexed_directories++;
+}
+
+
+static void free_indexed_directories(true_type_factory *factory) {
+  struct font_index_struct *index = factory->font_index;
+  int i;
+
+  for (i=0; i<index->nof_indexed_directories; i++) {
+    free(index->indexed_directories[i].dirname);
+  }
+  if (index->indexed_directories != NULL) {
+    free(index->indexed_directories);
+  }
+  index->indexed_directories = NULL;
+  index->nof_indexed_directories = 0;
+  index->indexed_directories_size = 0;
+}
+#endif // HAVE_SYS_STAT_H
+
+
+static void new_font_index(true_type_factory *factory) {
+  factory->font_index = (struct font_index_struct*)fizmo_malloc(
+      sizeof(struct font_index_struct));
+  memset(factory->font_index, 0, sizeof(struct font_index_struct));
+}
+
+
+static void free_font_index(true_type_factory *factory) {
+  font_index_entry *entry;
+  int i;
+
+  if (factory->font_index == NULL) {
+    return;
+  }
+
+  for (i=0; i<FONT_INDEX_HASH_SIZE; i++) {
+    while ((entry = factory->font_index->entries[i]) != NULL) {
+      factory->font_index->entries[i] = entry->next;
+      free(entry->filename);
+      free(entry->path);
+      free(entry);
+    }
+  }
+
+#ifdef HAVE_SYS_STAT_H
+  free_indexed_directories(factory);
+#endif // HAVE_SYS_STAT_H
+  free(factory->font_index);
+  factory->font_index = NULL;
+}
+
+
+static void index_directory(true_type_factory *factory, char *dirname) {
   z_dir *current_dir;
   struct z_dir_ent z_dir_entry;
-  char *result = NULL;
   char *fullname = NULL;
   int fullname_len = 0, current_len = 0;
+#ifdef HAVE_SYS_STAT_H
+  struct stat stat_buf;
+
+  if (stat(dirname, &stat_buf) == 0) {
+    add_indexed_directory(factory, dirname, stat_buf.st_mtime);
+  }
+#endif // HAVE_SYS_STAT_H
 
   if ((current_dir = fsi->open_dir(dirname)) == NULL) {
-    return NULL;
+    return;
   }
 
   while (fsi->read_dir(&z_dir_entry, current_dir) == 0) {
@@ -116,75 +366,277 @@ static char *find_file_recursively(char *dirname, char *filename) {
     strcat(fullname, z_dir_entry.d_name);
 
     if (fsi->is_filename_directory(fullname) == true) {
-      if ((result = find_file_recursively(fullname, filename)) != NULL) {
-        fsi->close_dir(current_dir);
-        free(fullname);
-        return result;
-      }
+      index_directory(factory, fullname);
     }
     else {
-      if (strcmp(z_dir_entry.d_name, filename) == 0) {
-        fsi->close_dir(current_dir);
-        return fullname;
-      }
+      add_font_index_entry(factory, z_dir_entry.d_name, fullname);
     }
   }
 
-  free(fullname);
+  if (fullname != NULL) {
+    free(fullname);
+  }
   fsi->close_dir(current_dir);
-  return NULL;
 }
 
 
-true_type_font *create_true_type_font(true_type_factory *factory,
-    char *font_filename, int pixel_size, int line_height) {
-  int ft_error;
-  z_file *fontfile;
-  char *token, *filename, *path_copy;
-  FT_Open_Args *openArgs;
-  FT_Stream stream;
-  long filesize;
-  true_type_font *result;
+#ifdef HAVE_SYS_STAT_H
+// Reads a line of any length into *line, which is grown as required.
+// Returns the line's length or -1 at the end of the file.
+static long read_cache_line(char **line, size_t *line_size, FILE *in) {
+#ifdef HAVE_GETLINE
+  return getline(line, line_size, in);
+#else
+  size_t len = 0;
 
-  if (factory->font_search_path == NULL)
-    return NULL;
+  if (*line_size < 128) {
+    *line_size = 128;
+    *line = fizmo_realloc(*line, *line_size);
+  }
 
-  TRACE_LOG("Loading font %s\n", font_filename);
-  path_copy = strdup(factory->font_search_path);
-  token = strtok(path_copy, ":");
-  fontfile = NULL;
-  while (token) {
-    if ((filename = find_file_recursively(token, font_filename)) != NULL) {
-      fontfile = fsi->openfile(filename, FILETYPE_DATA, FILEACCESS_READ);
-      free(filename);
+  while (fgets(*line + len, *line_size - len, in) != NULL) {
+    len += strlen(*line + len);
+    if ( (len > 0) && ((*line)[len - 1] == '\n') ) {
+      return len;
+    }
+    *line_size *= 2;
+    *line = fizmo_realloc(*line, *line_size);
+  }
+
+  return len > 0 ? (long)len : -1;
+#endif // HAVE_GETLINE
+}
 
-      if (fontfile != NULL) {
+
+// The index cache file is a plain text file. It starts with the
+// FONT_INDEX_CACHE_HEADER line, followed by an "S" line containing the
+// search path the index was built for, one "D" line per scanned directory
+// containing its modification time and name and one "F" line per font file
+// containing the filename and the full path, separated by a tab. The cache
+// is only used in case the search path is unchanged and none of the
+// directory modification times differ.
+static int read_font_index_cache(true_type_factory *factory) {
+  FILE *in;
+  char *line = NULL, *separator;
+  size_t line_size = 0;
+  long line_len;
+  struct stat stat_buf;
+  long long mtime;
+  int offset;
+  bool header_found = false, search_path_matches = false;
+  int result = 0;
+
+  if ((in = fopen(factory->font_index_cache_filename, "r")) == NULL) {
+    return -1;
+  }
+
+  while ((line_len = read_cache_line(&line, &line_size, in)) > 0) {
+    if (line[line_len - 1] == '\n') {
+      line[--line_len] = 0;
+    }
+
+    if (header_found == false) {
+      if (strcmp(line, FONT_INDEX_CACHE_HEADER) != 0) {
+        result = -1;
         break;
       }
+      header_found = true;
     }
-
-    /*
-    filename = fizmo_malloc(strlen(token) + strlen(font_filename) + 2);
-    strcpy(filename, token);
-    strcat(filename, "/");
-    strcat(filename, font_filename);
-    if ((fontfile = fsi->openfile(filename, FILETYPE_DATA, FILEACCESS_READ))
-        != NULL) {
-      free(filename);
+    else if (strncmp(line, "S ", 2) == 0) {
+      if (strcmp(line + 2, factory->font_search_path) != 0) {
+        result = -1;
+        break;
+      }
+      search_path_matches = true;
+    }
+    else if (strncmp(line, "D ", 2) == 0) {
+      if ( (sscanf(line + 2, "%lld %n", &mtime, &offset) != 1)
+          || (stat(line + 2 + offset, &stat_buf) != 0)
+          || ((long long)stat_buf.st_mtime != mtime) ) {
+        TRACE_LOG("Font index cache is outdated.\n");
+        result = -1;
+        break;
+      }
+    }
+    else if ( (strncmp(line, "F ", 2) == 0)
+        && ((separator = strchr(line + 2, '\t')) != NULL) ) {
+      *separator = 0;
+      add_font_index_entry(factory, line + 2, separator + 1);
+    }
+    else {
+      result = -1;
       break;
     }
-    free(filename);
-    */
+  }
+
+  if (line != NULL) {
+    free(line);
+  }
+  fclose(in);
 
+  if (search_path_matches == false) {
+    result = -1;
+  }
+
+  return result;
+}
+
+
+static void write_font_index_cache(true_type_factory *factory) {
+  FILE *out;
+  font_index_entry *entry;
+  int i;
+
+  if ((out = fopen(factory->font_index_cache_filename, "w")) == NULL) {
+    TRACE_LOG("Could not write font index cache \"%s\".\n",
+        factory->font_index_cache_filename);
+    return;
+  }
+
+  fprintf(out, "%s\nS %s\n", FONT_INDEX_CACHE_HEADER,
+      factory->font_search_path);
+
+  for (i=0; i<factory->font_index->nof_indexed_directories; i++) {
+    fprintf(out, "D %lld %s\n",
+        (long long)factory->font_index->indexed_directories[i].mtime,
+        factory->font_index->indexed_directories[i].dirname);
+  }
+
+  for (i=0; i<FONT_INDEX_HASH_SIZE; i++) {
+    entry = factory->font_index->entries[i];
+    while (entry != NULL) {
+      if ( (strpbrk(entry->filename, "\t\n") == NULL)
+          && (strchr(entry->path, '\n') == NULL) ) {
+        fprintf(out, "F %s\t%s\n", entry->filename, entry->path);
+      }
+      entry = entry->next;
+    }
+  }
+
+  fclose(out);
+}
+#endif // HAVE_SYS_STAT_H
+
+
+// Builds the filename to path index for all files below the font search
+// path, either from the index cache file in case it's valid or by scanning
+// all directories once.
+static void build_font_index(true_type_factory *factory) {
+  char *token, *path_copy;
+
+  new_font_index(factory);
+
+#ifdef HAVE_SYS_STAT_H
+  if (factory->font_index_cache_filename != NULL) {
+    if (read_font_index_cache(factory) == 0) {
+      TRACE_LOG("Using font index cache \"%s\".\n",
+          factory->font_index_cache_filename);
+      return;
+    }
+
+    // Drop whatever has been read from an outdated or broken cache.
+    free_font_index(factory);
+    new_font_index(factory);
+  }
+#endif // HAVE_SYS_STAT_H
+
+  TRACE_LOG("Scanning font search path \"%s\".\n", factory->font_search_path);
+  path_copy = strdup(factory->font_search_path);
+  token = strtok(path_copy, ":");
+  while (token) {
+    index_directory(factory, token);
     token = strtok(NULL, ":");
   }
   free(path_copy);
 
-  if (fontfile == NULL) {
-    TRACE_LOG("Font %s not found.\n", font_filename);
+#ifdef HAVE_SYS_STAT_H
+  if (factory->font_index_cache_filename != NULL) {
+    write_font_index_cache(factory);
+  }
+  free_indexed_directories(factory);
+#endif // HAVE_SYS_STAT_H
+}
+
+
+#ifdef HAVE_MMAP
+// Maps the given font file into memory, or returns the existing mapping in
+// case the same file has already been mapped for another style. Mappings
+// are kept until the factory is destroyed. Returns NULL on failure.
+static mapped_font_file *get_mapped_font_file(true_type_factory *factory,
+    char *filename) {
+  mapped_font_file *mapped_file = factory->mapped_font_files;
+  struct stat stat_buf;
+  void *data;
+  int fd;
+
+  while (mapped_file != NULL) {
+    if (strcmp(mapped_file->filename, filename) == 0) {
+      TRACE_LOG("Re-using mapping for %s.\n", filename);
+      return mapped_file;
+    }
+    mapped_file = mapped_file->next;
+  }
+
+  if ((fd = open(filename, O_RDONLY)) == -1) {
+    return NULL;
+  }
+
+  if ( (fstat(fd, &stat_buf) != 0) || (stat_buf.st_size == 0) ) {
+    close(fd);
+    return NULL;
+  }
+
+  data = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
     return NULL;
   }
 
+  TRACE_LOG("Mapped %s, %ld bytes.\n", filename, (long)stat_buf.st_size);
+
+  mapped_file = (mapped_font_file*)fizmo_malloc(sizeof(mapped_font_file));
+  mapped_file->filename = strdup(filename);
+  mapped_file->data = data;
+  mapped_file->size = stat_buf.st_size;
+  mapped_file->next = factory->mapped_font_files;
+  factory->mapped_font_files = mapped_file;
+
+  return mapped_file;
+}
+#endif // HAVE_MMAP
+
+
+// Opens a face from the given file, using a memory mapping where available
+// and falling back to a stream reading via the fizmo filesys interface.
+// Returns 0 on success.
+static int open_font_face(true_type_factory *factory, char *filename,
+    FT_Face *face) {
+  z_file *fontfile;
+  FT_Open_Args *openArgs;
+  FT_Stream stream;
+  long filesize;
+  int ft_error;
+#ifdef HAVE_MMAP
+  mapped_font_file *mapped_file;
+
+  if ((mapped_file = get_mapped_font_file(factory, filename)) != NULL) {
+    ft_error = FT_New_Memory_Face(
+        factory->ftlibrary,
+        (const FT_Byte*)mapped_file->data,
+        mapped_file->size,
+        0,
+        face);
+
+    return ft_error == 0 ? 0 : -1;
+  }
+#endif // HAVE_MMAP
+
+  if ((fontfile = fsi->openfile(filename, FILETYPE_DATA, FILEACCESS_READ))
+      == NULL) {
+    return -1;
+  }
+
   fsi->setfilepos(fontfile, 0, SEEK_END);
   filesize = fsi->getfilepos(fontfile);
   fsi->setfilepos(fontfile, 0, SEEK_SET);
@@ -201,34 +653,141 @@ true_type_font *create_true_type_font(true_type_factory *factory,
   openArgs->stream->read = read_ft_stream;
   openArgs->stream->close = close_ft_stream;
 
-  result = (true_type_font*)fizmo_malloc(sizeof(true_type_font));
+  ft_error = FT_Open_Face(factory->ftlibrary, openArgs, 0, face);
 
-  ft_error = FT_Open_Face(factory->ftlibrary, openArgs, 0, &result->face);
+  //free(stream),
+  //free(openArgs);
 
   if ( ft_error == FT_Err_Unknown_File_Format ) {
     // ... the font file could be opened and read, but it appears
     // ... that its font format is unsupported
-    return NULL;
+    return -1;
   }
   else if ( ft_error ) {
     // ... another ft_error code means that the font file could not
     // ... be opened or read, or simply that it is broken...
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Face ids for the cache subsystem. Styles using the same file share a
+// face id, and thus a face.
+static font_face_id *get_font_face_id(true_type_factory *factory,
+    char *path) {
+  font_face_id *face_id = factory->font_face_ids;
+
+  while (face_id != NULL) {
+    if (strcmp(face_id->path, path) == 0) {
+      return face_id;
+    }
+    face_id = face_id->next;
+  }
+
+  face_id = (font_face_id*)fizmo_malloc(sizeof(font_face_id));
+  face_id->path = strdup(path);
+  face_id->next = factory->font_face_ids;
+  factory->font_face_ids = face_id;
+
+  return face_id;
+}
+
+
+// Invoked by the cache manager whenever a face has to be (re-)opened.
+static FT_Error request_face(FTC_FaceID ftc_face_id,
+    FT_Library UNUSED(library), FT_Pointer request_data, FT_Face *face) {
+  font_face_id *face_id = (font_face_id*)ftc_face_id;
+
+  TRACE_LOG("Cache manager requests face %s.\n", face_id->path);
+
+  return open_font_face((true_type_factory*)request_data, face_id->path, face)
+    == 0 ? FT_Err_Ok : FT_Err_Cannot_Open_Resource;
+}
+
+
+true_type_font *create_true_type_font(true_type_factory *factory,
+    char *font_filename, int pixel_size, int line_height) {
+  int ft_error;
+  font_index_entry *entry;
+  FT_Face face = NULL;
+  font_face_id *face_id;
+  FTC_ScalerRec scaler;
+  FT_Size size;
+  true_type_font *result;
+  int i;
+
+  if (factory->font_search_path == NULL)
     return NULL;
+
+  TRACE_LOG("Loading font %s\n", font_filename);
+
+  if (factory->font_index == NULL) {
+    build_font_index(factory);
   }
 
-  //free(stream),
-  //free(openArgs);
+  if ((entry = find_font_index_entry(factory, font_filename)) == NULL) {
+    TRACE_LOG("Font %s not found.\n", font_filename);
+    return NULL;
+  }
+
+  if (factory->ftc_manager != NULL) {
+    face_id = get_font_face_id(factory, entry->path);
+
+    scaler.face_id = (FTC_FaceID)face_id;
+    scaler.width = 0;
+    scaler.height = pixel_size;
+    scaler.pixel = 1;
+    scaler.x_res = 0;
+    scaler.y_res = 0;
+
+    if (FTC_Manager_LookupSize(factory->ftc_manager, &scaler, &size) != 0) {
+      TRACE_LOG("Font %s could not be opened.\n", font_filename);
+      return NULL;
+    }
+  }
+  else if (open_font_face(factory, entry->path, &face) != 0) {
+    TRACE_LOG("Font %s could not be opened.\n", font_filename);
+    return NULL;
+  }
+
+  result = (true_type_font*)fizmo_malloc(sizeof(true_type_font));
+  result->face = face;
 
   result->font_height_in_pixel = pixel_size;
   result->line_height = line_height;
   result->render_mode = factory->render_mode;
-  result->glyph_size_cache = NULL;
-  result->glyph_size_cache_size = 0;
+  tt_init_glyph_size_cache(result);
+  result->rendered_glyph_cache = NULL;
+  result->ftc_manager = factory->ftc_manager;
+
+  if (factory->ftc_manager != NULL) {
+    result->ftc_cmap_cache = factory->ftc_cmap_cache;
+    result->ftc_sbit_cache = factory->ftc_sbit_cache;
+    result->ftc_scaler = scaler;
+    result->ascender = size->metrics.ascender / 64;
+  }
+  else {
+    ft_error = FT_Set_Pixel_Sizes(
+        result->face,
+        0,
+        pixel_size);
+
+    if (ft_error != 0) {
+      TRACE_LOG("Could not set pixel size %d for %s.\n",
+          pixel_size, font_filename);
+    }
+
+    result->ascender = result->face->size->metrics.ascender / 64;
+  }
 
-  ft_error = FT_Set_Pixel_Sizes(
-      result->face,
-      0,
-      pixel_size);
+  for (i=0; i<factory->nof_glyph_preload_ranges; i++) {
+    tt_preload_glyph_sizes(
+        result,
+        factory->glyph_preload_ranges[i * 2],
+        factory->glyph_preload_ranges[i * 2 + 1]);
+  }
 
   //result->has_kerning = FT_HAS_KERNING(result->face);
 
@@ -237,7 +796,39 @@ true_type_font *create_true_type_font(true_type_factory *factory,
 
 
 void destroy_true_type_factory(true_type_factory *factory) {
+#ifdef HAVE_MMAP
+  mapped_font_file *mapped_file;
+#endif // HAVE_MMAP
+
+  font_face_id *face_id;
+
+  if (factory->ftc_manager != NULL) {
+    FTC_Manager_Done(factory->ftc_manager);
+  }
+
+  while (factory->font_face_ids != NULL) {
+    face_id = factory->font_face_ids;
+    factory->font_face_ids = face_id->next;
+    free(face_id->path);
+    free(face_id);
+  }
+
   FT_Done_FreeType(factory->ftlibrary);
+
+#ifdef HAVE_MMAP
+  while (factory->mapped_font_files != NULL) {
+    mapped_file = factory->mapped_font_files;
+    factory->mapped_font_files = mapped_file->next;
+    munmap(mapped_file->data, mapped_file->size);
+    free(mapped_file->filename);
+    free(mapped_file);
+  }
+#endif // HAVE_MMAP
+
+  free_font_index(factory);
+  if (factory->font_index_cache_filename != NULL) {
+    free(factory->font_index_cache_filename);
+  }
   if (factory->font_search_path != NULL) {
     free(factory->font_search_path);
   }
@@ -37,15 +37,55 @@
 
 #include "true_type_font.h"
 
+// Glyph sizes for these char code ranges are measured when a font is
+// created. The default covers Latin-1 and the General Punctuation block.
+#define DEFAULT_GLYPH_PRELOAD_RANGES "0020-00ff,2000-206f"
+#define MAX_GLYPH_PRELOAD_RANGES 16
+
+// Font files mapped into memory. Several styles may be backed by the same
+// file, in which case the mapping is shared.
+typedef struct mapped_font_file_struct {
+  char *filename;
+  void *data;
+  size_t size;
+  struct mapped_font_file_struct *next;
+} mapped_font_file;
+
+// Maps font filenames to their full path below the font search path,
+// defined in true_type_factory.c.
+struct font_index_struct;
+
+// Limits for the FreeType cache subsystem. Since at most eight styles are
+// used, all faces can stay open; the byte budget bounds glyph bitmaps.
+#define FTC_MAX_FACES 8
+#define FTC_MAX_SIZES 8
+
+typedef struct font_face_id_struct {
+  char *path;
+  struct font_face_id_struct *next;
+} font_face_id;
+
 struct true_type_factory_struct {
   FT_Library ftlibrary;
   char *font_search_path;
   FT_Render_Mode render_mode;
+  z_ucs glyph_preload_ranges[MAX_GLYPH_PRELOAD_RANGES * 2];
+  int nof_glyph_preload_ranges;
+  mapped_font_file *mapped_font_files;
+  FTC_Manager ftc_manager; // NULL in case the cache subsystem isn't used.
+  FTC_CMapCache ftc_cmap_cache;
+  FTC_SBitCache ftc_sbit_cache;
+  font_face_id *font_face_ids;
+  struct font_index_struct *font_index; // NULL until the first font is created.
+  char *font_index_cache_filename;
 };
 
 typedef struct true_type_factory_struct true_type_factory;
 
-true_type_factory *create_true_type_factory(char *font_search_path);
+int parse_glyph_preload_ranges(char *ranges, z_ucs *range_bounds);
+true_type_factory *create_true_type_factory(char *font_search_path,
+    char *glyph_preload_ranges, char *font_index_cache_filename,
+    long font_cache_size);
 true_type_font *create_true_type_font(true_type_factory *factory,
     char *font_filename, int font_height_in_pixel, int line_height);
 void destroy_true_type_factory(true_type_factory *factory);
@@ -34,8 +34,10 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_ADVANCES_H
 
 #include "true_type_font.h"
+#include "glyph_blending.h"
 #include "tools/unused.h"
 #include "tools/tracelog.h"
 #include "interpreter/fizmo.h"
@@ -56,17 +58,51 @@ int tt_get_glyph_get_distance_to_rightmost_pixel(true_type_font *font,
 */
 
 
-static int get_glyph_size(true_type_font *font, z_ucs char_code,
+// Returns the font's face with its size activated, or NULL in case a face
+// managed by the cache subsystem could not be re-opened.
+static FT_Face get_face(true_type_font *font) {
+  FT_Size size;
+
+  if (font->ftc_manager == NULL) {
+    return font->face;
+  }
+
+  if (FTC_Manager_LookupSize(font->ftc_manager, &font->ftc_scaler, &size)
+      != 0) {
+    return NULL;
+  }
+
+  return size->face;
+}
+
+
+static FT_UInt get_char_index(true_type_font *font, z_ucs char_code) {
+  FT_Face face;
+
+  if (font->ftc_manager != NULL) {
+    return FTC_CMapCache_Lookup(
+        font->ftc_cmap_cache, font->ftc_scaler.face_id, -1, char_code);
+  }
+
+  return (face = get_face(font)) != NULL
+    ? FT_Get_Char_Index(face, char_code)
+    : 0;
+}
+
+
+static int get_glyph_index_size(true_type_font *font, FT_UInt glyph_index,
     int *advance, int *bitmap_width) {
 
-  FT_UInt glyph_index;
+  FT_Face face;
   FT_GlyphSlot slot;
   int ft_error;
 
-  glyph_index = FT_Get_Char_Index(font->face, char_code);
+  if ((face = get_face(font)) == NULL) {
+    return -1;
+  }
 
   ft_error = FT_Load_Glyph(
-      font->face,
+      face,
       glyph_index,
       FT_LOAD_DEFAULT);
 
@@ -74,7 +110,7 @@ static int get_glyph_size(true_type_font *font, z_ucs char_code,
     return -1;
   }
   else {
-    slot = font->face->glyph;
+    slot = face->glyph;
 
     *advance = slot->advance.x / 64;
     *bitmap_width = slot->metrics.width / 64 + slot->metrics.horiBearingX / 64;
@@ -84,90 +120,457 @@ static int get_glyph_size(true_type_font *font, z_ucs char_code,
 }
 
 
+static int get_glyph_size(true_type_font *font, z_ucs char_code,
+    int *advance, int *bitmap_width) {
+  return get_glyph_index_size(
+      font, get_char_index(font, char_code), advance, bitmap_width);
+}
+
+
+void tt_init_glyph_size_cache(true_type_font *font) {
+  int i;
+
+  for (i=0; i<GLYPH_SIZE_DIRECT_CACHE_SIZE; i++) {
+    font->glyph_size_cache[i].advance = GLYPH_SIZE_INVALID;
+  }
+  font->glyph_size_hash = NULL;
+  font->glyph_size_hash_size = 0;
+  font->glyph_size_hash_count = 0;
+}
+
+
+static inline long glyph_size_hash_index(z_ucs char_code, long hash_size) {
+  return (long)((char_code * 2654435761u) & (hash_size - 1));
+}
+
+
+// Returns the hash entry for char_code, which is either the entry already
+// holding char_code or the empty entry where it should be inserted.
+static glyph_size_hash_entry *find_glyph_size_hash_entry(
+    true_type_font *font, z_ucs char_code) {
+  long index = glyph_size_hash_index(char_code, font->glyph_size_hash_size);
+
+  while ( (font->glyph_size_hash[index].char_code != 0)
+      && (font->glyph_size_hash[index].char_code != char_code) ) {
+    index = (index + 1) & (font->glyph_size_hash_size - 1);
+  }
+
+  return &font->glyph_size_hash[index];
+}
+
+
+static void grow_glyph_size_hash(true_type_font *font) {
+  glyph_size_hash_entry *old_hash = font->glyph_size_hash;
+  long old_size = font->glyph_size_hash_size;
+  long i;
+
+  font->glyph_size_hash_size = old_size == 0 ? 64 : old_size * 2;
+
+  TRACE_LOG("Growing glyph size hash to %ld entries.\n",
+      font->glyph_size_hash_size);
+
+  font->glyph_size_hash = (glyph_size_hash_entry*)fizmo_malloc(
+      sizeof(glyph_size_hash_entry) * font->glyph_size_hash_size);
+  memset(font->glyph_size_hash, 0,
+      sizeof(glyph_size_hash_entry) * font->glyph_size_hash_size);
+
+  for (i=0; i<old_size; i++) {
+    if (old_hash[i].char_code != 0) {
+      *find_glyph_size_hash_entry(font, old_hash[i].char_code) = old_hash[i];
+    }
+  }
+
+  if (old_hash != NULL) {
+    free(old_hash);
+  }
+}
+
+
+static void store_glyph_size(true_type_font *font, z_ucs char_code,
+    int advance, int bitmap_width) {
+  glyph_size *size;
+  glyph_size_hash_entry *entry;
+
+  if (char_code < GLYPH_SIZE_DIRECT_CACHE_SIZE) {
+    size = &font->glyph_size_cache[char_code];
+  }
+  else {
+    // Keep the load factor below 3/4.
+    if ((font->glyph_size_hash_count + 1) * 4
+        > font->glyph_size_hash_size * 3) {
+      grow_glyph_size_hash(font);
+    }
+    entry = find_glyph_size_hash_entry(font, char_code);
+    if (entry->char_code == 0) {
+      entry->char_code = char_code;
+      font->glyph_size_hash_count++;
+    }
+    size = &entry->size;
+  }
+
+  size->advance = advance;
+  size->bitmap_width = bitmap_width;
+}
+
+
+// Returns true in case no size has been stored for char_code yet.
+static bool is_glyph_size_missing(true_type_font *font, z_ucs char_code) {
+  if (char_code < GLYPH_SIZE_DIRECT_CACHE_SIZE) {
+    return font->glyph_size_cache[char_code].advance == GLYPH_SIZE_INVALID;
+  }
+  else if (font->glyph_size_hash == NULL) {
+    return true;
+  }
+  else {
+    return find_glyph_size_hash_entry(font, char_code)->char_code == 0;
+  }
+}
+
+
+// Marks chars in a preload range whose size is already known.
+#define GLYPH_INDEX_SKIPPED ((FT_UInt)-1)
+
+// In case the glyph indices of a preload range are spread over more than
+// this many times the number of glyphs required, the advances are fetched
+// one by one instead of in a single FT_Get_Advances call.
+#define GLYPH_ADVANCES_MAX_SPREAD 4
+
+// Fetches the advances of all glyphs from first_char to last_char in
+// advance so that the word wrapper doesn't have to look them up while
+// formatting common text. Advances are taken from the font's metrics
+// without loading the glyphs themselves; bitmap widths are left unmeasured
+// and are filled in by tt_get_glyph_size once a glyph is actually loaded.
+void tt_preload_glyph_sizes(true_type_font *font, z_ucs first_char,
+    z_ucs last_char) {
+  FT_Face face;
+  FT_UInt *glyph_indices;
+  FT_UInt min_index = 0, max_index = 0;
+  FT_Fixed *advances = NULL;
+  FT_Fixed advance;
+  long nof_chars, nof_glyphs = 0, nof_advances = 0, i;
+
+  TRACE_LOG("Preloading glyph sizes from %d to %d for font %p.\n",
+      first_char, last_char, font);
+
+  if ( (last_char < first_char) || ((face = get_face(font)) == NULL) ) {
+    return;
+  }
+
+  // Counting the chars instead of iterating over char codes avoids wrapping
+  // around when last_char is the largest z_ucs.
+  nof_chars = (long)(last_char - first_char) + 1;
+  glyph_indices = (FT_UInt*)fizmo_malloc(sizeof(FT_UInt) * nof_chars);
+
+  for (i=0; i<nof_chars; i++) {
+    if ( (first_char + i == 0)
+        || (is_glyph_size_missing(font, first_char + i) == false) ) {
+      glyph_indices[i] = GLYPH_INDEX_SKIPPED;
+    }
+    else {
+      glyph_indices[i] = get_char_index(font, first_char + i);
+      if ( (nof_glyphs == 0) || (glyph_indices[i] < min_index) ) {
+        min_index = glyph_indices[i];
+      }
+      if ( (nof_glyphs == 0) || (glyph_indices[i] > max_index) ) {
+        max_index = glyph_indices[i];
+      }
+      nof_glyphs++;
+    }
+  }
+
+  // Fonts usually assign consecutive glyph indices to consecutive char
+  // codes, so all advances can mostly be fetched in a single call.
+  if (nof_glyphs > 0) {
+    nof_advances = (long)(max_index - min_index) + 1;
+    if (nof_advances <= nof_glyphs * GLYPH_ADVANCES_MAX_SPREAD) {
+      advances = (FT_Fixed*)fizmo_malloc(sizeof(FT_Fixed) * nof_advances);
+      if (FT_Get_Advances(face, min_index, nof_advances, FT_LOAD_DEFAULT,
+            advances) != 0) {
+        free(advances);
+        advances = NULL;
+      }
+    }
+  }
+
+  for (i=0; i<nof_chars; i++) {
+    if (glyph_indices[i] != GLYPH_INDEX_SKIPPED) {
+      if (advances != NULL) {
+        advance = advances[glyph_indices[i] - min_index];
+      }
+      else if (FT_Get_Advance(face, glyph_indices[i], FT_LOAD_DEFAULT,
+            &advance) != 0) {
+        continue;
+      }
+
+      // Advances are returned in 16.16 fixed point.
+      store_glyph_size(font, first_char + i, advance >> 16,
+          GLYPH_SIZE_INVALID);
+    }
+  }
+
+  if (advances != NULL) {
+    free(advances);
+  }
+  free(glyph_indices);
+}
+
+
 //int tt_get_glyph_advance(true_type_font *font, z_ucs current_char,
 //    z_ucs UNUSED(last_char)) {
+// bitmap_width may be NULL in case only the advance is required.
 int tt_get_glyph_size(true_type_font *font, z_ucs char_code,
     int *advance, int *bitmap_width) {
+  glyph_size *size = NULL;
+  glyph_size_hash_entry *entry;
+  int loaded_bitmap_width;
   int result;
-  long new_glyph_cache_size;
 
   TRACE_LOG("tt_get_glyph_size invoked.\n");
 
-  TRACE_LOG("Looking at %p\n", font->glyph_size_cache);
-  if ((font->glyph_size_cache == NULL)
-      || (font->glyph_size_cache_size < char_code)) {
+  if (char_code < GLYPH_SIZE_DIRECT_CACHE_SIZE) {
+    size = &font->glyph_size_cache[char_code];
+  }
+  else if (font->glyph_size_hash != NULL) {
+    entry = find_glyph_size_hash_entry(font, char_code);
+    if (entry->char_code != 0) {
+      size = &entry->size;
+    }
+  }
 
-    new_glyph_cache_size = char_code + 1024;
+  // A preloaded advance is sufficient in case the caller doesn't need the
+  // bitmap width, otherwise the glyph has to be loaded once.
+  if ( (size != NULL)
+      && (size->advance != GLYPH_SIZE_INVALID)
+      && ( (bitmap_width == NULL)
+        || (size->bitmap_width != GLYPH_SIZE_INVALID) ) ) {
+    TRACE_LOG("found glyph size cache hit for font %p, %c/%d.\n",
+        font, char_code, char_code);
+    *advance = size->advance;
+    if (bitmap_width != NULL) {
+      *bitmap_width = size->bitmap_width;
+    }
+    return 0;
+  }
 
-    TRACE_LOG("(Re-)allocating %d bytes for glyph cache.\n",
-        sizeof(glyph_size) * new_glyph_cache_size);
+  TRACE_LOG("no glyph size cache hit for %c/%d.\n", char_code, char_code);
+  TRACE_LOG("font: %p.\n", font);
+  result = get_glyph_size(font, char_code, advance, &loaded_bitmap_width);
 
-    font->glyph_size_cache = fizmo_realloc(
-        font->glyph_size_cache,
-        sizeof(glyph_size) * new_glyph_cache_size);
+  if (result == 0) {
+    store_glyph_size(font, char_code, *advance, loaded_bitmap_width);
+    if (bitmap_width != NULL) {
+      *bitmap_width = loaded_bitmap_width;
+    }
+  }
 
-    TRACE_LOG("Cache at %p.\n", font->glyph_size_cache);
+  return result;
+}
 
-    // fill uninitialzed memory.
-    TRACE_LOG("clearning mem from %p, %d bytes.\n",
-        font->glyph_size_cache + font->glyph_size_cache_size,
-        (new_glyph_cache_size - font->glyph_size_cache_size)
-        * sizeof(glyph_size));
 
-    TRACE_LOG("memset: %p, %d.\n",
-        font->glyph_size_cache + font->glyph_size_cache_size,
-        (new_glyph_cache_size - font->glyph_size_cache_size)
-        * sizeof(glyph_size));
 
-    memset(
-        font->glyph_size_cache + font->glyph_size_cache_size,
-        0,
-        (new_glyph_cache_size - font->glyph_size_cache_size)
-        * sizeof(glyph_size));
+// Returns the glyph bitmap for char_code from FreeType's small bitmap
+// cache. Returns NULL in case the glyph is too large to be stored in the
+// cache, in which case it has to be rendered directly.
+static rendered_glyph *get_cached_sbit_glyph(true_type_font *font,
+    z_ucs char_code) {
+  FTC_SBit sbit;
+  FT_UInt glyph_index;
 
-    font->glyph_size_cache_size = new_glyph_cache_size;
+  glyph_index = get_char_index(font, char_code);
+
+  if (FTC_SBitCache_LookupScaler(
+        font->ftc_sbit_cache,
+        &font->ftc_scaler,
+        FT_LOAD_DEFAULT | FT_LOAD_RENDER
+        | (font->render_mode == FT_RENDER_MODE_LCD
+          ? FT_LOAD_TARGET_LCD : FT_LOAD_TARGET_NORMAL),
+        glyph_index,
+        &sbit,
+        NULL) != 0) {
+    return NULL;
   }
 
-  TRACE_LOG("Access glyph cache at %p.\n",
-      &font->glyph_size_cache[char_code].is_valid);
+  // Glyphs which don't fit into a small bitmap are marked by a missing
+  // buffer and a width of 255.
+  if ( (sbit->buffer == NULL) && (sbit->width == 255) ) {
+    return NULL;
+  }
 
-  if (font->glyph_size_cache[char_code].is_valid == 1) {
-    TRACE_LOG("found glyph size cache hit for font %p, %c/%d.\n",
-        font, char_code, char_code);
+  font->ftc_glyph.char_code = char_code;
+  font->ftc_glyph.bitmap_left = sbit->left;
+  font->ftc_glyph.bitmap_top = sbit->top;
+  font->ftc_glyph.advance = sbit->xadvance;
+  font->ftc_glyph.pixel_mode = sbit->format;
+  font->ftc_glyph.rows = sbit->buffer != NULL ? sbit->height : 0;
+  font->ftc_glyph.width = sbit->buffer != NULL ? sbit->width : 0;
+  font->ftc_glyph.pitch = sbit->pitch;
+  font->ftc_glyph.buffer = sbit->buffer;
+  font->ftc_glyph.buffer_size = 0;
+
+  return &font->ftc_glyph;
+}
 
-    TRACE_LOG("Reading from glyph cache at %p.\n",
-        &font->glyph_size_cache[char_code].advance);
-    *advance = font->glyph_size_cache[char_code].advance;
-    *bitmap_width = font->glyph_size_cache[char_code].bitmap_width;
-    /*
-    printf("Fontcache for font %p, '%c' at %p: adv %d, bmitmapw: %d.\n",
-        font, char_code, advance, *advance, *bitmap_width);
-    */
 
-    return 0;
-  }
-  else {
-    /*
-    printf("no glyph size cache hit for font %p, %c/%d.\n",
-        font, char_code, char_code);
-    */
-    TRACE_LOG("no glyph size cache hit for %c/%d.\n", char_code, char_code);
-    TRACE_LOG("font: %p.\n", font);
-    result = get_glyph_size(font, char_code, advance, bitmap_width);
-
-    if (result == 0) {
-      TRACE_LOG("Writin to glyph cache at %p.\n",
-          &font->glyph_size_cache[char_code].advance);
-      font->glyph_size_cache[char_code].is_valid = 1;
-      font->glyph_size_cache[char_code].advance = *advance;
-      font->glyph_size_cache[char_code].bitmap_width = *bitmap_width;
+// Returns the rendered bitmap and metrics for char_code. FreeType is only
+// invoked in case the glyph is not yet found in the font's rendered glyph
+// cache, or in FreeType's small bitmap cache in case the font is managed
+// by the cache subsystem. The returned entry is owned by the cache and only
+// valid until the next invocation for the same font.
+static rendered_glyph *get_rendered_glyph(true_type_font *font,
+    z_ucs char_code) {
+  rendered_glyph *entry, *glyph;
+  FT_Face face;
+  FT_GlyphSlot slot;
+  FT_UInt glyph_index;
+  size_t bytes_required;
+  unsigned int row;
+
+  if (font->ftc_manager != NULL) {
+    if ((glyph = get_cached_sbit_glyph(font, char_code)) != NULL) {
+      return glyph;
     }
+  }
 
-    return result;
+  if (font->rendered_glyph_cache == NULL) {
+    font->rendered_glyph_cache = (rendered_glyph*)fizmo_malloc(
+        sizeof(rendered_glyph) * RENDERED_GLYPH_CACHE_SIZE);
+    memset(font->rendered_glyph_cache, 0,
+        sizeof(rendered_glyph) * RENDERED_GLYPH_CACHE_SIZE);
   }
+
+  entry = &font->rendered_glyph_cache[char_code % RENDERED_GLYPH_CACHE_SIZE];
+
+  if ( (entry->char_code == char_code) && (char_code != 0) ) {
+    TRACE_LOG("Rendered glyph cache hit for %c/%d.\n", char_code, char_code);
+    return entry;
+  }
+
+  TRACE_LOG("Rendering glyph %c/%d.\n", char_code, char_code);
+
+  glyph_index = get_char_index(font, char_code);
+
+  if ( ((face = get_face(font)) == NULL)
+      || (FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT) != 0)
+      || (FT_Render_Glyph(face->glyph, font->render_mode) != 0) ) {
+    // In case the glyph can't be rendered we'll store an empty bitmap, so
+    // we won't have to retry for every occurrence of this char.
+    entry->char_code = char_code;
+    entry->bitmap_left = 0;
+    entry->bitmap_top = 0;
+    entry->advance = 0;
+    entry->pixel_mode = FT_PIXEL_MODE_GRAY;
+    entry->rows = 0;
+    entry->width = 0;
+    entry->pitch = 0;
+    return entry;
+  }
+
+  slot = face->glyph;
+
+  // Bitmaps are stored without row padding, so the stored pitch is always
+  // the width of a row in bytes.
+  bytes_required = (size_t)slot->bitmap.rows * slot->bitmap.width;
+  if (bytes_required > entry->buffer_size) {
+    entry->buffer = (unsigned char*)fizmo_realloc(
+        entry->buffer, bytes_required);
+    entry->buffer_size = bytes_required;
+  }
+
+  for (row=0; row<slot->bitmap.rows; row++) {
+    memcpy(
+        entry->buffer + row * slot->bitmap.width,
+        slot->bitmap.buffer + (long)row * slot->bitmap.pitch,
+        slot->bitmap.width);
+  }
+
+  entry->char_code = char_code;
+  entry->bitmap_left = slot->bitmap_left;
+  entry->bitmap_top = slot->bitmap_top;
+  entry->advance = slot->advance.x / 64;
+  entry->pixel_mode = slot->bitmap.pixel_mode;
+  entry->rows = slot->bitmap.rows;
+  entry->width = slot->bitmap.width;
+  entry->pitch = slot->bitmap.width;
+
+  return entry;
 }
 
 
+// Draws the rows of a glyph bitmap. Every row is first blended into r/g/b
+// values using the blending kernels from glyph_blending.c. In case the
+// screen interface provides draw_rgb_span, consecutive drawn pixels are
+// then sent as a single span, otherwise every pixel is sent via
+// draw_rgb_pixel. As in tt_draw_glyph, pixels without coverage are never
+// drawn.
+static void draw_glyph_rows(rendered_glyph *glyph, int bitmap_start_y,
+    int start_x, int screen_y, int max_y, const uint8_t *foreground,
+    const uint8_t *background,
+    struct z_screen_pixel_interface *screen_pixel_interface) {
+  bool is_lcd = glyph->pixel_mode == FT_PIXEL_MODE_LCD ? true : false;
+  int nof_pixels = is_lcd == true ? glyph->width / 3 : glyph->width;
+  uint8_t blended_row[(nof_pixels + 1) * 3];
+  int bitmap_y, pixel_x, run_start;
+  unsigned char *row_buffer;
+  bool pixel_is_drawn;
+
+  for (
+      bitmap_y = bitmap_start_y;
+      screen_y < max_y;
+      bitmap_y++, screen_y++) {
+    row_buffer = glyph->buffer + bitmap_y * glyph->pitch;
+
+    if (is_lcd == true) {
+      blend_lcd_row(row_buffer, nof_pixels, blended_row,
+          foreground, background);
+    }
+    else {
+      blend_gray_row(row_buffer, nof_pixels, blended_row,
+          foreground, background);
+    }
+
+    run_start = -1;
+    for (pixel_x=0; pixel_x<nof_pixels; pixel_x++) {
+      pixel_is_drawn
+        = is_lcd == true
+        ? (row_buffer[pixel_x * 3] && row_buffer[pixel_x * 3 + 1]
+            && row_buffer[pixel_x * 3 + 2])
+        : (row_buffer[pixel_x] != 0);
+
+      if (pixel_is_drawn == true) {
+        if (screen_pixel_interface->draw_rgb_span != NULL) {
+          if (run_start < 0) {
+            run_start = pixel_x;
+          }
+        }
+        else {
+          screen_pixel_interface->draw_rgb_pixel(
+              screen_y,
+              start_x + pixel_x,
+              blended_row[pixel_x * 3],
+              blended_row[pixel_x * 3 + 1],
+              blended_row[pixel_x * 3 + 2]);
+        }
+      }
+      else if (run_start >= 0) {
+        screen_pixel_interface->draw_rgb_span(
+            screen_y,
+            start_x + run_start,
+            pixel_x - run_start,
+            blended_row + run_start * 3);
+        run_start = -1;
+      }
+    }
+
+    if (run_start >= 0) {
+      screen_pixel_interface->draw_rgb_span(
+          screen_y,
+          start_x + run_start,
+          nof_pixels - run_start,
+          blended_row + run_start * 3);
+    }
+  }
+}
+
 
 // note: glyph pixels are only drawn in case they are not completely
 // equal to background color. this is required, since especially in case
@@ -186,44 +589,22 @@ int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
     z_rgb_colour background_colour,
     struct z_screen_pixel_interface *screen_pixel_interface,
     z_ucs charcode, int *last_gylphs_xcursorpos) {
-  FT_GlyphSlot slot;
-  FT_Bitmap bitmap;
+  rendered_glyph *glyph;
   //FT_Vector kerning;
   //int ft_error,
   int pixel_bitmap_width, left_reverse_x, reverse_width;
-  int screen_x, screen_y, advance, start_x, bitmap_x, bitmap_y;
-  uint8_t pixel;
-  uint8_t pixel2, pixel3;
-  float pixel_value;
-  float pixel_value2, pixel_value3;
-  int dr, dg, db; // delta from foreground to background
-  uint8_t br, bg, bb; // pre-evaluated background colors
+  int screen_y, advance, start_x;
+  uint8_t foreground[3], background[3]; // pre-evaluated r/g/b colours
   int draw_width, bitmap_start_y, top_space, max_y;
   int number_of_rows_available;
 
 
-  FT_UInt glyph_index = FT_Get_Char_Index(font->face, charcode);
-
-  // TODO: Evaluate ft_error
-  // ft_error = FT_Load_Glyph(
-  FT_Load_Glyph(
-      font->face,
-      glyph_index,
-      FT_LOAD_DEFAULT);
-
-  // TODO: Evaluate ft_error
-  // ft_error = FT_Render_Glyph(
-  FT_Render_Glyph(
-      font->face->glyph,
-      font->render_mode);
-
-  slot = font->face->glyph;
-  bitmap = slot->bitmap;
-  advance = slot->advance.x / 64;
+  glyph = get_rendered_glyph(font, charcode);
+  advance = glyph->advance;
 
   pixel_bitmap_width
-    = bitmap.pixel_mode == FT_PIXEL_MODE_LCD
-    ? bitmap.width / 3 : bitmap.width;
+    = glyph->pixel_mode == FT_PIXEL_MODE_LCD
+    ? glyph->width / 3 : glyph->width;
 
   draw_width = advance > pixel_bitmap_width ? advance : pixel_bitmap_width;
 
@@ -239,15 +620,15 @@ int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
     left_reverse_x
       = *last_gylphs_xcursorpos + 1;
     reverse_width
-      = x + slot->bitmap_left + draw_width - *last_gylphs_xcursorpos + 1;
+      = x + glyph->bitmap_left + draw_width - *last_gylphs_xcursorpos + 1;
   }
   else {
     left_reverse_x = x;
-    reverse_width = slot->bitmap_left + draw_width + 1;
+    reverse_width = glyph->bitmap_left + draw_width + 1;
   }
 
   if (last_gylphs_xcursorpos) {
-    *last_gylphs_xcursorpos = x + slot->bitmap_left + draw_width;
+    *last_gylphs_xcursorpos = x + glyph->bitmap_left + draw_width;
   }
 
   if (left_reverse_x + reverse_width > x_max) {
@@ -278,21 +659,21 @@ int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
       green_from_z_rgb_colour(background_colour),
       blue_from_z_rgb_colour(background_colour));
 
-  x += slot->bitmap_left;
+  x += glyph->bitmap_left;
 
   /*
   printf("y: %d, %d, %d\n",
-      y, (int)font->face->size->metrics.ascender/64, (int)slot->bitmap_top);
+      y, (int)font->face->size->metrics.ascender/64, (int)glyph->bitmap_top);
   */
-  //y += font->face->size->metrics.ascender/64 - slot->bitmap_top;
+  //y += font->face->size->metrics.ascender/64 - glyph->bitmap_top;
 
   // Bitmaps for glyphs don't all have the same height. For smaller
   // (e.g. lowercase) letters bitmaps may be smaller.
   // To avoid drawing glyphs top-aligned we'll calculate the appropriate
   // top_space we have to skip at the top.
   top_space
-    = font->face->size->metrics.ascender/64
-    - slot->bitmap_top;
+    = font->ascender
+    - glyph->bitmap_top;
 
   max_y = y + font->line_height - clip_top - clip_bottom;
 
@@ -309,17 +690,17 @@ int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
     }
   }
   // compiler error? doesn't work without "number_of_rows_available" below:
-  //if (y + top_space + (bitmap.rows - clip_top) < max_y) {
+  //if (y + top_space + (glyph->rows - clip_top) < max_y) {
 
-  number_of_rows_available = y + top_space + (bitmap.rows - clip_top);
+  number_of_rows_available = y + top_space + (glyph->rows - clip_top);
   if (number_of_rows_available < max_y) {
-    max_y = y + top_space + (bitmap.rows - clip_top);
+    max_y = y + top_space + (glyph->rows - clip_top);
   }
   y += top_space;
   bitmap_start_y = clip_top;
 
-  TRACE_LOG("ascender: %ld\n", font->face->size->metrics.ascender/64);
-  TRACE_LOG("bitmap_top: %d\n", slot->bitmap_top);
+  TRACE_LOG("ascender: %d\n", font->ascender);
+  TRACE_LOG("bitmap_top: %d\n", glyph->bitmap_top);
 
   // FIXME: Free glyph's memory.
   // FT_Done_FreeType
@@ -338,78 +719,52 @@ int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
   }
   */
 
-  br = red_from_z_rgb_colour(background_colour);
-  bg = green_from_z_rgb_colour(background_colour);
-  bb = blue_from_z_rgb_colour(background_colour);
-
-  dr = red_from_z_rgb_colour(foreground_colour) - br;
-  dg = green_from_z_rgb_colour(foreground_colour) - bg;
-  db = blue_from_z_rgb_colour(foreground_colour) - bb;
-
   start_x = x;
   screen_y = y;
   /*
   printf("Glyph display at %03d/%03d, %02d*%02d for char '%c'.\n", x, y,
-      bitmap.width, bitmap.rows, charcode);
+      glyph->width, glyph->rows, charcode);
   */
   TRACE_LOG("Glyph display at %d / %d.\n", x, y);
   TRACE_LOG("clip_top: %d, clip_bottom: %d.\n", clip_top, clip_bottom);
 
-    //= bitmap.rows > font->line_height - clip_top
-    //? bitmap.rows - (font->line_height - clip_top)
+    //= glyph->rows > font->line_height - clip_top
+    //? glyph->rows - (font->line_height - clip_top)
     //: 0;
 
-  TRACE_LOG("bitmap.rows: %d, clip_bottom: %d, bitmap_start_y: %d.\n",
-      bitmap.rows, clip_bottom, bitmap_start_y);
-  TRACE_LOG("diff: %d.\n", bitmap.rows - clip_bottom);
-
-  if (bitmap.pixel_mode == FT_PIXEL_MODE_LCD) {
-    for (
-        bitmap_y = bitmap_start_y;
-        screen_y < max_y;
-        bitmap_y++, screen_y++) {
-      TRACE_LOG("bitmap_y: %d, diff: %d.\n",
-          bitmap_y, bitmap.rows - clip_bottom);
-      screen_x = start_x;
-      for (bitmap_x=0; bitmap_x<bitmap.width; bitmap_x+=3, screen_x++) {
-        pixel = bitmap.buffer[bitmap_y*bitmap.pitch+ bitmap_x];
-        pixel2 = bitmap.buffer[bitmap_y*bitmap.pitch + bitmap_x + 1];
-        pixel3 = bitmap.buffer[bitmap_y*bitmap.pitch+ bitmap_x + 2];
-        if (pixel && pixel2 && pixel3 ) {
-          pixel_value = (float)pixel / (float)255;
-          pixel_value2 = (float)pixel2 / (float)255;
-          pixel_value3 = (float)pixel3 / (float)255;
-          screen_pixel_interface->draw_rgb_pixel(
-              screen_y,
-              screen_x,
-              br + pixel_value * dr,
-              bg + pixel_value2 * dg,
-              bb + pixel_value3 * db);
-        }
-      }
+  TRACE_LOG("glyph->rows: %d, clip_bottom: %d, bitmap_start_y: %d.\n",
+      glyph->rows, clip_bottom, bitmap_start_y);
+  TRACE_LOG("diff: %d.\n", glyph->rows - clip_bottom);
+
+  foreground[0] = red_from_z_rgb_colour(foreground_colour);
+  foreground[1] = green_from_z_rgb_colour(foreground_colour);
+  foreground[2] = blue_from_z_rgb_colour(foreground_colour);
+
+  background[0] = red_from_z_rgb_colour(background_colour);
+  background[1] = green_from_z_rgb_colour(background_colour);
+  background[2] = blue_from_z_rgb_colour(background_colour);
+
+  if ( (glyph->pixel_mode != FT_PIXEL_MODE_LCD)
+      && (screen_pixel_interface->draw_alpha_mask != NULL) ) {
+    if (max_y > screen_y) {
+      screen_pixel_interface->draw_alpha_mask(
+          screen_y,
+          start_x,
+          glyph->width,
+          max_y - screen_y,
+          glyph->buffer + bitmap_start_y * glyph->pitch,
+          glyph->pitch,
+          foreground[0],
+          foreground[1],
+          foreground[2],
+          background[0],
+          background[1],
+          background[2]);
     }
   }
   else {
-    for (
-        bitmap_y = bitmap_start_y;
-        screen_y < max_y;
-        bitmap_y++, screen_y++) {
-      TRACE_LOG("bitmap_y: %d, diff: %d.\n",
-          bitmap_y, bitmap.rows - clip_bottom);
-      screen_x = start_x;
-      for (bitmap_x=0; bitmap_x<bitmap.width; bitmap_x++, screen_x++) {
-        pixel = bitmap.buffer[bitmap_y*bitmap.pitch+ bitmap_x];
-        if (pixel) {
-          pixel_value = (float)pixel / (float)255;
-          screen_pixel_interface->draw_rgb_pixel(
-              screen_y,
-              screen_x,
-              br + pixel_value * dr,
-              bg + pixel_value * dg,
-              bb + pixel_value * db);
-        }
-      }
-    }
+    draw_glyph_rows(glyph, bitmap_start_y, start_x, screen_y, max_y,
+        foreground, background, screen_pixel_interface);
   }
 
   TRACE_LOG("Glyph advance is %d.\n", advance);
@@ -419,10 +774,22 @@ int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
 
 
 void tt_destroy_font(true_type_font *font) {
-  if (font->glyph_size_cache != NULL) {
-    free(font->glyph_size_cache);
+  int i;
+
+  if (font->glyph_size_hash != NULL) {
+    free(font->glyph_size_hash);
+  }
+  if (font->rendered_glyph_cache != NULL) {
+    for (i=0; i<RENDERED_GLYPH_CACHE_SIZE; i++) {
+      if (font->rendered_glyph_cache[i].buffer != NULL) {
+        free(font->rendered_glyph_cache[i].buffer);
+      }
+    }
+    free(font->rendered_glyph_cache);
+  }
+  if (font->ftc_manager == NULL) {
+    FT_Done_Face(font->face);
   }
-  FT_Done_Face(font->face);
   free(font);
 }
 
@@ -37,30 +37,77 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_CACHE_H
 
 #include "true_type_font.h"
 #include "../screen_interface/screen_pixel_interface.h"
 
 
+// Glyph sizes for char codes below GLYPH_SIZE_DIRECT_CACHE_SIZE (which
+// covers ASCII and Latin-1) are stored in an array directly inside the
+// font, all others in a small open-addressing hash table.
+#define GLYPH_SIZE_DIRECT_CACHE_SIZE 256
+#define GLYPH_SIZE_INVALID INT16_MIN
+
 typedef struct glyph_size_struct {
-    int is_valid;
-    int advance;
-    int bitmap_width;
+    int16_t advance; // GLYPH_SIZE_INVALID for entries not yet measured.
+    int16_t bitmap_width; // GLYPH_SIZE_INVALID in case only the advance
+                          // has been preloaded.
 } glyph_size;
 
+typedef struct glyph_size_hash_entry_struct {
+    z_ucs char_code; // 0 marks an empty entry.
+    glyph_size size;
+} glyph_size_hash_entry;
+
+// Number of slots in the per-font rendered glyph cache. Slots are addressed
+// by char_code modulo this value, so a glyph only evicts another glyph
+// which maps to the same slot.
+#define RENDERED_GLYPH_CACHE_SIZE 512
+
+typedef struct rendered_glyph_struct {
+  z_ucs char_code; // 0 marks an empty slot
+  int bitmap_left;
+  int bitmap_top;
+  int advance;
+  unsigned char pixel_mode;
+  unsigned int rows;
+  unsigned int width;
+  int pitch;
+  unsigned char *buffer;
+  size_t buffer_size;
+} rendered_glyph;
+
 struct true_type_font_struct {
-  FT_Face face;
+  FT_Face face; // NULL in case the face is managed by ftc_manager.
+  int ascender;
   //bool has_kerning;
   int font_height_in_pixel;
   int line_height;
   z_ucs last_char; // for kerning
   FT_Render_Mode render_mode;
-  glyph_size *glyph_size_cache;
-  long glyph_size_cache_size;
+  glyph_size glyph_size_cache[GLYPH_SIZE_DIRECT_CACHE_SIZE];
+  glyph_size_hash_entry *glyph_size_hash;
+  long glyph_size_hash_size; // always a power of two
+  long glyph_size_hash_count;
+  rendered_glyph *rendered_glyph_cache;
+
+  // In case the factory uses FreeType's cache subsystem, the face and
+  // size are looked up from ftc_manager using ftc_scaler each time they're
+  // needed, and small bitmaps are taken from ftc_sbit_cache. ftc_glyph
+  // refers to the bitmap of the last glyph taken from the cache.
+  FTC_Manager ftc_manager;
+  FTC_CMapCache ftc_cmap_cache;
+  FTC_SBitCache ftc_sbit_cache;
+  FTC_ScalerRec ftc_scaler;
+  rendered_glyph ftc_glyph;
 };
 
 typedef struct true_type_font_struct true_type_font;
 
+void tt_init_glyph_size_cache(true_type_font *font);
+void tt_preload_glyph_sizes(true_type_font *font, z_ucs first_char,
+    z_ucs last_char);
 int tt_get_glyph_size(true_type_font *font, z_ucs char_code,
     int *advance, int *bitmap_width);
 int tt_draw_glyph(true_type_font *font, int x, int y, int x_max,
@@ -40,11 +40,11 @@
 #include "tools/unused.h"
 #include "interpreter/fizmo.h"
 #include "tools/tracelog.h"
-#include "interpreter/hyphenation.h"
+#include "hyphenation_cache.h"
 
 
-static z_ucs newline_string[] = { Z_UCS_NEWLINE, 0 };
-static z_ucs minus_string[] = { Z_UCS_MINUS, 0 };
+static const z_ucs newline_string[] = { Z_UCS_NEWLINE };
+static const z_ucs minus_string[] = { Z_UCS_MINUS };
 
 static void set_font(true_type_wordwrapper *wrapper, true_type_font *new_font) {
   TRACE_LOG("Wordwrapper setting new font to %p.\n", new_font);
@@ -68,20 +68,31 @@ void freetype_wordwrap_reset_position(true_type_wordwrapper *wrapper) {
 
 true_type_wordwrapper *create_true_type_wordwrapper(true_type_font *font,
     int line_length,
-    void (*wrapped_text_output_destination)(z_ucs *output, void *parameter),
+    void (*wrapped_text_output_destination)(const z_ucs *output, size_t len,
+      void *parameter),
     void *destination_parameter, bool hyphenation_enabled) {
   true_type_wordwrapper *result = fizmo_malloc(sizeof(true_type_wordwrapper));
 
   result->line_length = line_length;
   result->input_buffer = NULL;
   result->input_buffer_size = 0;
+  result->input_buffer_start = 0;
   result->current_buffer_index = 0;
+  result->chars_consumed = 0;
+  result->char_sizes = NULL;
+  result->bitmap_width_sum = 0;
+  result->word_buffer = NULL;
+  result->word_buffer_size = 0;
+  result->hyphenated_word_buffer = NULL;
+  result->hyphenated_word_buffer_size = 0;
   freetype_wordwrap_reset_position(result);
   result->wrapped_text_output_destination = wrapped_text_output_destination;
   result->destination_parameter = destination_parameter;
+  result->line_break_destination = NULL;
   result->enable_hyphenation = hyphenation_enabled;
   result->metadata = NULL;
   result->metadata_size = 0;
+  result->metadata_start = 0;
   result->metadata_index = 0;
   result->font_at_buffer_start = font;
   set_font(result, font);
@@ -100,25 +111,115 @@ void destroy_freetype_wrapper(true_type_wordwrapper *wrapper) {
   if (wrapper->metadata != NULL) {
     free(wrapper->metadata);
   }
+  if (wrapper->hyphenated_word_buffer != NULL) {
+    free(wrapper->hyphenated_word_buffer);
+  }
+  if (wrapper->word_buffer != NULL) {
+    free(wrapper->word_buffer);
+  }
+  if (wrapper->char_sizes != NULL) {
+    free(wrapper->char_sizes);
+  }
   free(wrapper);
 }
 
 
+// The input buffer and the metadata queue are both ring buffers whose
+// capacity is always a power of two. Chars and metadata entries are
+// addressed by their logical index, which is relative to the start of the
+// ring, so consuming text from the front doesn't have to move anything.
+static inline z_ucs *buffer_char(true_type_wordwrapper *wrapper, long index) {
+  return &wrapper->input_buffer[
+    (wrapper->input_buffer_start + index) & (wrapper->input_buffer_size - 1)];
+}
+
+
+static inline struct freetype_wordwrap_char_size *char_size(
+    true_type_wordwrapper *wrapper, long index) {
+  return &wrapper->char_sizes[
+    (wrapper->input_buffer_start + index) & (wrapper->input_buffer_size - 1)];
+}
+
+
+// Returns the sum of the bitmap widths of the chars from start_index up to
+// and including end_index.
+static long get_bitmap_width_sum(true_type_wordwrapper *wrapper,
+    long start_index, long end_index) {
+  struct freetype_wordwrap_char_size *start_size;
+
+  if (end_index < start_index) {
+    return 0;
+  }
+
+  start_size = char_size(wrapper, start_index);
+  return char_size(wrapper, end_index)->bitmap_width_sum
+    - start_size->bitmap_width_sum + start_size->size.bitmap_width;
+}
+
+
+static inline struct freetype_wordwrap_metadata *metadata_entry(
+    true_type_wordwrapper *wrapper, int index) {
+  return &wrapper->metadata[
+    (wrapper->metadata_start + index) & (wrapper->metadata_size - 1)];
+}
+
+
+// Metadata entries store the absolute position of the char they precede,
+// which is converted into a logical buffer index here.
+static inline long metadata_buffer_index(true_type_wordwrapper *wrapper,
+    int index) {
+  return metadata_entry(wrapper, index)->output_index
+    - wrapper->chars_consumed;
+}
+
+
 inline static int ensure_additional_buffer_capacity(
     true_type_wordwrapper *wrapper, int size) {
   z_ucs *ptr;
-  long new_size;
+  struct freetype_wordwrap_char_size *sizes_ptr;
+  long new_size, first_part;
 
   TRACE_LOG("new min size: %d, cursize: %d, buffer at %p\n",
       wrapper->current_buffer_index + size,
       wrapper->input_buffer_size,
       wrapper->input_buffer);
   if (wrapper->current_buffer_index + size > wrapper->input_buffer_size) {
-    new_size = (size - (size % 1024) + 1024) * sizeof(z_ucs);
-    if ((ptr = realloc(wrapper->input_buffer, new_size)) == NULL)
-      return -1;
+    new_size = wrapper->input_buffer_size > 0
+      ? wrapper->input_buffer_size : 1024;
+    while (new_size < wrapper->current_buffer_index + size) {
+      new_size *= 2;
+    }
+
+    ptr = fizmo_malloc(new_size * sizeof(z_ucs));
+    sizes_ptr = fizmo_malloc(
+        new_size * sizeof(struct freetype_wordwrap_char_size));
+
+    if (wrapper->current_buffer_index > 0) {
+      first_part = wrapper->input_buffer_size - wrapper->input_buffer_start;
+      if (first_part > wrapper->current_buffer_index) {
+        first_part = wrapper->current_buffer_index;
+      }
+      memcpy(ptr, wrapper->input_buffer + wrapper->input_buffer_start,
+          first_part * sizeof(z_ucs));
+      memcpy(ptr + first_part, wrapper->input_buffer,
+          (wrapper->current_buffer_index - first_part) * sizeof(z_ucs));
+      memcpy(sizes_ptr, wrapper->char_sizes + wrapper->input_buffer_start,
+          first_part * sizeof(struct freetype_wordwrap_char_size));
+      memcpy(sizes_ptr + first_part, wrapper->char_sizes,
+          (wrapper->current_buffer_index - first_part)
+          * sizeof(struct freetype_wordwrap_char_size));
+    }
+
+    if (wrapper->input_buffer != NULL) {
+      free(wrapper->input_buffer);
+    }
+    if (wrapper->char_sizes != NULL) {
+      free(wrapper->char_sizes);
+    }
     wrapper->input_buffer = ptr;
+    wrapper->char_sizes = sizes_ptr;
     wrapper->input_buffer_size = new_size;
+    wrapper->input_buffer_start = 0;
     TRACE_LOG("new size: %ld\n, new ptr: %p\n", wrapper->input_buffer_size,
         wrapper->input_buffer);
   }
@@ -127,6 +228,64 @@ inline static int ensure_additional_buffer_capacity(
 }
 
 
+// Removes the first nof_chars chars from the buffer.
+static void consume_buffer_chars(true_type_wordwrapper *wrapper,
+    long nof_chars) {
+  if (nof_chars <= 0) {
+    return;
+  }
+
+  wrapper->input_buffer_start
+    = (wrapper->input_buffer_start + nof_chars)
+    & (wrapper->input_buffer_size - 1);
+  wrapper->current_buffer_index -= nof_chars;
+  wrapper->chars_consumed += nof_chars;
+}
+
+
+// Removes the first nof_entries entries from the metadata queue.
+static void consume_metadata_entries(true_type_wordwrapper *wrapper,
+    int nof_entries) {
+  if (nof_entries <= 0) {
+    return;
+  }
+
+  TRACE_LOG("Removing %d metadata entries.\n", nof_entries);
+  wrapper->metadata_start
+    = (wrapper->metadata_start + nof_entries) & (wrapper->metadata_size - 1);
+  wrapper->metadata_index -= nof_entries;
+}
+
+
+// Sends the buffer contents from logical index start_index up to, but not
+// including, end_index to the output destination. A chunk wrapping around
+// the end of the ring is sent in two parts.
+static void output_buffer_range(true_type_wordwrapper *wrapper,
+    long start_index, long end_index) {
+  long physical_start, len, first_len;
+
+  if ((len = end_index - start_index) <= 0) {
+    return;
+  }
+
+  physical_start
+    = (wrapper->input_buffer_start + start_index)
+    & (wrapper->input_buffer_size - 1);
+
+  if (physical_start + len > wrapper->input_buffer_size) {
+    first_len = wrapper->input_buffer_size - physical_start;
+    output_buffer_range(wrapper, start_index, start_index + first_len);
+    output_buffer_range(wrapper, start_index + first_len, end_index);
+    return;
+  }
+
+  wrapper->wrapped_text_output_destination(
+      wrapper->input_buffer + physical_start,
+      (size_t)len,
+      wrapper->destination_parameter);
+}
+
+
 int get_current_pixel_position(true_type_wordwrapper *wrapper) {
   return wrapper->current_advance_position;
 }
@@ -136,8 +295,7 @@ int get_current_pixel_position(true_type_wordwrapper *wrapper) {
 // main work it has to do is to correctly adjust the metadata.
 void forget_first_char_in_buffer(true_type_wordwrapper *wrapper) {
   int metadata_index = 0;
-  struct freetype_wordwrap_metadata *metadata_entry;
-  int i;
+  struct freetype_wordwrap_metadata *metadata;
 
   if (wrapper->current_buffer_index < 1) {
     return;
@@ -145,54 +303,39 @@ void forget_first_char_in_buffer(true_type_wordwrapper *wrapper) {
 
   while (metadata_index < wrapper->metadata_index) {
     //printf("mdindex: %d\n", metadata_index);
-    if (wrapper->metadata[metadata_index].output_index > 0) {
+    if (metadata_buffer_index(wrapper, metadata_index) > 0) {
       break;
     }
 
     // There's actually metadata for the very first char in the buffer.
 
-    metadata_entry = &wrapper->metadata[metadata_index];
+    metadata = metadata_entry(wrapper, metadata_index);
 
-    metadata_entry->metadata_output_function(
-        metadata_entry->ptr_parameter,
-        metadata_entry->int_parameter);
+    metadata->metadata_output_function(
+        metadata->ptr_parameter,
+        metadata->int_parameter);
 
     metadata_index++;
   }
 
-  if (metadata_index > 0) {
-    //printf("Removing %d metadata entries.\n", metadata_index);
-    memmove(
-        wrapper->metadata,
-        &wrapper->metadata[metadata_index],
-        (wrapper->metadata_index - metadata_index) * sizeof(
-          struct freetype_wordwrap_metadata));
-    wrapper->metadata_index -= metadata_index;
-  }
+  consume_metadata_entries(wrapper, metadata_index);
 
-  for (i=0; i<wrapper->metadata_index; i++) {
-    wrapper->metadata[i].output_index -= 1;
+  if (wrapper->line_break_destination != NULL) {
+    wrapper->line_break_destination(
+        wrapper->chars_consumed,
+        FREETYPE_WORDWRAP_BREAK_SKIP,
+        wrapper->destination_parameter);
   }
 
-  //printf("Moving %ld chars.\n", (wrapper->current_buffer_index - 1));
-  memmove(
-      wrapper->input_buffer,
-      wrapper->input_buffer + 1,
-      (wrapper->current_buffer_index - 1) * sizeof(z_ucs));
-
-  wrapper->current_buffer_index--;
+  consume_buffer_chars(wrapper, 1);
 }
 
 
 void flush_line(true_type_wordwrapper *wrapper, long flush_index,
     bool append_minus, bool append_newline) {
-  z_ucs buf_1; //, buf_2;
-  size_t chars_sent;
-  int chars_to_move;
   int metadata_index = 0;
   long output_metadata_index, output_index;
-  struct freetype_wordwrap_metadata *metadata_entry;
-  int i;
+  struct freetype_wordwrap_metadata *metadata;
 
   if (flush_index == -1) {
     flush_index = wrapper->current_buffer_index - 1;
@@ -200,11 +343,9 @@ void flush_line(true_type_wordwrapper *wrapper, long flush_index,
   else
   {
     TRACE_LOG("flush on: %c %d \n",
-      (char)wrapper->input_buffer[flush_index],
-      wrapper->input_buffer[flush_index]);
+      (char)*buffer_char(wrapper, flush_index),
+      *buffer_char(wrapper, flush_index));
   }
-  // Ensure there's enough space to place a terminating 0.
-  ensure_additional_buffer_capacity(wrapper, 1);
 
   output_index = 0;
   while (metadata_index < wrapper->metadata_index) {
@@ -212,8 +353,7 @@ void flush_line(true_type_wordwrapper *wrapper, long flush_index,
         metadata_index, wrapper->metadata_index);
 
     // Look which buffer position is affected by the next metadata entry.
-    output_metadata_index =
-      wrapper->metadata[metadata_index].output_index;
+    output_metadata_index = metadata_buffer_index(wrapper, metadata_index);
 
     TRACE_LOG("mdoutput: mdindex: %d, flushindex: %d, output_index:%d\n",
         output_metadata_index, flush_index, output_index);
@@ -230,143 +370,109 @@ void flush_line(true_type_wordwrapper *wrapper, long flush_index,
       TRACE_LOG("Flusing up to next metadata entry at %ld\n",
           output_metadata_index);
 
-      buf_1 = wrapper->input_buffer[output_metadata_index];
-      wrapper->input_buffer[output_metadata_index] = 0;
-      wrapper->wrapped_text_output_destination(
-          wrapper->input_buffer + output_index,
-          wrapper->destination_parameter);
-      wrapper->input_buffer[output_metadata_index] = buf_1;
+      output_buffer_range(wrapper, output_index, output_metadata_index);
       output_index = output_metadata_index;
     }
 
     TRACE_LOG("metadata_index: %d,output_index: %d,output_metadata_index:%d\n",
         metadata_index, output_index, output_metadata_index);
-    TRACE_LOG("wrapper->metadata[%d].output_index: %d\n",
-        metadata_index,
-        wrapper->metadata[metadata_index].output_index);
     TRACE_LOG("wrapper->metadata_index: %d\n",
         wrapper->metadata_index);
-    // We can now flush all the metadata entries at the current position.
-    TRACE_LOG("%d / %d\n",
-        wrapper->metadata[metadata_index].output_index + 1,
-        output_metadata_index + 1);
 
+    // We can now flush all the metadata entries at the current position.
     while ( (metadata_index < wrapper->metadata_index)
-        && (wrapper->metadata[metadata_index].output_index
+        && (metadata_buffer_index(wrapper, metadata_index)
           == output_metadata_index) ) {
 
-      metadata_entry = &wrapper->metadata[metadata_index];
+      metadata = metadata_entry(wrapper, metadata_index);
 
       TRACE_LOG("Output metadata prm %d at buffer position %ld.\n",
-          metadata_entry->int_parameter,
+          metadata->int_parameter,
           output_metadata_index);
 
-      metadata_entry->metadata_output_function(
-          metadata_entry->ptr_parameter,
-          metadata_entry->int_parameter);
+      metadata->metadata_output_function(
+          metadata->ptr_parameter,
+          metadata->int_parameter);
 
-      if (metadata_entry->font != NULL) {
-        wrapper->font_at_buffer_start = metadata_entry->font;
+      if (metadata->font != NULL) {
+        wrapper->font_at_buffer_start = metadata->font;
       }
 
       metadata_index++;
     }
   }
 
-  if (metadata_index > 0) {
-    TRACE_LOG("Removing %d metadata entries.\n", metadata_index);
-    memmove(
-        wrapper->metadata,
-        &wrapper->metadata[metadata_index],
-        (wrapper->metadata_index - metadata_index) * sizeof(
-          struct freetype_wordwrap_metadata));
-    wrapper->metadata_index -= metadata_index;
-  }
+  consume_metadata_entries(wrapper, metadata_index);
 
-  /*
-  if (append_newline == true) {
-    buf_1 = wrapper->input_buffer[flush_index + 1];
-    buf_2 = wrapper->input_buffer[flush_index + 2];
-    wrapper->input_buffer[flush_index + 1] = Z_UCS_NEWLINE;
-    wrapper->input_buffer[flush_index + 2] = 0;
-    TRACE_LOG("flush-index: %d\n", flush_index);
-    TRACE_LOG("flush-line (%d / %p): \"", z_ucs_len(wrapper->input_buffer),
-        wrapper->input_buffer);
-    TRACE_LOG_Z_UCS(wrapper->input_buffer);
-    TRACE_LOG("\"\n");
-    wrapper->wrapped_text_output_destination(
-        wrapper->input_buffer + output_index,
-        wrapper->destination_parameter);
-    wrapper->input_buffer[flush_index + 1] = buf_1;
-    wrapper->input_buffer[flush_index + 2] = buf_2;
-  }
-  else {
-    buf_1 = wrapper->input_buffer[flush_index + 1];
-    wrapper->input_buffer[flush_index + 1] = 0;
-    TRACE_LOG("flush-index: %d\n", flush_index);
-    TRACE_LOG("flush-line (%d / %p): \"", z_ucs_len(wrapper->input_buffer),
-        wrapper->input_buffer);
-    TRACE_LOG_Z_UCS(wrapper->input_buffer);
-    TRACE_LOG("\"\n");
-    wrapper->wrapped_text_output_destination(
-        wrapper->input_buffer + output_index,
-        wrapper->destination_parameter);
-    wrapper->input_buffer[flush_index + 1] = buf_1;
-  }
-  */
-
-  buf_1 = wrapper->input_buffer[flush_index + 1];
-  wrapper->input_buffer[flush_index + 1] = 0;
   TRACE_LOG("flush-index: %d\n", flush_index);
-  TRACE_LOG("flush-line (%d / %p): \"", z_ucs_len(wrapper->input_buffer),
-      wrapper->input_buffer);
-  TRACE_LOG_Z_UCS(wrapper->input_buffer);
-  TRACE_LOG("\"\n");
-  wrapper->wrapped_text_output_destination(
-      wrapper->input_buffer + output_index,
-      wrapper->destination_parameter);
-  wrapper->input_buffer[flush_index + 1] = buf_1;
+  output_buffer_range(wrapper, output_index, flush_index + 1);
 
   if (append_minus == true) {
     wrapper->wrapped_text_output_destination(
         minus_string,
+        1,
         wrapper->destination_parameter);
+    if (wrapper->line_break_destination != NULL) {
+      wrapper->line_break_destination(
+          wrapper->chars_consumed + flush_index + 1,
+          FREETYPE_WORDWRAP_BREAK_MINUS,
+          wrapper->destination_parameter);
+    }
   }
 
   if (append_newline == true) {
     wrapper->wrapped_text_output_destination(
         newline_string,
+        1,
         wrapper->destination_parameter);
+    if (wrapper->line_break_destination != NULL) {
+      wrapper->line_break_destination(
+          wrapper->chars_consumed + flush_index + 1,
+          FREETYPE_WORDWRAP_BREAK_NEWLINE,
+          wrapper->destination_parameter);
+    }
+  }
+
+  TRACE_LOG("chars_sent: %ld, bufindex: %ld\n",
+      flush_index + 1, wrapper->current_buffer_index);
+  consume_buffer_chars(wrapper, flush_index + 1);
+}
+
+
+// Copies the chars from start_index up to, but not including, end_index
+// into the zero-terminated word buffer, which is required since a word
+// may wrap around the end of the ring.
+static z_ucs *copy_word(true_type_wordwrapper *wrapper, long start_index,
+    long end_index) {
+  long i;
+
+  if (end_index - start_index + 1 > wrapper->word_buffer_size) {
+    wrapper->word_buffer_size = end_index - start_index + 1;
+    wrapper->word_buffer = fizmo_realloc(
+        wrapper->word_buffer, wrapper->word_buffer_size * sizeof(z_ucs));
   }
 
-  chars_sent = flush_index + 1;
-  TRACE_LOG("chars_sent: %ld, dst: %p, src: %p, bufindex: %ld\n",
-      chars_sent,
-      wrapper->input_buffer,
-      wrapper->input_buffer + flush_index,
-      wrapper->current_buffer_index);
-  if ((chars_to_move = wrapper->current_buffer_index - chars_sent) > 0) {
-    memmove(
-        wrapper->input_buffer,
-        wrapper->input_buffer + flush_index + 1,
-        chars_to_move * sizeof(z_ucs));
+  for (i=start_index; i<end_index; i++) {
+    wrapper->word_buffer[i - start_index] = *buffer_char(wrapper, i);
   }
-  for (i=0; i<wrapper->metadata_index; i++)
-    wrapper->metadata[i].output_index -= chars_sent;
+  wrapper->word_buffer[end_index - start_index] = 0;
 
-  wrapper->current_buffer_index -= chars_sent;
+  return wrapper->word_buffer;
 }
 
 
-void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
-    bool end_line_after_end_of_input) {
-  z_ucs *hyphenated_word, *input_index = input;
-  z_ucs current_char, last_char, buf;
+void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, const z_ucs *input,
+    size_t input_len, bool end_line_after_end_of_input) {
+  z_ucs *hyphenated_word;
+  size_t input_index = 0;
+  z_ucs current_char, last_char;
   long wrap_width_position, end_index, hyph_index;
   long buf_index, last_valid_hyph_index, output_metadata_index;
   long last_valid_hyph_position, hyph_position;
   int hyph_font_dash_bitmap_width, hyph_font_dash_advance;
   int metadata_index = 0, advance, bitmap_width;
+  size_t hyphenated_word_len;
+  struct freetype_wordwrap_char_size *current_size;
   true_type_font *hyph_font;
   bool process_line_end = end_line_after_end_of_input;
 
@@ -395,29 +501,36 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
   // purposes of kerning.
   last_char
     = (wrapper->current_buffer_index > 0)
-    ? wrapper->input_buffer[wrapper->current_buffer_index - 1]
+    ? *buffer_char(wrapper, wrapper->current_buffer_index - 1)
     : 0;
 
-  while ( ((input != NULL) && (*input_index != 0))
+  while ( ((input != NULL) && (input_index < input_len))
       || (process_line_end == true) ) {
 
-    if ((input != NULL) && (*input_index != 0)) {
-      current_char = *input_index;
+    if ((input != NULL) && (input_index < input_len)) {
+      current_char = input[input_index];
 
       ensure_additional_buffer_capacity(wrapper, 1);
-      wrapper->input_buffer[wrapper->current_buffer_index] = current_char;
+      *buffer_char(wrapper, wrapper->current_buffer_index) = current_char;
 
-      TRACE_LOG("buffer-add: %c / %ld / %p / cap:%ld / lweap:%ld \n",
+      TRACE_LOG("buffer-add: %c / %ld / cap:%ld / lweap:%ld \n",
           (char)current_char,
           wrapper->current_buffer_index,
-          wrapper->input_buffer + wrapper->current_buffer_index,
           wrapper->current_advance_position,
           wrapper->last_word_end_advance_position);
 
-      wrapper->current_buffer_index++;
-
       tt_get_glyph_size(wrapper->current_font, current_char,
           &advance, &bitmap_width);
+
+      // Remember the char's size so that finding a break position later
+      // on doesn't require measuring the buffered text again.
+      wrapper->bitmap_width_sum += bitmap_width;
+      current_size = char_size(wrapper, wrapper->current_buffer_index);
+      current_size->size.advance = advance;
+      current_size->size.bitmap_width = bitmap_width;
+      current_size->bitmap_width_sum = wrapper->bitmap_width_sum;
+
+      wrapper->current_buffer_index++;
       wrapper->current_width_position
         = wrapper->current_advance_position + bitmap_width;
       //printf("current_width_position: %ld for '%c'\n",
@@ -467,7 +580,7 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
       // to best break the line.
 
       if ((current_char == Z_UCS_SPACE) || (current_char == Z_UCS_NEWLINE)
-          || (((input == NULL) || (*input_index == 0))
+          || (((input == NULL) || (input_index >= input_len))
             && (process_line_end == true)) ) {
         // Here we've found a completed word past the lind end. At this
         // point we'll break the line without exception.
@@ -478,24 +591,23 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
 
         if (wrapper->enable_hyphenation == true) {
           end_index = wrapper->current_buffer_index - 2;
-          TRACE_LOG("end_index: %d / %c, lwei: %d\n",
-              end_index, wrapper->input_buffer[end_index],
-              wrapper->last_word_end_index);
+          TRACE_LOG("end_index: %d, lwei: %d\n",
+              end_index, wrapper->last_word_end_index);
           while ( (end_index >= 0)
               && (end_index > wrapper->last_word_end_index)
-              && ( (wrapper->input_buffer[end_index] == Z_UCS_COMMA)
-                || (wrapper->input_buffer[end_index] == Z_UCS_DOT) ) ) {
+              && ( (*buffer_char(wrapper, end_index) == Z_UCS_COMMA)
+                || (*buffer_char(wrapper, end_index) == Z_UCS_DOT) ) ) {
             end_index--;
           }
-          TRACE_LOG("end end_index: %d / %c, lwei: %d\n",
-              end_index, wrapper->input_buffer[end_index],
-              wrapper->last_word_end_index);
+          TRACE_LOG("end end_index: %d, lwei: %d\n",
+              end_index, wrapper->last_word_end_index);
           if (end_index > wrapper->last_word_end_index) {
             end_index++;
-            buf = wrapper->input_buffer[end_index];
-            wrapper->input_buffer[end_index] = 0;
-            if ((hyphenated_word = hyphenate(wrapper->input_buffer
-                    + wrapper->last_word_end_index + 1)) == NULL) {
+            if ((hyphenated_word = copy_hyphenated_word(
+                    copy_word(wrapper,
+                      wrapper->last_word_end_index + 1, end_index),
+                    &wrapper->hyphenated_word_buffer,
+                    &wrapper->hyphenated_word_buffer_size)) == NULL) {
               TRACE_LOG("Error hyphenating.\n");
             }
             else {
@@ -518,8 +630,10 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
               tt_get_glyph_size(hyph_font, Z_UCS_MINUS,
                   &hyph_font_dash_bitmap_width, &hyph_font_dash_advance);
               metadata_index = 0;
+              hyphenated_word_len = z_ucs_len(hyphenated_word);
 
-              while ( (buf_index < z_ucs_len(hyphenated_word))
+              while ( (buf_index < (long)hyphenated_word_len)
+                  && (hyph_index < end_index)
                   && (wrap_width_position + hyph_font_dash_bitmap_width
                     <= wrapper->line_length) ) {
                 /*
@@ -535,16 +649,17 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
                   //printf("metadata: %d of %d.\n",
                   //    metadata_index, wrapper->metadata_index);
 
-                  output_metadata_index =
-                    wrapper->metadata[metadata_index].output_index;
+                  output_metadata_index
+                    = metadata_buffer_index(wrapper, metadata_index);
 
                   //printf("output_metadata_index: %ld, hyph_index: %ld\n",
                   //    output_metadata_index, hyph_index);
                   //printf("hyph_font: %p.\n", hyph_font);
 
                   if (output_metadata_index <= hyph_index) {
-                    if (wrapper->metadata[metadata_index].font != NULL) {
-                      hyph_font = wrapper->metadata[metadata_index].font;
+                    if (metadata_entry(wrapper, metadata_index)->font
+                        != NULL) {
+                      hyph_font = metadata_entry(wrapper, metadata_index)->font;
                       tt_get_glyph_size(hyph_font, Z_UCS_MINUS,
                           &hyph_font_dash_bitmap_width,
                           &hyph_font_dash_advance);
@@ -564,12 +679,10 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
                 }
 
                 if (hyphenated_word[buf_index] != Z_UCS_SOFT_HYPEN) {
-                  //printf("hyph_font: %p.\n", hyph_font);
-                  tt_get_glyph_size(hyph_font,
-                      hyphenated_word[buf_index],
-                      &advance, &bitmap_width);
-                  //wrap_width_position += bitmap_width;
-                  wrap_width_position += advance;
+                  //wrap_width_position
+                  //  += char_size(wrapper, hyph_index)->size.bitmap_width;
+                  wrap_width_position
+                    += char_size(wrapper, hyph_index)->size.advance;
                   hyph_index++;
                 }
 
@@ -588,17 +701,15 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
                    */
               }
 
-              free(hyphenated_word);
-
               if (last_valid_hyph_index != -1) {
                 /*
                    printf("Found valid hyph pos at %ld / %c.\n",
                    last_valid_hyph_index,
-                   wrapper->input_buffer[last_valid_hyph_index]);
+                   *buffer_char(wrapper, last_valid_hyph_index));
                    */
                 TRACE_LOG("Found valid hyph pos at %ld / %c.\n",
                     last_valid_hyph_index,
-                    wrapper->input_buffer[last_valid_hyph_index]);
+                    *buffer_char(wrapper, last_valid_hyph_index));
                 hyph_index = last_valid_hyph_index;
                 hyph_position = last_valid_hyph_position;
               }
@@ -608,10 +719,10 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
                 //printf("no valid hyph, hyph_index: %ld.\n", hyph_index);
               }
             }
-            wrapper->input_buffer[end_index] = buf;
           } // endif (end_index > wrapper->last_work_end_index)
           else {
             hyph_index = end_index;
+            hyph_position = wrapper->last_word_end_advance_position;
             //printf("Hyph at %ld.\n", hyph_index);
           }
         } // endif (wrapper->enable_hyphentation == true)
@@ -619,72 +730,87 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
           // Check for dashes inside the last word.
           // Example: "first-class car", where the word end we've now
           // found is between "first-class" and "car".
-          wrap_width_position = wrapper->current_width_position;
-          hyph_index = wrapper->current_buffer_index - 2;
+          end_index = wrapper->current_buffer_index - 2;
+          hyph_index = end_index;
           while ( (hyph_index >= 0)
               && (hyph_index > wrapper->last_word_end_index)) {
             /*
             printf("hyph_index: %ld / '%c'.\n",
-                hyph_index, wrapper->input_buffer[hyph_index]);
+                hyph_index, *buffer_char(wrapper, hyph_index));
             */
 
-            if ( (wrapper->input_buffer[hyph_index] == Z_UCS_MINUS)
-                && (wrap_width_position <= wrapper->line_length) ) {
+            if ( (*buffer_char(wrapper, hyph_index) == Z_UCS_MINUS)
+                && (wrapper->current_width_position
+                  - get_bitmap_width_sum(wrapper, hyph_index + 1, end_index)
+                  <= wrapper->line_length) ) {
               // Found a dash to break on
               break;
             }
-            tt_get_glyph_size(wrapper->current_font,
-                wrapper->input_buffer[hyph_index],
-                &advance, &bitmap_width);
-            wrap_width_position -= bitmap_width;
             hyph_index--;
           }
-          hyph_position = wrap_width_position;
+          hyph_position
+            = wrapper->current_width_position
+            - get_bitmap_width_sum(wrapper, hyph_index + 1, end_index);
         }
 
         //printf("breaking on char %ld / %c.\n",
-        //    hyph_index, wrapper->input_buffer[hyph_index]);
-        TRACE_LOG("breaking on char %ld / %c.\n",
-            hyph_index, wrapper->input_buffer[hyph_index]);
-
-        if (wrapper->input_buffer[hyph_index] == Z_UCS_MINUS) {
-          // We're wrappring on a in-word-dash.
-          flush_line(wrapper, hyph_index, false, true);
-        }
-        else if (wrapper->input_buffer[hyph_index] == Z_UCS_SPACE) {
-          flush_line(wrapper, hyph_index - 1, false, true);
-          // In case we're wrapping between words without hyphenation or
-          // in-word-dashes we'll have to get rid of the remaining leading
-          // space-char in the input buffer.
-          forget_first_char_in_buffer(wrapper);
+        //    hyph_index, *buffer_char(wrapper, hyph_index));
+        TRACE_LOG("breaking on char %ld.\n", hyph_index);
+
+        if (hyph_index < 0) {
+          // There's no position to break at before the current char, since
+          // the word crossing the margin is the first one in this line. In
+          // this case we can only break right behind the word.
+          if (current_char == Z_UCS_SPACE) {
+            flush_line(wrapper, wrapper->current_buffer_index - 2, false, true);
+            forget_first_char_in_buffer(wrapper);
+            wrapper->current_advance_position = 0;
+            wrapper->current_width_position = 0;
+            wrapper->last_word_end_advance_position = 0;
+            wrapper->last_word_end_width_position = 0;
+          }
         }
         else {
-          if (wrapper->input_buffer[hyph_index - 2] == Z_UCS_MINUS) {
-            flush_line(wrapper, hyph_index - 3, true, true);
+          if (*buffer_char(wrapper, hyph_index) == Z_UCS_MINUS) {
+            // We're wrappring on a in-word-dash.
+            flush_line(wrapper, hyph_index, false, true);
+          }
+          else if (*buffer_char(wrapper, hyph_index) == Z_UCS_SPACE) {
+            flush_line(wrapper, hyph_index - 1, false, true);
+            // In case we're wrapping between words without hyphenation or
+            // in-word-dashes we'll have to get rid of the remaining leading
+            // space-char in the input buffer.
             forget_first_char_in_buffer(wrapper);
           }
           else {
-            flush_line(wrapper, hyph_index - 2, true, true);
+            if ( (hyph_index >= 2)
+                && (*buffer_char(wrapper, hyph_index - 2) == Z_UCS_MINUS) ) {
+              flush_line(wrapper, hyph_index - 3, true, true);
+              forget_first_char_in_buffer(wrapper);
+            }
+            else {
+              flush_line(wrapper, hyph_index - 2, true, true);
+            }
           }
-        }
 
-        wrapper->current_advance_position
-          -= hyph_position - wrapper->dash_bitmap_width;
+          wrapper->current_advance_position
+            -= hyph_position - wrapper->dash_bitmap_width;
 
-        /*
-        wrapper->last_width_position
-          = wrapper->current_width_position
-          - wrapper->last_word_end_advance_position;
-          */
+          /*
+          wrapper->last_width_position
+            = wrapper->current_width_position
+            - wrapper->last_word_end_advance_position;
+            */
 
-        wrapper->current_width_position
-          = wrapper->current_advance_position;
+          wrapper->current_width_position
+            = wrapper->current_advance_position;
 
-        wrapper->last_word_end_advance_position
-          = wrapper->current_advance_position;
+          wrapper->last_word_end_advance_position
+            = wrapper->current_advance_position;
 
-        wrapper->last_word_end_width_position
-          = wrapper->current_width_position;
+          wrapper->last_word_end_width_position
+            = wrapper->current_width_position;
+        }
 
         wrapper->last_word_end_index = -1;
       }
@@ -693,8 +819,8 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
         // break in case we've filled two full lines of text.
 
         /*
-        printf("flush on: %c\n", wrapper->input_buffer[
-            wrapper->current_buffer_index - 2]);
+        printf("flush on: %c\n", *buffer_char(wrapper,
+            wrapper->current_buffer_index - 2));
         */
         flush_line(wrapper, wrapper->current_buffer_index - 2, false, true);
 
@@ -708,7 +834,7 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
         wrapper->last_word_end_advance_position = 0;
         wrapper->last_word_end_width_position = 0;
 
-        //printf("first buf: %c\n", wrapper->input_buffer[0]);
+        //printf("first buf: %c\n", *buffer_char(wrapper, 0));
 
         /*
         printf("current_buffer_index: %ld\n", wrapper->current_buffer_index);
@@ -723,7 +849,7 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
         printf("current_buffer_index: %ld\n", wrapper->current_buffer_index);
 
         tt_get_glyph_size(wrapper->last_chars_in_line_font,
-            wrapper->input_buffer[wrapper->current_buffer_index],
+            *buffer_char(wrapper, wrapper->current_buffer_index),
             &advance, &bitmap_width);
 
         wrapper->current_advance_position
@@ -784,7 +910,7 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
         = wrapper->current_buffer_index - 1;
     }
 
-    if ( (input != NULL) && (*input_index != 0) ) {
+    if ( (input != NULL) && (input_index < input_len) ) {
       input_index++;
       last_char = current_char;
     }
@@ -796,7 +922,7 @@ void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
 
 
 void end_current_line(true_type_wordwrapper *wrapper) {
-  freetype_wrap_z_ucs(wrapper, NULL, true);
+  freetype_wrap_z_ucs(wrapper, NULL, 0, true);
 }
 
 
@@ -812,24 +938,34 @@ void freetype_wordwrap_insert_metadata(true_type_wordwrapper *wrapper,
     void (*metadata_output)(void *ptr_parameter, uint32_t int_parameter),
     void *ptr_parameter, uint32_t int_parameter, true_type_font *new_font) {
   size_t bytes_to_allocate;
+  struct freetype_wordwrap_metadata *metadata, *new_metadata;
+  int new_size, i;
 
   TRACE_LOG("freetype_wordwrap_insert_metadata, font %p.\n", new_font);
 
   // Before adding new metadata, check if we need to allocate more space.
   if (wrapper->metadata_index == wrapper->metadata_size)
   {
+    new_size = wrapper->metadata_size > 0 ? wrapper->metadata_size * 2 : 32;
     bytes_to_allocate
-      = (size_t)(
-          (wrapper->metadata_size + 32)
-          * sizeof(struct freetype_wordwrap_metadata));
+      = (size_t)(new_size * sizeof(struct freetype_wordwrap_metadata));
 
     TRACE_LOG("Allocating %d bytes for wordwrap-metadata.\n",
         (int)bytes_to_allocate);
 
-    wrapper->metadata = (struct freetype_wordwrap_metadata*)fizmo_realloc(
-        wrapper->metadata, bytes_to_allocate);
+    new_metadata = (struct freetype_wordwrap_metadata*)fizmo_malloc(
+        bytes_to_allocate);
+
+    for (i=0; i<wrapper->metadata_index; i++) {
+      new_metadata[i] = *metadata_entry(wrapper, i);
+    }
 
-    wrapper->metadata_size += 32;
+    if (wrapper->metadata != NULL) {
+      free(wrapper->metadata);
+    }
+    wrapper->metadata = new_metadata;
+    wrapper->metadata_size = new_size;
+    wrapper->metadata_start = 0;
 
     TRACE_LOG("Wordwrap-metadata at %p.\n", wrapper->metadata);
   }
@@ -837,19 +973,14 @@ void freetype_wordwrap_insert_metadata(true_type_wordwrapper *wrapper,
   TRACE_LOG("Current wordwrap-metadata-index is %d.\n",
       wrapper->metadata_index);
 
-  TRACE_LOG("Current wordwrap-metadata-entry at %p.\n",
-      &(wrapper->metadata[wrapper->metadata_index]));
+  metadata = metadata_entry(wrapper, wrapper->metadata_index);
 
-  wrapper->metadata[wrapper->metadata_index].output_index
-    = wrapper->current_buffer_index;
-  wrapper->metadata[wrapper->metadata_index].metadata_output_function
-    = metadata_output;
-  wrapper->metadata[wrapper->metadata_index].ptr_parameter
-    = ptr_parameter;
-  wrapper->metadata[wrapper->metadata_index].int_parameter
-    = int_parameter;
-  wrapper->metadata[wrapper->metadata_index].font
-    = new_font;
+  metadata->output_index
+    = wrapper->chars_consumed + wrapper->current_buffer_index;
+  metadata->metadata_output_function = metadata_output;
+  metadata->ptr_parameter = ptr_parameter;
+  metadata->int_parameter = int_parameter;
+  metadata->font = new_font;
 
   if (new_font != NULL) {
     set_font(wrapper, new_font);
@@ -870,3 +1001,22 @@ void freetype_wordwrap_adjust_line_length(true_type_wordwrapper *wrapper,
   wrapper->line_length = new_line_length;
 }
 
+
+void freetype_wordwrap_set_line_break_destination(
+    true_type_wordwrapper *wrapper,
+    void (*line_break_destination)(long position, int break_type,
+      void *parameter)) {
+  wrapper->line_break_destination = line_break_destination;
+}
+
+
+long freetype_wordwrap_get_input_position(true_type_wordwrapper *wrapper) {
+  return wrapper->chars_consumed + wrapper->current_buffer_index;
+}
+
+
+bool freetype_wordwrap_is_at_line_start(true_type_wordwrapper *wrapper) {
+  return (wrapper->current_buffer_index == 0)
+    && (wrapper->current_advance_position == 0);
+}
+
@@ -38,8 +38,15 @@
 #include "tools/types.h"
 #include "true_type_font.h"
 
+// Line break types reported to the line break destination: A minus or a
+// newline has been added in front of the char at the given position, or
+// the char at the given position has been skipped.
+#define FREETYPE_WORDWRAP_BREAK_MINUS 0
+#define FREETYPE_WORDWRAP_BREAK_NEWLINE 1
+#define FREETYPE_WORDWRAP_BREAK_SKIP 2
+
 struct freetype_wordwrap_metadata {
-  long output_index;
+  long output_index; // absolute position of the char in the wrapper's input
   void (*metadata_output_function)(void *ptr_parameter, uint32_t int_parameter);
   void *ptr_parameter;
   true_type_font *font;
@@ -47,19 +54,38 @@ struct freetype_wordwrap_metadata {
 };
 
 
+// Size of a char in the wrapper's input buffer, measured in the font that
+// was active when the char was added.
+struct freetype_wordwrap_char_size {
+  glyph_size size;
+  long bitmap_width_sum; // sum of all bitmap widths up to and including this
+};
+
 typedef struct {
   true_type_font *current_font;
   int line_length; // in pixels
   bool enable_hyphenation;
-  struct freetype_wordwrap_metadata *metadata;
-  int metadata_size;
-  int metadata_index;
+  struct freetype_wordwrap_metadata *metadata; // ring buffer
+  int metadata_size; // always a power of two
+  int metadata_start;
+  int metadata_index; // number of entries in the queue
   true_type_font *font_at_buffer_start;
-  void (*wrapped_text_output_destination)(z_ucs *output, void *parameter);
+  void (*wrapped_text_output_destination)(const z_ucs *output, size_t len,
+      void *parameter);
   void *destination_parameter;
-  z_ucs *input_buffer;
-  long input_buffer_size;
-  long current_buffer_index;
+  void (*line_break_destination)(long position, int break_type,
+      void *parameter);
+  z_ucs *input_buffer; // ring buffer
+  long input_buffer_size; // always a power of two
+  long input_buffer_start;
+  long current_buffer_index; // number of chars in the buffer
+  long chars_consumed; // number of chars removed from the buffer's front
+  struct freetype_wordwrap_char_size *char_sizes; // parallel to input_buffer
+  long bitmap_width_sum; // sum of the bitmap widths of all chars added
+  z_ucs *word_buffer;
+  long word_buffer_size;
+  z_ucs *hyphenated_word_buffer;
+  size_t hyphenated_word_buffer_size;
   long last_word_end_index; // last word end buffer index
   long last_word_end_advance_position; // right position of last word in line
   long last_word_end_width_position;
@@ -76,12 +102,16 @@ typedef struct {
 
 true_type_wordwrapper *create_true_type_wordwrapper(
     true_type_font *current_font, int line_length,
-    void (*wrapped_text_output_destination)(z_ucs *output, void *parameter),
+    void (*wrapped_text_output_destination)(const z_ucs *output, size_t len,
+      void *parameter),
     void *destination_parameter, bool hyphenation_enabled);
 void destroy_freetype_wrapper(true_type_wordwrapper * wrapper);
 int get_current_pixel_position(true_type_wordwrapper *wrapper);
-void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, z_ucs *input,
-    bool end_line_after_end_of_input);
+// Wraps the input_len chars at input. The output destination receives
+// slices of the wrapper's buffer which are not zero-terminated and are only
+// valid during the callback.
+void freetype_wrap_z_ucs(true_type_wordwrapper *wrapper, const z_ucs *input,
+    size_t input_len, bool end_line_after_end_of_input);
 void freetype_wordwrap_flush_output(true_type_wordwrapper *wrapper);
 void freetype_wordwrap_insert_metadata(true_type_wordwrapper *wrapper,
     void (*metadata_output)(void *ptr_parameter, uint32_t int_parameter),
@@ -89,6 +119,18 @@ void freetype_wordwrap_insert_metadata(true_type_wordwrapper *wrapper,
 void freetype_wordwrap_adjust_line_length(true_type_wordwrapper *wrapper,
     size_t new_line_length);
 void freetype_wordwrap_reset_position(true_type_wordwrapper *wrapper);
+// Sets a function which is notified about every line break, using the
+// wrapper's destination parameter. Positions are counted in chars since
+// the wrapper's creation, see freetype_wordwrap_get_input_position.
+void freetype_wordwrap_set_line_break_destination(
+    true_type_wordwrapper *wrapper,
+    void (*line_break_destination)(long position, int break_type,
+      void *parameter));
+// Returns the number of chars the wrapper has received so far.
+long freetype_wordwrap_get_input_position(true_type_wordwrapper *wrapper);
+// Returns true in case the wrapper holds no text and the next char will
+// be placed at the start of a line.
+bool freetype_wordwrap_is_at_line_start(true_type_wordwrapper *wrapper);
 
 #endif // true_type_wordwrapper_h_INCLUDED
 
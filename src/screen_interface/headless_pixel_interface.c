@@ -0,0 +1,760 @@
+
+/* headless_pixel_interface.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// A screen interface without any display: everything is drawn into an
+// in-memory r/g/b framebuffer, and input is taken from a queue of scripted
+// events. This allows to render on servers and to run reproducible
+// performance tests.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "headless_pixel_interface.h"
+#include "../pixel_interface/glyph_blending.h"
+#include "tools/tracelog.h"
+#include "tools/unused.h"
+#include "interpreter/fizmo.h"
+#include "interpreter/streams.h"
+
+// Queue entries which are handled internally instead of being returned.
+#define HEADLESS_EVENT_RESIZE -1
+#define HEADLESS_EVENT_DUMP -2
+
+#define MAX_VALUE_AS_STRING_LEN 32
+
+typedef struct headless_event_struct {
+  int event_type;
+  z_ucs input;
+  int width;
+  int height;
+  char *filename;
+} headless_event;
+
+static struct z_screen_pixel_interface headless_interface;
+static bool headless_interface_initialized = false;
+
+static uint8_t *framebuffer = NULL;
+static int screen_width = HEADLESS_DEFAULT_SCREEN_WIDTH;
+static int screen_height = HEADLESS_DEFAULT_SCREEN_HEIGHT;
+static long nof_updates = 0;
+static long nof_pixels_presented = 0;
+
+static headless_event *events = NULL;
+static int nof_events = 0;
+static int events_size = 0;
+static int next_event = 0;
+// Set from reporting a resize until the screen is updated next, which is
+// when the pixel interface has redrawn the screen for the new size.
+static bool resize_pending_update = false;
+
+static char last_width_config_value_as_string[MAX_VALUE_AS_STRING_LEN];
+static char last_height_config_value_as_string[MAX_VALUE_AS_STRING_LEN];
+static char *headless_config_option_names[] = {
+  "headless-width", "headless-height", "headless-script", NULL };
+
+static struct {
+  char *name;
+  int event_type;
+} key_names[] = {
+  { "backspace", EVENT_WAS_CODE_BACKSPACE },
+  { "delete", EVENT_WAS_CODE_DELETE },
+  { "left", EVENT_WAS_CODE_CURSOR_LEFT },
+  { "right", EVENT_WAS_CODE_CURSOR_RIGHT },
+  { "up", EVENT_WAS_CODE_CURSOR_UP },
+  { "down", EVENT_WAS_CODE_CURSOR_DOWN },
+  { "page-up", EVENT_WAS_CODE_PAGE_UP },
+  { "page-down", EVENT_WAS_CODE_PAGE_DOWN },
+  { "esc", EVENT_WAS_CODE_ESC },
+  { "ctrl-a", EVENT_WAS_CODE_CTRL_A },
+  { "ctrl-e", EVENT_WAS_CODE_CTRL_E },
+  { "ctrl-l", EVENT_WAS_CODE_CTRL_L },
+  { "ctrl-r", EVENT_WAS_CODE_CTRL_R },
+  { "scroll-top", EVENT_WAS_CODE_SCROLL_TOP },
+  { "scroll-bottom", EVENT_WAS_CODE_SCROLL_BOTTOM },
+  { NULL, 0 }
+};
+
+
+static void resize_framebuffer(int width, int height) {
+  framebuffer = fizmo_realloc(framebuffer, (size_t)width * height * 3);
+  memset(framebuffer, 0, (size_t)width * height * 3);
+  screen_width = width;
+  screen_height = height;
+  TRACE_LOG("Headless framebuffer size: %d*%d.\n", width, height);
+}
+
+
+static uint8_t *get_pixel(int y, int x) {
+  return framebuffer + ((size_t)y * screen_width + x) * 3;
+}
+
+
+// Clips the given area to the screen, returns false in case nothing of it
+// remains.
+static bool clip_area(int *x, int *y, int *width, int *height) {
+  if (*x < 0) {
+    *width += *x;
+    *x = 0;
+  }
+  if (*y < 0) {
+    *height += *y;
+    *y = 0;
+  }
+  if (*x + *width > screen_width) {
+    *width = screen_width - *x;
+  }
+  if (*y + *height > screen_height) {
+    *height = screen_height - *y;
+  }
+  return (*width > 0) && (*height > 0);
+}
+
+
+static void headless_draw_rgb_pixel(int y, int x, uint8_t r, uint8_t g,
+    uint8_t b) {
+  uint8_t *pixel;
+
+  if ( (x >= 0) && (y >= 0) && (x < screen_width) && (y < screen_height) ) {
+    pixel = get_pixel(y, x);
+    pixel[0] = r;
+    pixel[1] = g;
+    pixel[2] = b;
+  }
+}
+
+
+static void headless_draw_rgb_span(int y, int x, int width,
+    uint8_t *rgb_data) {
+  int height = 1, start_x = x;
+
+  if (clip_area(&x, &y, &width, &height) == true) {
+    memcpy(get_pixel(y, x), rgb_data + (x - start_x) * 3,
+        (size_t)width * 3);
+  }
+}
+
+
+static void headless_draw_alpha_mask(int y, int x, int width, int height,
+    uint8_t *mask, int mask_pitch,
+    uint8_t foreground_r, uint8_t foreground_g, uint8_t foreground_b,
+    uint8_t background_r, uint8_t background_g, uint8_t background_b) {
+  uint8_t foreground[3] = { foreground_r, foreground_g, foreground_b };
+  uint8_t background[3] = { background_r, background_g, background_b };
+  uint8_t blended_row[width * 3 + 1];
+  uint8_t *mask_row, *pixel;
+  int row, pixel_x;
+
+  for (row=0; row<height; row++) {
+    if ( (y + row < 0) || (y + row >= screen_height) ) {
+      continue;
+    }
+
+    mask_row = mask + row * mask_pitch;
+    blend_gray_row(mask_row, width, blended_row, foreground, background);
+    for (pixel_x=0; pixel_x<width; pixel_x++) {
+      // Pixels without coverage are left untouched.
+      if ( (mask_row[pixel_x] != 0)
+          && (x + pixel_x >= 0) && (x + pixel_x < screen_width) ) {
+        pixel = get_pixel(y + row, x + pixel_x);
+        pixel[0] = blended_row[pixel_x * 3];
+        pixel[1] = blended_row[pixel_x * 3 + 1];
+        pixel[2] = blended_row[pixel_x * 3 + 2];
+      }
+    }
+  }
+}
+
+
+static void headless_fill_area(int startx, int starty, int xsize, int ysize,
+    uint8_t r, uint8_t g, uint8_t b) {
+  uint8_t *first_row, *pixel;
+  int x, y;
+
+  if (clip_area(&startx, &starty, &xsize, &ysize) == false) {
+    return;
+  }
+
+  // Only the first row is filled pixel by pixel, the others are copies.
+  first_row = get_pixel(starty, startx);
+  pixel = first_row;
+  for (x=0; x<xsize; x++) {
+    *(pixel++) = r;
+    *(pixel++) = g;
+    *(pixel++) = b;
+  }
+
+  for (y=starty+1; y<starty+ysize; y++) {
+    memcpy(get_pixel(y, startx), first_row, (size_t)xsize * 3);
+  }
+}
+
+
+static void headless_copy_area(int dsty, int dstx, int srcy, int srcx,
+    int height, int width) {
+  int y;
+
+  if ( (srcx < 0) || (srcy < 0) || (dstx < 0) || (dsty < 0)
+      || (srcx + width > screen_width) || (dstx + width > screen_width)
+      || (srcy + height > screen_height) || (dsty + height > screen_height)
+      || (width <= 0) || (height <= 0) ) {
+    TRACE_LOG("Ignoring copy_area outside the screen.\n");
+    return;
+  }
+
+  // Rows are moved in an order which doesn't overwrite source rows which
+  // are yet to be copied.
+  if (dsty > srcy) {
+    for (y=height-1; y>=0; y--) {
+      memmove(get_pixel(dsty + y, dstx), get_pixel(srcy + y, srcx),
+          (size_t)width * 3);
+    }
+  }
+  else {
+    for (y=0; y<height; y++) {
+      memmove(get_pixel(dsty + y, dstx), get_pixel(srcy + y, srcx),
+          (size_t)width * 3);
+    }
+  }
+}
+
+
+static void headless_update_screen() {
+  nof_updates++;
+  nof_pixels_presented += (long)screen_width * screen_height;
+  resize_pending_update = false;
+}
+
+
+static void headless_update_screen_rects(struct z_screen_rect *rects,
+    int nof_rects) {
+  int i;
+
+  nof_updates++;
+  for (i=0; i<nof_rects; i++) {
+    nof_pixels_presented += (long)rects[i].width * rects[i].height;
+  }
+  resize_pending_update = false;
+}
+
+
+static void headless_redraw_screen_from_scratch() {
+  // The framebuffer is always up to date.
+}
+
+
+static void headless_set_cursor_visibility(bool UNUSED(visible)) {
+}
+
+
+static void add_event(headless_event *event) {
+  if (nof_events == events_size) {
+    events_size = events_size > 0 ? events_size * 2 : 256;
+    events = fizmo_realloc(events, events_size * sizeof(headless_event));
+  }
+  events[nof_events++] = *event;
+}
+
+
+void queue_headless_event(int event_type, z_ucs input) {
+  headless_event event = { event_type, input, 0, 0, NULL };
+  add_event(&event);
+}
+
+
+void queue_headless_input_line(z_ucs *input) {
+  while (*input != 0) {
+    queue_headless_event(EVENT_WAS_INPUT, *(input++));
+  }
+  queue_headless_event(EVENT_WAS_INPUT, Z_UCS_NEWLINE);
+}
+
+
+void queue_headless_resize(int width, int height) {
+  headless_event event = { HEADLESS_EVENT_RESIZE, 0, width, height, NULL };
+  add_event(&event);
+}
+
+
+void queue_headless_screen_dump(char *filename) {
+  headless_event event = { HEADLESS_EVENT_DUMP, 0, 0, 0, NULL };
+  event.filename = fizmo_malloc(strlen(filename) + 1);
+  strcpy(event.filename, filename);
+  add_event(&event);
+}
+
+
+// After a resize has been reported, the pixel interface waits with a
+// timeout for further resizes before redrawing the screen. Until then, a
+// timed wait only returns the next resize and times out otherwise, so a
+// dump following a resize shows the redrawn screen and the end of the
+// queue isn't reported before the last resize has been handled. Polling
+// returns the next queued event the same way, with EVENT_WAS_NOTHING in
+// place of a timeout and of the end of the queue.
+static int headless_get_next_event(z_ucs *input, int timeout_millis,
+    bool poll_only, bool UNUSED(history_finished_remeasuring)) {
+  headless_event *event;
+  bool timed_wait = (timeout_millis > 0);
+
+  while (next_event < nof_events) {
+    event = &events[next_event];
+
+    if (event->event_type == HEADLESS_EVENT_RESIZE) {
+      next_event++;
+      resize_framebuffer(event->width, event->height);
+      resize_pending_update = true;
+      return EVENT_WAS_WINCH;
+    }
+    else if ( (poll_only == true) && (resize_pending_update == true) ) {
+      return EVENT_WAS_NOTHING;
+    }
+    else if ( (timed_wait == true) && (resize_pending_update == true) ) {
+      return EVENT_WAS_TIMEOUT;
+    }
+
+    next_event++;
+
+    if (event->event_type == HEADLESS_EVENT_DUMP) {
+      dump_headless_screen_to_ppm(event->filename);
+    }
+    else {
+      *input = event->input;
+      return event->event_type;
+    }
+  }
+
+  if (poll_only == true) {
+    return EVENT_WAS_NOTHING;
+  }
+
+  return (timed_wait == true) && (resize_pending_update == true)
+    ? EVENT_WAS_TIMEOUT
+    : EVENT_WAS_QUIT;
+}
+
+
+// Queues the UTF-8 encoded "line" as input.
+static void queue_utf8_input_line(char *line) {
+  z_ucs buffer[strlen(line) + 1];
+  unsigned char *ptr = (unsigned char*)line;
+  int index = 0, nof_continuation_bytes;
+  z_ucs code;
+
+  while (*ptr != 0) {
+    if (*ptr < 0x80) {
+      code = *ptr;
+      nof_continuation_bytes = 0;
+    }
+    else if ((*ptr & 0xe0) == 0xc0) {
+      code = *ptr & 0x1f;
+      nof_continuation_bytes = 1;
+    }
+    else if ((*ptr & 0xf0) == 0xe0) {
+      code = *ptr & 0x0f;
+      nof_continuation_bytes = 2;
+    }
+    else if ((*ptr & 0xf8) == 0xf0) {
+      code = *ptr & 0x07;
+      nof_continuation_bytes = 3;
+    }
+    else {
+      // Invalid byte, skipped.
+      ptr++;
+      continue;
+    }
+    ptr++;
+
+    while ( (nof_continuation_bytes > 0) && ((*ptr & 0xc0) == 0x80) ) {
+      code = (code << 6) | (*ptr & 0x3f);
+      nof_continuation_bytes--;
+      ptr++;
+    }
+
+    if (nof_continuation_bytes == 0) {
+      buffer[index++] = code;
+    }
+  }
+  buffer[index] = 0;
+
+  queue_headless_input_line(buffer);
+}
+
+
+static int parse_script_command(char *command) {
+  int width, height, i;
+
+  if (sscanf(command, "resize %d %d", &width, &height) == 2) {
+    if ( (width < 1) || (height < 1) ) {
+      return -1;
+    }
+    queue_headless_resize(width, height);
+  }
+  else if ( (strncmp(command, "dump ", 5) == 0) && (command[5] != 0) ) {
+    queue_headless_screen_dump(command + 5);
+  }
+  else if (strncmp(command, "key ", 4) == 0) {
+    for (i=0; key_names[i].name != NULL; i++) {
+      if (strcasecmp(command + 4, key_names[i].name) == 0) {
+        queue_headless_event(key_names[i].event_type, 0);
+        return 0;
+      }
+    }
+    return -1;
+  }
+  else if (strcmp(command, "quit") == 0) {
+    queue_headless_event(EVENT_WAS_QUIT, 0);
+  }
+  else {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Reads a line of any length into *line, which is grown as required.
+// Returns the line's length or -1 at the end of the file.
+static long read_script_line(char **line, size_t *line_size, FILE *in) {
+#ifdef HAVE_GETLINE
+  return getline(line, line_size, in);
+#else
+  size_t len = 0;
+
+  if (*line_size < 128) {
+    *line_size = 128;
+    *line = fizmo_realloc(*line, *line_size);
+  }
+
+  while (fgets(*line + len, *line_size - len, in) != NULL) {
+    len += strlen(*line + len);
+    if ( (len > 0) && ((*line)[len - 1] == '\n') ) {
+      return len;
+    }
+    *line_size *= 2;
+    *line = fizmo_realloc(*line, *line_size);
+  }
+
+  return len > 0 ? (long)len : -1;
+#endif // HAVE_GETLINE
+}
+
+
+int load_headless_script(char *filename) {
+  FILE *script;
+  char *line = NULL;
+  size_t line_size = 0;
+  long len;
+  int line_number = 0;
+
+  if ((script = fopen(filename, "r")) == NULL) {
+    return -1;
+  }
+
+  while ((len = read_script_line(&line, &line_size, script)) >= 0) {
+    line_number++;
+    while ( (len > 0) && ( (line[len-1] == '\n') || (line[len-1] == '\r') ) ) {
+      line[--len] = 0;
+    }
+
+    if ( (line[0] == '!') && (line[1] != '!') ) {
+      if (parse_script_command(line + 1) != 0) {
+        TRACE_LOG("Invalid command in line %d of script \"%s\".\n",
+            line_number, filename);
+      }
+    }
+    else {
+      queue_utf8_input_line(line[0] == '!' ? line + 1 : line);
+    }
+  }
+
+  free(line);
+  fclose(script);
+
+  return 0;
+}
+
+
+int dump_headless_screen_to_ppm(char *filename) {
+  FILE *out;
+  size_t size = (size_t)screen_width * screen_height * 3;
+  int result = 0;
+
+  if ( (framebuffer == NULL) || ((out = fopen(filename, "wb")) == NULL) ) {
+    return -1;
+  }
+
+  if ( (fprintf(out, "P6\n%d %d\n255\n", screen_width, screen_height) < 0)
+      || (fwrite(framebuffer, 1, size, out) != size) ) {
+    result = -1;
+  }
+
+  if (fclose(out) != 0) {
+    result = -1;
+  }
+
+  TRACE_LOG("Dumped screen to \"%s\", result %d.\n", filename, result);
+
+  return result;
+}
+
+
+uint8_t *get_headless_framebuffer(int *width, int *height) {
+  *width = screen_width;
+  *height = screen_height;
+  return framebuffer;
+}
+
+
+void get_headless_update_statistics(long *updates, long *pixels_presented) {
+  *updates = nof_updates;
+  *pixels_presented = nof_pixels_presented;
+}
+
+
+static bool headless_is_input_timeout_available() {
+  return true;
+}
+
+
+static char *headless_get_interface_name() {
+  return "headless";
+}
+
+
+static bool headless_is_colour_available() {
+  return true;
+}
+
+
+static int headless_parse_config_parameter(char *key, char *value) {
+  long long_value;
+  char *endptr;
+  int result;
+
+  if ( (strcasecmp(key, "headless-width") == 0)
+      || (strcasecmp(key, "headless-height") == 0) ) {
+    if ( (value == NULL) || (strlen(value) == 0) )
+      return -1;
+    long_value = strtol(value, &endptr, 10);
+    free(value);
+    if ( (*endptr != 0) || (long_value < 1) )
+      return -1;
+    if (strcasecmp(key, "headless-width") == 0)
+      screen_width = long_value;
+    else
+      screen_height = long_value;
+    if (framebuffer != NULL)
+      resize_framebuffer(screen_width, screen_height);
+    return 0;
+  }
+  else if (strcasecmp(key, "headless-script") == 0) {
+    if (value == NULL)
+      return -1;
+    result = load_headless_script(value);
+    free(value);
+    return result;
+  }
+  else {
+    return -2;
+  }
+}
+
+
+static char *headless_get_config_value(char *key) {
+  if (strcasecmp(key, "headless-width") == 0) {
+    snprintf(last_width_config_value_as_string, MAX_VALUE_AS_STRING_LEN,
+        "%d", screen_width);
+    return last_width_config_value_as_string;
+  }
+  else if (strcasecmp(key, "headless-height") == 0) {
+    snprintf(last_height_config_value_as_string, MAX_VALUE_AS_STRING_LEN,
+        "%d", screen_height);
+    return last_height_config_value_as_string;
+  }
+  else {
+    return NULL;
+  }
+}
+
+
+static char **headless_get_config_option_names() {
+  return headless_config_option_names;
+}
+
+
+static void headless_link_interface_to_story(
+    struct z_story *UNUSED(story)) {
+  resize_framebuffer(screen_width, screen_height);
+}
+
+
+static void headless_reset_interface() {
+}
+
+
+static int headless_close_interface(z_ucs *UNUSED(error_message)) {
+  // The framebuffer is kept so the final screen may still be inspected.
+  return 0;
+}
+
+
+static void headless_output_interface_info() {
+  streams_latin1_output("headless pixel interface\n");
+}
+
+
+static int headless_get_screen_width_in_pixels() {
+  return screen_width;
+}
+
+
+static int headless_get_screen_height_in_pixels() {
+  return screen_height;
+}
+
+
+static double headless_get_device_to_pixel_ratio() {
+  return 1.0;
+}
+
+
+static z_colour headless_get_default_foreground_colour() {
+  return Z_COLOUR_BLACK;
+}
+
+
+static z_colour headless_get_default_background_colour() {
+  return Z_COLOUR_WHITE;
+}
+
+
+// Without a display, output before the interface is opened goes to stdout.
+static int headless_console_output(z_ucs *output) {
+  while (*output != 0) {
+    if (*output < 0x80) {
+      putchar(*output);
+    }
+    else if (*output < 0x800) {
+      putchar(0xc0 | (*output >> 6));
+      putchar(0x80 | (*output & 0x3f));
+    }
+    else if (*output < 0x10000) {
+      putchar(0xe0 | (*output >> 12));
+      putchar(0x80 | ((*output >> 6) & 0x3f));
+      putchar(0x80 | (*output & 0x3f));
+    }
+    else {
+      putchar(0xf0 | (*output >> 18));
+      putchar(0x80 | ((*output >> 12) & 0x3f));
+      putchar(0x80 | ((*output >> 6) & 0x3f));
+      putchar(0x80 | (*output & 0x3f));
+    }
+    output++;
+  }
+
+  return 0;
+}
+
+
+struct z_screen_pixel_interface *get_headless_pixel_interface() {
+  if (headless_interface_initialized == false) {
+    memset(&headless_interface, 0, sizeof(struct z_screen_pixel_interface));
+    headless_interface.draw_rgb_pixel = &headless_draw_rgb_pixel;
+    headless_interface.is_input_timeout_available
+      = &headless_is_input_timeout_available;
+    headless_interface.get_next_event = &headless_get_next_event;
+    headless_interface.get_interface_name = &headless_get_interface_name;
+    headless_interface.is_colour_available = &headless_is_colour_available;
+    headless_interface.parse_config_parameter
+      = &headless_parse_config_parameter;
+    headless_interface.get_config_value = &headless_get_config_value;
+    headless_interface.get_config_option_names
+      = &headless_get_config_option_names;
+    headless_interface.link_interface_to_story
+      = &headless_link_interface_to_story;
+    headless_interface.reset_interface = &headless_reset_interface;
+    headless_interface.close_interface = &headless_close_interface;
+    headless_interface.output_interface_info
+      = &headless_output_interface_info;
+    headless_interface.get_screen_width_in_pixels
+      = &headless_get_screen_width_in_pixels;
+    headless_interface.get_screen_height_in_pixels
+      = &headless_get_screen_height_in_pixels;
+    headless_interface.get_device_to_pixel_ratio
+      = &headless_get_device_to_pixel_ratio;
+    headless_interface.update_screen = &headless_update_screen;
+    headless_interface.redraw_screen_from_scratch
+      = &headless_redraw_screen_from_scratch;
+    headless_interface.copy_area = &headless_copy_area;
+    headless_interface.fill_area = &headless_fill_area;
+    headless_interface.set_cursor_visibility
+      = &headless_set_cursor_visibility;
+    headless_interface.get_default_foreground_colour
+      = &headless_get_default_foreground_colour;
+    headless_interface.get_default_background_colour
+      = &headless_get_default_background_colour;
+    headless_interface.console_output = &headless_console_output;
+    headless_interface.draw_rgb_span = &headless_draw_rgb_span;
+    headless_interface.draw_alpha_mask = &headless_draw_alpha_mask;
+    headless_interface.update_screen_rects = &headless_update_screen_rects;
+    headless_interface_initialized = true;
+  }
+
+  return &headless_interface;
+}
+
+
+void free_headless_pixel_interface() {
+  int i;
+
+  for (i=0; i<nof_events; i++) {
+    if (events[i].filename != NULL) {
+      free(events[i].filename);
+    }
+  }
+  if (events != NULL) {
+    free(events);
+    events = NULL;
+  }
+  nof_events = 0;
+  events_size = 0;
+  next_event = 0;
+
+  if (framebuffer != NULL) {
+    free(framebuffer);
+    framebuffer = NULL;
+  }
+}
@@ -0,0 +1,92 @@
+
+/* headless_pixel_interface.h
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#ifndef headless_pixel_interface_h_INCLUDED
+#define headless_pixel_interface_h_INCLUDED
+
+#include "tools/types.h"
+#include "screen_pixel_interface.h"
+
+#define HEADLESS_DEFAULT_SCREEN_WIDTH 800
+#define HEADLESS_DEFAULT_SCREEN_HEIGHT 600
+
+// Returns a screen interface which draws into an in-memory framebuffer
+// and takes its input from a queue of scripted events, so the library
+// can run without any display. The result is meant to be passed to
+// fizmo_register_screen_pixel_interface. The framebuffer is allocated
+// when the interface is linked to the story.
+struct z_screen_pixel_interface *get_headless_pixel_interface();
+
+// Queues events to be returned by get_next_event. Polling never returns
+// a queued event, so that remeasuring the history always finishes before
+// the next input is processed. Once the queue is empty, EVENT_WAS_QUIT is
+// returned. Between a resize and the next screen update, waits with a
+// timeout return EVENT_WAS_TIMEOUT unless the next event is a resize.
+void queue_headless_event(int event_type, z_ucs input);
+// Queues every character of "input" followed by a newline.
+void queue_headless_input_line(z_ucs *input);
+// Changes the framebuffer's size and returns EVENT_WAS_WINCH when reached.
+void queue_headless_resize(int width, int height);
+// Writes the framebuffer to a PPM file when reached.
+void queue_headless_screen_dump(char *filename);
+
+// Reads events from a script file, in which every line is typed as
+// input followed by a newline, except for lines starting with '!':
+//   !resize WIDTH HEIGHT
+//   !dump FILENAME
+//   !key NAME          (backspace, delete, left, right, up, down, page-up,
+//                       page-down, esc, ctrl-a, ctrl-e, ctrl-l, ctrl-r,
+//                       scroll-top, scroll-bottom)
+//   !quit
+//   !!TEXT             (types "!TEXT")
+// Returns 0 on success and -1 in case the file couldn't be read.
+int load_headless_script(char *filename);
+
+// Writes the framebuffer as a binary PPM file. Returns 0 on success and
+// -1 on failure.
+int dump_headless_screen_to_ppm(char *filename);
+
+// Returns the framebuffer's r/g/b triplets, row by row without padding.
+uint8_t *get_headless_framebuffer(int *width, int *height);
+
+// Returns the number of screen updates and the number of pixels these
+// had to present, which allows to compare rendering costs.
+void get_headless_update_statistics(long *nof_updates,
+    long *nof_pixels_presented);
+
+void free_headless_pixel_interface();
+
+#endif // headless_pixel_interface_h_INCLUDED
@@ -59,6 +59,17 @@
 #define EVENT_WAS_CODE_ESC          0x400B
 #define EVENT_WAS_CODE_CTRL_L       0x400C
 #define EVENT_WAS_CODE_CTRL_R       0x400D
+#define EVENT_WAS_CODE_SCROLL_TOP   0x400E
+#define EVENT_WAS_CODE_SCROLL_BOTTOM 0x400F
+
+// A rectangular area of the screen, in pixels.
+struct z_screen_rect
+{
+  int x;
+  int y;
+  int width;
+  int height;
+};
 
 struct z_screen_pixel_interface
 {
@@ -89,6 +100,27 @@ struct z_screen_pixel_interface
   z_colour (*get_default_foreground_colour)();
   z_colour (*get_default_background_colour)();
   int (*console_output)(z_ucs *output);
+
+  // The following functions are optional and may be NULL. In case they
+  // are available they're used instead of draw_rgb_pixel.
+
+  // Draws "width" pixels starting at y/x, rgb_data contains width
+  // consecutive r/g/b byte triplets.
+  void (*draw_rgb_span)(int y, int x, int width, uint8_t *rgb_data);
+
+  // Draws a width*height coverage mask at y/x, blending the foreground
+  // over the background colour by coverage/255. Pixels with coverage 0
+  // must be left untouched. mask_pitch is the distance in bytes between
+  // two rows of the mask.
+  void (*draw_alpha_mask)(int y, int x, int width, int height,
+      uint8_t *mask, int mask_pitch,
+      uint8_t foreground_r, uint8_t foreground_g, uint8_t foreground_b,
+      uint8_t background_r, uint8_t background_g, uint8_t background_b);
+
+  // Like update_screen, but only the given areas have changed since the
+  // last update. In case this is available it's used instead of
+  // update_screen. It's not invoked when nothing has changed.
+  void (*update_screen_rects)(struct z_screen_rect *rects, int nof_rects);
 };
 
 #endif /* screen_pixel_interface_h_INCLUDED */
@@ -0,0 +1,173 @@
+
+/* headless_pixel_interface_test.c
+ *
+ * This file is part of fizmo.
+ *
+ * Copyright (c) 2023 Christoph Ender.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Runs a script through the headless interface the way the pixel
+// interface would and checks the events and screen dumps it produces.
+// Doesn't require a story file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headless_pixel_interface.h"
+
+#define SCRIPT_FILENAME "headless_pixel_interface_test.script"
+#define DUMP_FILENAME "headless_pixel_interface_test.ppm"
+
+static int nof_failures = 0;
+
+
+static void check(bool condition, char *description) {
+  if (condition == false) {
+    printf("FAILED: %s\n", description);
+    nof_failures++;
+  }
+}
+
+
+static void check_event(struct z_screen_pixel_interface *screen,
+    int timeout_millis, int expected_event_type, z_ucs expected_input,
+    char *description) {
+  z_ucs input = 0;
+  int event_type = screen->get_next_event(&input, timeout_millis, false,
+      false);
+
+  if ( (event_type != expected_event_type)
+      || ( (event_type == EVENT_WAS_INPUT) && (input != expected_input) ) ) {
+    printf("FAILED: %s (event %d, input %d)\n",
+        description, event_type, (int)input);
+    nof_failures++;
+  }
+}
+
+
+// Returns true in case the dump's header and first pixel are as expected.
+static bool check_dump(int width, int height, uint8_t red) {
+  FILE *in;
+  int dump_width, dump_height, max_value;
+  uint8_t pixel[3];
+  bool result = false;
+
+  if ((in = fopen(DUMP_FILENAME, "rb")) == NULL) {
+    return false;
+  }
+
+  if ( (fscanf(in, "P6 %d %d %d", &dump_width, &dump_height, &max_value)
+        == 3)
+      && (fgetc(in) == '\n')
+      && (fread(pixel, 1, 3, in) == 3) ) {
+    result
+      = (dump_width == width)
+      && (dump_height == height)
+      && (max_value == 255)
+      && (pixel[0] == red);
+  }
+
+  fclose(in);
+  return result;
+}
+
+
+int main() {
+  struct z_screen_pixel_interface *screen = get_headless_pixel_interface();
+  FILE *script;
+  z_ucs input;
+  int width, height;
+
+  if ((script = fopen(SCRIPT_FILENAME, "w")) == NULL) {
+    printf("Could not write \"%s\".\n", SCRIPT_FILENAME);
+    return 1;
+  }
+  fputs("ab\n", script);
+  fputs("!resize 320 200\n", script);
+  fputs("!dump " DUMP_FILENAME "\n", script);
+  fputs("!key page-up\n", script);
+  fputs("!!x\xc3\xa4\n", script);
+  fputs("!resize 160 100\n", script);
+  fclose(script);
+
+  check(screen->parse_config_parameter(
+        "headless-script", strdup(SCRIPT_FILENAME)) == 0,
+      "loading the script");
+  check(screen->parse_config_parameter("no-such-option", NULL) == -2,
+      "rejecting unknown options");
+  screen->link_interface_to_story(NULL);
+
+  input = 0;
+  check( (screen->get_next_event(&input, 0, true, false) == EVENT_WAS_INPUT)
+      && (input == 'a'), "polling returns the first input char");
+  check_event(screen, 100, EVENT_WAS_INPUT, 'b', "timed wait returns input");
+  check_event(screen, 0, EVENT_WAS_INPUT, Z_UCS_NEWLINE, "end of line");
+
+  // Coalescing a resize: the timed wait must not run the dump before the
+  // screen has been redrawn.
+  check_event(screen, 0, EVENT_WAS_WINCH, 0, "resize");
+  get_headless_framebuffer(&width, &height);
+  check( (width == 320) && (height == 200), "framebuffer resized");
+  check(screen->get_next_event(&input, 0, true, false) == EVENT_WAS_NOTHING,
+      "polling after resize returns nothing");
+  check_event(screen, 100, EVENT_WAS_TIMEOUT, 0, "timed wait after resize");
+  remove(DUMP_FILENAME);
+  screen->fill_area(0, 0, width, height, 0xff, 0, 0);
+  screen->update_screen();
+
+  check_event(screen, 0, EVENT_WAS_CODE_PAGE_UP, 0, "key after dump");
+  check(check_dump(320, 200, 0xff) == true, "dump shows redrawn screen");
+  check_event(screen, 0, EVENT_WAS_INPUT, '!', "escaped '!'");
+  check_event(screen, 0, EVENT_WAS_INPUT, 'x', "char after escaped '!'");
+  check_event(screen, 0, EVENT_WAS_INPUT, 0xe4, "UTF-8 input");
+  check_event(screen, 0, EVENT_WAS_INPUT, Z_UCS_NEWLINE, "end of line");
+
+  // A resize at the end of the script must not make coalescing report
+  // the end of the queue.
+  check_event(screen, 0, EVENT_WAS_WINCH, 0, "final resize");
+  check_event(screen, 100, EVENT_WAS_TIMEOUT, 0, "timed wait at end");
+  screen->update_screen();
+  check(screen->get_next_event(&input, 0, true, false) == EVENT_WAS_NOTHING,
+      "polling at end of script returns nothing");
+  check_event(screen, 0, EVENT_WAS_QUIT, 0, "end of script");
+
+  free_headless_pixel_interface();
+  remove(SCRIPT_FILENAME);
+  remove(DUMP_FILENAME);
+
+  if (nof_failures > 0) {
+    printf("%d checks failed.\n", nof_failures);
+    return 1;
+  }
+
+  printf("All checks passed.\n");
+  return 0;
+}